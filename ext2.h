@@ -18,8 +18,9 @@
 #ifndef CSC369_EXT2_FS_H
 #define CSC369_EXT2_FS_H
 
-/* The ext2 block size used in the assignment. */
-#define EXT2_BLOCK_SIZE 1024
+/* Block sizes are 1024 << s_log_block_size, 1024 is the smallest. */
+#define EXT2_MIN_BLOCK_SIZE 1024
+#define EXT2_BLOCK_SIZE(s) (EXT2_MIN_BLOCK_SIZE << (s)->s_log_block_size)
 
 /*
  * Structure of the super block
@@ -103,6 +104,11 @@ struct ext2_super_block {
 	unsigned int   s_reserved[190]; /* Padding to the end of the block */
 };
 
+/*
+ * Compatible feature set flags
+ */
+#define    EXT2_FEATURE_COMPAT_DIR_PREALLOC  0x0001
+
 
 /*
  * Structure of a blocks group descriptor
@@ -154,6 +160,12 @@ struct ext2_inode {
 	unsigned int   extra[3];
 };
 
+/*
+ * Symlink targets shorter than this are stored inline in i_block, with
+ * i_blocks set to 0 ("fast" symlinks).
+ */
+#define EXT2_FAST_SYMLINK_LEN (15 * sizeof(unsigned int))
+
 
 /*
  * Type field for file mode
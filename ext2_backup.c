@@ -0,0 +1,284 @@
+/*
+ * Takes three arguments to back up:
+ * First: the name of an ext2 formatted disk.
+ * Second: the manifest left by the previous backup of that disk. It does not
+ *         have to exist for the first one, which then has every block.
+ * Third: the file to write the stream of changed blocks to, - for stdout.
+ *
+ * or, with -a, two arguments to apply a backup:
+ * First: the name of the disk to bring up to date, created if it does not
+ *        exist. It must be where the previous backup left it.
+ * Second: a stream written by a backup, - for stdin.
+ *
+ * A backup hashes every block allocated in the disk and compares the hashes
+ * with the ones in the manifest. Only the blocks whose hash changed go into
+ * the stream, and the manifest is then replaced with the new hashes. Free
+ * blocks are never read and are recorded with hash 0, so one that is
+ * allocated again is always sent. Applying the streams in order to an empty
+ * disk gives back the disk as it was at the last backup.
+ */
+
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include "ext2.h"
+#include<errno.h>
+#include "ext2_utils.c"
+
+#define BACKUP_MAGIC 0x4b423245     // "E2BK"
+#define MANIFEST_MAGIC 0x464d3245   // "E2MF"
+#define BACKUP_END 0xffffffff       // Block number ending a stream
+#define OUT_SIZE (1 << 20)
+#define PREFETCH_WINDOW 64          // Blocks read ahead of the one hashed
+
+/* Starts both the manifest and the stream. */
+struct backup_header {
+	unsigned int magic;
+	unsigned int block_size;
+	unsigned int blocks_count;
+	unsigned int changed;   // Blocks in the stream, 0 in a manifest
+};
+
+unsigned char *disk;
+unsigned int bs;
+
+/* Output, buffered so a stream of small blocks is written in large writes. */
+unsigned char *out;
+size_t out_len = 0;
+int out_fd;
+
+/* HELPERS */
+
+/* Appends len bytes at data to the output, writing it out when full. */
+void out_bytes(const void *data, size_t len) {
+	if (out_len + len > OUT_SIZE) {
+		if (write_all(out_fd, out, out_len) == -1) {
+			perror("write");
+			exit(1);
+		}
+		out_len = 0;
+	}
+	memcpy(out + out_len, data, len);
+	out_len += len;
+}
+
+/* Reads exactly len bytes from fd into buf. Returns 0 on success, -1 on error
+ * or end of file.
+ */
+int read_all(int fd, void *buf, size_t len) {
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Returns 1 if block is allocated, counting the blocks before the first data
+ * block, which no bitmap covers, as allocated.
+ */
+int block_allocated(unsigned int block) {
+	struct ext2_super_block *sb = get_super(disk);
+	return block < sb->s_first_data_block || block_in_use(disk, block);
+}
+
+/* Starts reading the allocated blocks among the window from first. */
+void prefetch_window(unsigned int first) {
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int blocks[PREFETCH_WINDOW], block;
+	int n = 0;
+	for (block = first; block < first + PREFETCH_WINDOW && block < sb->s_blocks_count; block++) {
+		if (block_allocated(block)) {
+			blocks[n++] = block;
+		}
+	}
+	prefetch_blocks(disk, blocks, n);
+	release_blocks();
+}
+
+/* Reads the manifest at path into hashes, leaving them 0 if there is none.
+ * Exits if it is for a disk of another size.
+ */
+void read_manifest(char *path, uint64_t *hashes, struct backup_header *want) {
+	struct backup_header header;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			return;
+		}
+		perror(path);
+		exit(1);
+	}
+	if (read_all(fd, &header, sizeof(header)) == -1 || header.magic != MANIFEST_MAGIC ||
+			header.block_size != want->block_size || header.blocks_count != want->blocks_count ||
+			read_all(fd, hashes, (size_t)header.blocks_count * sizeof(uint64_t)) == -1) {
+		fprintf(stderr, "'%s' is not a manifest for this disk.\n", path);
+		exit(EINVAL);
+	}
+	close(fd);
+}
+
+/* Backs up disk against the manifest, writing the stream to stream_path.
+ * The new manifest replaces the old one only once the stream is safely out.
+ */
+int backup(char *manifest, char *stream_path) {
+	struct ext2_super_block *sb = get_super(disk);
+	struct backup_header header = {BACKUP_MAGIC, bs, sb->s_blocks_count, 0};
+	uint64_t *hashes = calloc(sb->s_blocks_count, sizeof(uint64_t));
+	unsigned int block, end = BACKUP_END;
+	read_manifest(manifest, hashes, &header);
+
+	out_fd = strcmp(stream_path, "-") == 0 ? STDOUT_FILENO :
+		open(stream_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd == -1) {
+		perror(stream_path);
+		exit(1);
+	}
+	// The count of changed blocks is only known at the end, so the header
+	// goes out with 0 and is rewritten if the stream is a file.
+	out_bytes(&header, sizeof(header));
+	double start = trace_begin();
+	for (block = 0; block < sb->s_blocks_count; block++) {
+		uint64_t hash = 0;
+		// Keep the next window's reads in flight while this one is hashed
+		if (block % PREFETCH_WINDOW == 0) {
+			if (block == 0) {
+				prefetch_window(0);
+			}
+			prefetch_window(block + PREFETCH_WINDOW);
+		}
+		if (block_allocated(block)) {
+			hash = hash_block(get_block(disk, block), bs);
+		}
+		if (hash != 0 && hash != hashes[block]) {
+			out_bytes(&block, sizeof(block));
+			out_bytes(get_block(disk, block), bs);
+			stats.bytes_copied += bs;
+			header.changed++;
+		}
+		hashes[block] = hash;
+		release_blocks();
+	}
+	trace_end("hash blocks", start);
+	out_bytes(&end, sizeof(end));
+	if (write_all(out_fd, out, out_len) == -1 ||
+			(out_fd != STDOUT_FILENO && (pwrite(out_fd, &header, sizeof(header), 0) != sizeof(header) ||
+			fsync(out_fd) == -1))) {
+		perror(stream_path);
+		exit(1);
+	}
+
+	// Write the new manifest next to the old one and rename it over
+	char tmp[strlen(manifest) + 5];
+	sprintf(tmp, "%s.new", manifest);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	header.magic = MANIFEST_MAGIC;
+	int changed = header.changed;
+	header.changed = 0;
+	if (fd == -1 || write_all(fd, &header, sizeof(header)) == -1 ||
+			write_all(fd, hashes, (size_t)sb->s_blocks_count * sizeof(uint64_t)) == -1 ||
+			fsync(fd) == -1 || close(fd) == -1 || rename(tmp, manifest) == -1) {
+		perror(manifest);
+		exit(1);
+	}
+	fprintf(stderr, "%d of %u blocks changed\n", changed, sb->s_blocks_count);
+	return 0;
+}
+
+/* Applies the stream at stream_path to the disk named name, creating it if
+ * need be.
+ */
+int apply(char *name, char *stream_path) {
+	struct backup_header header;
+	int in = strcmp(stream_path, "-") == 0 ? STDIN_FILENO : open(stream_path, O_RDONLY);
+	if (in == -1 || read_all(in, &header, sizeof(header)) == -1 || header.magic != BACKUP_MAGIC) {
+		fprintf(stderr, "'%s' is not a backup stream.\n", stream_path);
+		exit(EINVAL);
+	}
+	int fd = open(name, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	off_t size = (off_t)header.block_size * header.blocks_count;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(name);
+		exit(ENOENT);
+	}
+	if (st.st_size == 0 && ftruncate(fd, size) == -1) {
+		perror(name);
+		exit(1);
+	} else if (st.st_size != 0 && st.st_size != size) {
+		fprintf(stderr, "'%s' is not the size of the backed up disk.\n", name);
+		exit(EINVAL);
+	}
+	// Blocks are written straight to the image, it is never mapped
+	mapped_fd = fd;
+	lock_image(1);
+	double start = trace_begin();
+	unsigned char *data = malloc(header.block_size);
+	unsigned int block;
+	while (read_all(in, &block, sizeof(block)) == 0 && block != BACKUP_END) {
+		if (block >= header.blocks_count || read_all(in, data, header.block_size) == -1) {
+			fprintf(stderr, "'%s' is truncated or corrupt.\n", stream_path);
+			exit(EINVAL);
+		}
+		if (pwrite(fd, data, header.block_size, (off_t)block * header.block_size) != header.block_size) {
+			perror(name);
+			exit(1);
+		}
+		stats.bytes_copied += header.block_size;
+	}
+	if (block != BACKUP_END) {
+		fprintf(stderr, "'%s' is truncated.\n", stream_path);
+		exit(EINVAL);
+	}
+	trace_end("apply blocks", start);
+	if (fsync(fd) == -1) {
+		perror(name);
+		exit(1);
+	}
+	return 0;
+}
+
+/* MAIN */
+int main(int argc, char **argv) {
+	parse_common_flags(&argc, argv);
+	int opt, bad = 0, applying = 0;
+	while ((opt = getopt(argc, argv, "a")) != -1) {
+		switch (opt) {
+			case 'a':
+				applying = 1;
+				break;
+			default:
+				bad = 1;
+		}
+	}
+	if (bad || optind != argc - (applying ? 2 : 3)) {
+		fprintf(stderr, "Usage: %s [--stats] [--trace file] [disk] [manifest] [stream]\n"
+				"       %s [--stats] [--trace file] -a [disk] [stream]\n", argv[0], argv[0]);
+		exit(1);
+	}
+	if (applying) {
+		return apply(argv[optind], argv[optind + 1]);
+	}
+	// Opening disk
+	int fd = open(argv[optind], O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "Disk image '%s' not found.\n", argv[optind]);
+		exit(ENOENT);
+	}
+	disk = map_disk(fd);
+	// Writers wait until the blocks are all hashed and copied out
+	lock_image(0);
+	bs = get_block_size(disk);
+	out = malloc(OUT_SIZE);
+	return backup(argv[optind + 1], argv[optind + 2]);
+}
@@ -0,0 +1,326 @@
+/*
+ * End-to-end benchmark for the ext2_* tools.
+ *
+ * Builds a fresh image with the requested geometry, fills it with a
+ * directory fan-out and a set of files, optionally fragments the free space,
+ * then times every tool one process per operation, just like a script would
+ * run them. Reports ops/sec, MB/s and p50/p99 latency per operation as CSV
+ * or JSON. Exits with 1, after a warning, if any operation failed or the
+ * checker had to repair the image they left.
+ *
+ * Usage: ext2_bench [-b blocks] [-B block size] [-i inodes] [-n files] [-f fan-out] [-F holes]
+ *                   [-s small KiB] [-l large KiB] [-L large files] [-c checks]
+ *                   [-d tool dir] [-w work dir] [-o csv|json]
+ */
+
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<sys/wait.h>
+#include<fcntl.h>
+#include<time.h>
+#include<errno.h>
+
+/* Benchmark configuration, overridden from the command line. */
+struct bench_config {
+	int blocks;       // Image size in KiB
+	int block_size;   // Block size of the image
+	int inodes;       // Inodes in the image
+	int files;        // Small files to copy
+	int fanout;       // Directories the small files are spread over
+	int holes;        // Filler files removed again to fragment free space
+	int small_kb;     // Size of each small file
+	int large_kb;     // Size of each large file
+	int large_files;  // Large files to copy
+	int checks;       // ext2_checker runs
+	char *tool_dir;   // Where the ext2_* binaries live
+	char *work_dir;   // Where the image and source files are written
+	int json;         // JSON output instead of CSV
+};
+
+/* Latencies and totals collected for one kind of operation. */
+struct bench_op {
+	char *name;
+	int ops;
+	int failures;
+	long long bytes;  // Payload bytes moved, for MB/s
+	double total_ms;
+	double *lat_ms;
+	int cap;
+};
+
+struct bench_config cfg = {128, 1024, 32, 8, 2, 0, 1, 16, 1, 5, ".", "/tmp", 0};
+char image[4096];
+char small_src[4096];
+char large_src[4096];
+
+/* HELPERS */
+
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Runs argv to completion with its output going to the file out, or
+ * discarded if out is NULL.
+ * Returns the wall time in milliseconds, the exit status goes in status.
+ */
+double run(char **argv, int *status, char *out) {
+	double start = now_ms();
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		int fd = out != NULL ? open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644) : null;
+		dup2(fd, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	int wstatus;
+	waitpid(pid, &wstatus, 0);
+	*status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128;
+	return now_ms() - start;
+}
+
+/* Runs the ext2_* tool name with up to three arguments after the image,
+ * recording the latency in op when op is not NULL.
+ */
+int run_tool(struct bench_op *op, char *name, char *a1, char *a2, char *a3, long long bytes) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", cfg.tool_dir, name);
+	char *argv[6] = {path, NULL, NULL, NULL, NULL, NULL};
+	int argc = 1;
+	if (a1 != NULL && strcmp(a1, "-s") == 0) { // Flags go before the image
+		argv[argc++] = a1;
+		a1 = a2;
+		a2 = a3;
+		a3 = NULL;
+	}
+	argv[argc++] = image;
+	if (a1 != NULL) argv[argc++] = a1;
+	if (a2 != NULL) argv[argc++] = a2;
+	if (a3 != NULL) argv[argc++] = a3;
+
+	int status;
+	double ms = run(argv, &status, NULL);
+	if (op == NULL) {
+		return status;
+	}
+	if (op->ops == op->cap) {
+		op->cap = op->cap ? op->cap * 2 : 64;
+		op->lat_ms = realloc(op->lat_ms, sizeof(double) * op->cap);
+	}
+	op->lat_ms[op->ops++] = ms;
+	op->total_ms += ms;
+	if (status != 0) {
+		op->failures++;
+	} else {
+		op->bytes += bytes;
+	}
+	return status;
+}
+
+/* Writes a file of kb KiB of pseudo-random data to path. */
+void write_source(char *path, int kb) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	int i;
+	srand(kb);
+	for (i = 0; i < kb * 1024; i++) {
+		fputc(rand() & 0xff, f);
+	}
+	fclose(f);
+}
+
+/* Creates an empty image of the configured geometry with ext2_mkfs. */
+void make_image() {
+	char path[4096], blocks[32], block_size[32], inodes[32];
+	snprintf(path, sizeof(path), "%s/ext2_mkfs", cfg.tool_dir);
+	snprintf(blocks, sizeof(blocks), "%d", cfg.blocks);
+	snprintf(block_size, sizeof(block_size), "%d", cfg.block_size);
+	snprintf(inodes, sizeof(inodes), "%d", cfg.inodes);
+	char *argv[] = {path, "-b", block_size, "-N", inodes, image, blocks, NULL};
+	int status;
+	run(argv, &status, NULL);
+	if (status != 0) {
+		fprintf(stderr, "Could not create image '%s'.\n", image);
+		exit(1);
+	}
+}
+
+/* Runs ext2_checker on the image, before any timed run repairs it.
+ * Returns 1 if it found nothing to fix.
+ */
+int check_image() {
+	char path[4096], out[4096], line[256];
+	snprintf(path, sizeof(path), "%s/ext2_checker", cfg.tool_dir);
+	snprintf(out, sizeof(out), "%s/bench-%d.check", cfg.work_dir, getpid());
+	char *argv[] = {path, image, NULL};
+	int status, clean = 0;
+	run(argv, &status, out);
+	FILE *f = fopen(out, "r");
+	while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		clean = strncmp(line, "No file system inconsistencies", 30) == 0;
+	}
+	if (f != NULL) fclose(f);
+	unlink(out);
+	return status == 0 && clean;
+}
+
+int compare_double(const void *a, const void *b) {
+	double x = *(double *)a, y = *(double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Returns the p-th percentile (0 < p <= 1) of op's latencies. */
+double percentile(struct bench_op *op, double p) {
+	if (op->ops == 0) {
+		return 0;
+	}
+	int idx = (int)(p * op->ops + 0.999999) - 1;
+	if (idx < 0) idx = 0;
+	return op->lat_ms[idx];
+}
+
+void report(struct bench_op *ops, int n) {
+	int i;
+	if (cfg.json) {
+		printf("{\"config\": {\"blocks\": %d, \"block_size\": %d, \"inodes\": %d, \"files\": %d, \"fanout\": %d, "
+				"\"holes\": %d, \"small_kb\": %d, \"large_kb\": %d, \"large_files\": %d},\n"
+				" \"results\": [\n", cfg.blocks, cfg.block_size, cfg.inodes, cfg.files, cfg.fanout,
+				cfg.holes, cfg.small_kb, cfg.large_kb, cfg.large_files);
+	} else {
+		printf("op,ops,failures,total_ms,ops_per_sec,mb_per_sec,p50_ms,p99_ms\n");
+	}
+	for (i = 0; i < n; i++) {
+		struct bench_op *op = &ops[i];
+		qsort(op->lat_ms, op->ops, sizeof(double), compare_double);
+		double secs = op->total_ms / 1000.0;
+		double ops_sec = secs > 0 ? op->ops / secs : 0;
+		double mb_sec = secs > 0 ? op->bytes / (1024.0 * 1024.0) / secs : 0;
+		if (cfg.json) {
+			printf("  {\"op\": \"%s\", \"ops\": %d, \"failures\": %d, \"total_ms\": %.3f, "
+					"\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f}%s\n",
+					op->name, op->ops, op->failures, op->total_ms, ops_sec, mb_sec,
+					percentile(op, 0.5), percentile(op, 0.99), i == n - 1 ? "" : ",");
+		} else {
+			printf("%s,%d,%d,%.3f,%.1f,%.3f,%.3f,%.3f\n", op->name, op->ops, op->failures,
+					op->total_ms, ops_sec, mb_sec, percentile(op, 0.5), percentile(op, 0.99));
+		}
+	}
+	if (cfg.json) {
+		printf(" ]}\n");
+	}
+}
+
+/* MAIN */
+
+int main(int argc, char **argv) {
+	int c;
+	while ((c = getopt(argc, argv, "b:B:i:n:f:F:s:l:L:c:d:w:o:")) != -1) {
+		switch (c) {
+			case 'b': cfg.blocks = atoi(optarg); break;
+			case 'B': cfg.block_size = atoi(optarg); break;
+			case 'i': cfg.inodes = atoi(optarg); break;
+			case 'n': cfg.files = atoi(optarg); break;
+			case 'f': cfg.fanout = atoi(optarg); break;
+			case 'F': cfg.holes = atoi(optarg); break;
+			case 's': cfg.small_kb = atoi(optarg); break;
+			case 'l': cfg.large_kb = atoi(optarg); break;
+			case 'L': cfg.large_files = atoi(optarg); break;
+			case 'c': cfg.checks = atoi(optarg); break;
+			case 'd': cfg.tool_dir = optarg; break;
+			case 'w': cfg.work_dir = optarg; break;
+			case 'o': cfg.json = strcmp(optarg, "json") == 0; break;
+			default:
+				fprintf(stderr, "Usage: %s [-b blocks] [-B block size] [-i inodes] [-n files] [-f fan-out] "
+						"[-F holes] [-s small KiB] [-l large KiB] [-L large files] [-c checks] "
+						"[-d tool dir] [-w work dir] [-o csv|json]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (cfg.fanout < 1) cfg.fanout = 1;
+	snprintf(image, sizeof(image), "%s/bench-%d.img", cfg.work_dir, getpid());
+	snprintf(small_src, sizeof(small_src), "%s/bench-%d.small", cfg.work_dir, getpid());
+	snprintf(large_src, sizeof(large_src), "%s/bench-%d.large", cfg.work_dir, getpid());
+	make_image();
+	write_source(small_src, cfg.small_kb);
+	write_source(large_src, cfg.large_kb);
+
+	enum {MKDIR, CP_SMALL, CP_LARGE, LN, LN_S, RM, RESTORE, CHECKER, NOPS};
+	struct bench_op ops[NOPS] = {
+		{"mkdir"}, {"cp_small"}, {"cp_large"}, {"ln"}, {"ln_s"}, {"rm"}, {"restore"}, {"checker"}
+	};
+	char path[512], link[512];
+	int i;
+
+	for (i = 0; i < cfg.fanout; i++) {
+		snprintf(path, sizeof(path), "/d%d", i);
+		run_tool(&ops[MKDIR], "ext2_mkdir", path, NULL, NULL, 0);
+	}
+	// Fragment free space: fill it with interleaved filler files and drop every other one.
+	for (i = 0; i < cfg.holes; i++) {
+		snprintf(path, sizeof(path), "/hole%d", i);
+		run_tool(NULL, "ext2_cp", small_src, path, NULL, 0);
+	}
+	for (i = 0; i < cfg.holes; i += 2) {
+		snprintf(path, sizeof(path), "/hole%d", i);
+		run_tool(NULL, "ext2_rm", path, NULL, NULL, 0);
+	}
+	for (i = 0; i < cfg.files; i++) {
+		snprintf(path, sizeof(path), "/d%d/f%d", i % cfg.fanout, i);
+		run_tool(&ops[CP_SMALL], "ext2_cp", small_src, path, NULL, cfg.small_kb * 1024LL);
+	}
+	for (i = 0; i < cfg.large_files; i++) {
+		snprintf(path, sizeof(path), "/big%d", i);
+		run_tool(&ops[CP_LARGE], "ext2_cp", large_src, path, NULL, cfg.large_kb * 1024LL);
+	}
+	// Even files get a hard link and a symlink, odd ones are removed and restored.
+	for (i = 0; i < cfg.files; i += 2) {
+		snprintf(path, sizeof(path), "/d%d/f%d", i % cfg.fanout, i);
+		snprintf(link, sizeof(link), "/d%d/l%d", i % cfg.fanout, i);
+		run_tool(&ops[LN], "ext2_ln", path, link, NULL, 0);
+		snprintf(link, sizeof(link), "/d%d/s%d", i % cfg.fanout, i);
+		run_tool(&ops[LN_S], "ext2_ln", "-s", path, link, 0);
+	}
+	for (i = 1; i < cfg.files; i += 2) {
+		snprintf(path, sizeof(path), "/d%d/f%d", i % cfg.fanout, i);
+		run_tool(&ops[RM], "ext2_rm", path, NULL, NULL, 0);
+	}
+	for (i = 1; i < cfg.files; i += 2) {
+		snprintf(path, sizeof(path), "/d%d/f%d", i % cfg.fanout, i);
+		run_tool(&ops[RESTORE], "ext2_restore", path, NULL, NULL, 0);
+	}
+	int clean = check_image();
+	for (i = 0; i < cfg.checks; i++) {
+		run_tool(&ops[CHECKER], "ext2_checker", NULL, NULL, NULL, 0);
+	}
+
+	report(ops, NOPS);
+	int failures = 0;
+	for (i = 0; i < NOPS; i++) {
+		failures += ops[i].failures;
+		free(ops[i].lat_ms);
+	}
+	if (failures > 0) {
+		fprintf(stderr, "Warning: %d operations failed.\n", failures);
+	}
+	if (!clean) {
+		fprintf(stderr, "Warning: ext2_checker found inconsistencies in the image.\n");
+	}
+	unlink(image);
+	unlink(small_src);
+	unlink(large_src);
+	return failures > 0 || !clean;
+}
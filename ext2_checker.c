@@ -5,6 +5,20 @@
  * The program should implement a lightweight file system checker, which
  * detects a small subset of possible file system inconsistencies and takes
  * actions to fix them.
+ *
+ * Link counts are checked by counting the directory entries that refer to
+ * every inode, "." and ".." included, over all the directories' blocks at
+ * once, shared out among threads. An in-use inode no entry refers to keeps
+ * its count, rather than being given one of 0.
+ *
+ * With --verify-fast, the metadata blocks are first checked against the
+ * CRC32C sidecar (disk.crc) the writing tools keep up to date, and only the
+ * checks covering blocks whose checksum does not match are run: the bitmap
+ * scan for the superblock, group descriptors and bitmaps, the directory scan
+ * of a directory for its blocks, and the whole directory scan for the inode
+ * tables, since any entry may point into them. The link counts are checked
+ * if any directory block or inode table changed. The sidecar is created, after
+ * a full check, if there is none, and refreshed after every check.
  */
 
 #include<stdio.h>
@@ -19,43 +33,58 @@
 #include<errno.h>
 #include "ext2_utils.c"
 
+#define PREFETCH_WINDOW 32  // Blocks read ahead of the scan
+#define LINK_MAX_THREADS 16 // Threads counting directory entries
+
 unsigned char *disk;
 struct ext2_super_block *sb;
 struct ext2_group_desc *desc;
+int errors = 0; // Total number of errors fixed, increment for every fix.
+unsigned int bs;
 
-/* MAIN */
-int main(int argc, char **argv) {
-	if (argc != 2) { // Requires only one argument, an ext2 formatted disk.
-		fprintf(stderr, "Usage: %s [disk]\n", argv[0]);
-		exit(1);
-	}
-	// Opening disk
-	int fd = open(argv[1], O_RDWR);
-	if (!fd) {
-		fprintf(stderr, "Disk image '%s' not found.", argv[1]);
-		exit(ENOENT);
-	}
-	// mmap the disk
-	disk = mmap(NULL, 128*1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (disk == MAP_FAILED) {
-		perror("mmap");
-		exit(1);
-	}
-	// Grabbing super block and block descriptor
-	sb = (struct ext2_super_block *)(disk + 1024);
-	desc = (struct ext2_group_desc *)(disk + 2*1024);
+/* What --verify-fast found changed since the sidecar was last updated. */
+struct mismatches {
+	uint32_t *crcs;         // Checksums from the sidecar
+	int super;              // Superblock, group descriptors or bitmaps
+	int tables;             // Inode tables
+	unsigned char *dirs;    // Bitmap of directories with changed blocks
+	int dir_blocks;         // Directory blocks changed
+	int count;
+};
+
+/* The directory blocks the link count pass reads, taken by its threads a
+ * window at a time.
+ */
+struct link_count {
+	unsigned int *blocks;
+	unsigned int nblocks;
+	unsigned int next;      // First block no thread has taken yet
+	unsigned short *refs;   // Entries referring to each inode, by index
+};
 
-	int errors = 0; // Total number of errors fixed, increment for every fix.
-	// Allocating the bitmaps.
-	unsigned char *map = (unsigned char *)(disk + 1024 * desc->bg_block_bitmap);
-	unsigned char *imap = (unsigned char *)(disk + 1024 * desc->bg_inode_bitmap);
+/* HELPERS */
 
-	// Count the free blocks based on the bitmap.
-	int free = sb->s_blocks_count; // Total number of blocks.
+/* Checks the free counters in the superblock and group descriptors against
+ * the bitmaps.
+ */
+void check_bitmaps() {
+	// Count the free blocks based on each group's bitmap.
+	double start = trace_begin();
+	unsigned int g, groups = get_group_count(disk);
+	int free = 0; // Free blocks over all groups.
 	int diff; // Value to allocate the difference if there is one.
 	int i;
-	for (i = 0; i < sb->s_blocks_count; i++) {
-		if (check_node(i, map)) free--;
+	int group_free[groups];
+	for (g = 0; g < groups; g++) {
+		struct ext2_group_desc *gd = get_group_desc(disk, g);
+		unsigned char *map = get_block(disk, gd->bg_block_bitmap);
+		int n = sb->s_blocks_count - sb->s_first_data_block - g * sb->s_blocks_per_group;
+		if (n > sb->s_blocks_per_group) n = sb->s_blocks_per_group;
+		group_free[g] = n;
+		for (i = 0; i < n; i++) {
+			if (check_node(i, map)) group_free[g]--;
+		}
+		free += group_free[g];
 	}
 	// Check free versus the counts in sb and desc.
 	// Block bitmap vs superblock
@@ -67,17 +96,26 @@ int main(int argc, char **argv) {
 		errors += diff;
 	}
 	// Block bitmap vs group descriptor
-	if (free != desc->bg_free_blocks_count) {
-		diff = abs(desc->bg_free_blocks_count - free);
-		printf("Fixed: block group's free block counter was off by %d compared to the bitmap\n",
-					diff);
-		desc->bg_free_blocks_count = free;
-		errors += diff;
+	for (g = 0; g < groups; g++) {
+		struct ext2_group_desc *gd = get_group_desc(disk, g);
+		if (group_free[g] != gd->bg_free_blocks_count) {
+			diff = abs(gd->bg_free_blocks_count - group_free[g]);
+			printf("Fixed: block group's free block counter was off by %d compared to the bitmap\n",
+						diff);
+			gd->bg_free_blocks_count = group_free[g];
+			errors += diff;
+		}
 	}
-	// Reset free for the inode bitmap, loop through.
-	free = sb->s_inodes_count;
-	for (i = 0; i < sb->s_inodes_count; i++) {
-		if (check_node(i, imap)) free--;
+	// Reset free for the inode bitmaps, loop through.
+	free = 0;
+	for (g = 0; g < groups; g++) {
+		struct ext2_group_desc *gd = get_group_desc(disk, g);
+		unsigned char *imap = get_block(disk, gd->bg_inode_bitmap);
+		group_free[g] = sb->s_inodes_per_group;
+		for (i = 0; i < sb->s_inodes_per_group; i++) {
+			if (check_node(i, imap)) group_free[g]--;
+		}
+		free += group_free[g];
 	}
 	// Check free versus the counts in sb and desc.
 	// Inode bitmap vs superblock
@@ -89,75 +127,297 @@ int main(int argc, char **argv) {
 		errors += diff;
 	}
 	// Inode bitmap vs group desc
-	if (free != desc->bg_free_inodes_count) {
-		diff = abs(desc->bg_free_inodes_count - free);
-		printf("Fixed: block group's free inode counter was off by %d compared to the bitmap\n",
-					diff);
-		desc->bg_free_inodes_count = free;
-		errors += diff;
+	for (g = 0; g < groups; g++) {
+		struct ext2_group_desc *gd = get_group_desc(disk, g);
+		if (group_free[g] != gd->bg_free_inodes_count) {
+			diff = abs(gd->bg_free_inodes_count - group_free[g]);
+			printf("Fixed: block group's free inode counter was off by %d compared to the bitmap\n",
+						diff);
+			gd->bg_free_inodes_count = group_free[g];
+			errors += diff;
+		}
 	}
 
-	// Check each directory entry for matching file type with its inode.
-	// Straight from readimage to get directory blocks.
-	struct ext2_inode *curinode;
+	trace_end("bitmap scan", start);
+}
+
+/* Starts reading the inode table blocks of the entries in a directory block,
+ * before they are checked one by one.
+ */
+void prefetch_entries(unsigned char *block) {
+	unsigned int blocks[PREFETCH_WINDOW], offset;
+	int n = 0;
+	for (offset = 0; offset < bs && n < PREFETCH_WINDOW; ) {
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+		if (entry->rec_len == 0) {
+			break;
+		}
+		offset += entry->rec_len;
+		if (entry->inode != 0 && entry->inode <= sb->s_inodes_count) {
+			unsigned int table_block = inode_table_block(disk, entry->inode - 1);
+			if (n == 0 || blocks[n - 1] != table_block) {
+				blocks[n++] = table_block;
+			}
+		}
+	}
+	prefetch_blocks(disk, blocks, n);
+}
+
+/* Marks block in use if it is not, counting it in the int at arg. */
+void mark_unmarked(unsigned int block, void *arg) {
+	if (!block_in_use(disk, block)) {
+		(*(int *)arg)++;
+		mark_block(disk, block, 1);
+	}
+}
+
+/* Checks every entry of the directory at index i against the inode it
+ * points to.
+ */
+void check_directory(int i) {
+	struct ext2_inode *curinode = get_inode(disk, i);
 	struct ext2_inode *file_node;
-	for (i = 0; i < sb->s_inodes_count; i++) {
-		if ((check_node(i, imap) && (i == 1 || i >= 11)) || i == 1) {
-			curinode = (struct ext2_inode *)((disk + 1024 * desc->bg_inode_table) + (sb->s_inode_size * i));
-			if (get_inode_type(curinode) == 'd') {
-				// Looping through blocks to find ext2_dir_entry details
-				unsigned int cur_rec_len;
-				unsigned char file_type;
-				struct ext2_dir_entry *curdir;
-				int x; // Need some new loop integer since i is already in use.
-				for (x = 0; curinode->i_block[x] != 0; x++) {
-					for (cur_rec_len = 0; cur_rec_len < 1024; ) {
-						curdir = (struct ext2_dir_entry *)(disk + (1024 * curinode->i_block[x]) + cur_rec_len);
-						file_type = get_dir_type(curdir->file_type);
-						file_node = (struct ext2_inode *)((disk + 1024 * desc->bg_inode_table) +
-															(sb->s_inode_size * (curdir->inode-1)));
-						cur_rec_len += curdir->rec_len;
-						if (file_type != get_inode_type(file_node)) {
-							printf("Fixed: Entry type vs inode mismatch: inode %d\n", curdir->inode);
-							errors++;
-							set_dir_type(curdir, get_inode_type(file_node));
-						}
-
-						// Check that the directory's inode is allocated
-						if (!check_node(curdir->inode - 1, imap)) { // Inode is not allocated
-							errors++;
-							printf("Fixed: inode %d not marked as in-use\n", curdir->inode);
-							set_node(curdir->inode-1, imap);
-							adjust_free_inodes(-1, sb, desc);
-						}
-
-						// Check inodes i_dtime to be 0
-						if (file_node->i_dtime != 0) {
-							errors++;
-							printf("Fixed: valid inode marked for deletion: %d\n", curdir->inode);
-							file_node->i_dtime = 0;
-						}
-
-						// Check the directory's data blocks for allocation
-						int y; // Another random counter...
-						int block_counter = 0; // Counting amount of blocks not allocated.
-						for (y = 0; file_node->i_block[y] != 0; y++) {
-							if (!check_node(file_node->i_block[y] - 1, map)) {
-								block_counter++;
-								set_node(file_node->i_block[y] - 1, map);
-								adjust_free_blocks(-1, sb, desc);
-							}
-						}
-						if (block_counter > 0) {
-							errors++;
-							printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: %d\n",
-									block_counter, curdir->inode);
-						}	
-					}
+	// Looping through blocks to find ext2_dir_entry details
+	unsigned int cur_rec_len;
+	unsigned char file_type;
+	struct ext2_dir_entry *curdir;
+	unsigned int x, y, nblocks = dir_block_count(disk, curinode), block;
+	unsigned int window[PREFETCH_WINDOW];
+	for (x = 0; x < nblocks; x++) {
+		if (x % PREFETCH_WINDOW == 0) { // Read the directory's blocks a window at a time
+			for (y = 0; y < PREFETCH_WINDOW && x + y < nblocks; y++) {
+				window[y] = file_block(disk, curinode, x + y);
+			}
+			prefetch_blocks(disk, window, y);
+		}
+		if ((block = file_block(disk, curinode, x)) == 0) {
+			continue;
+		}
+		prefetch_entries(get_block(disk, block));
+		for (cur_rec_len = 0; cur_rec_len < bs; ) {
+			curdir = (struct ext2_dir_entry *)(get_block(disk, block) + cur_rec_len);
+			if (curdir->rec_len == 0) { // Corrupt block, nothing more to read
+				break;
+			}
+			cur_rec_len += curdir->rec_len;
+			if (curdir->inode == 0) { // Unused entry
+				continue;
+			}
+			file_type = get_dir_type(curdir->file_type);
+			file_node = get_inode(disk, curdir->inode - 1);
+			if (file_type != get_inode_type(file_node)) {
+				printf("Fixed: Entry type vs inode mismatch: inode %d\n", curdir->inode);
+				errors++;
+				set_dir_type(curdir, get_inode_type(file_node));
+			}
+
+			// Check that the directory's inode is allocated
+			if (!inode_in_use(disk, curdir->inode - 1)) { // Inode is not allocated
+				errors++;
+				printf("Fixed: inode %d not marked as in-use\n", curdir->inode);
+				mark_inode(disk, curdir->inode - 1, 1);
+			}
+
+			// Check inodes i_dtime to be 0
+			if (file_node->i_dtime != 0) {
+				errors++;
+				printf("Fixed: valid inode marked for deletion: %d\n", curdir->inode);
+				file_node->i_dtime = 0;
+				summary_update(disk, curdir->inode - 1);
+			}
+
+			// Check the data blocks for allocation, and the indirect blocks
+			int block_counter = 0; // Counting amount of blocks not allocated.
+			for_each_file_block(disk, file_node, mark_unmarked, &block_counter);
+			if (block_counter > 0) {
+				errors++;
+				printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: %d\n",
+						block_counter, curdir->inode);
+			}	
+		}
+	}
+}
+
+/* Compares the checksum of block with the sidecar's, noting what it covers
+ * if it has changed.
+ */
+void compare_block(unsigned int block, enum crc_kind kind, unsigned int index, void *arg) {
+	struct mismatches *m = arg;
+	if (block >= sb->s_blocks_count || crc32c(get_block(disk, block), bs) == m->crcs[block]) {
+		return;
+	}
+	m->count++;
+	if (kind == CRC_SUPER || kind == CRC_BITMAP) {
+		m->super = 1;
+	} else if (kind == CRC_TABLE) {
+		m->tables = 1;
+	} else {
+		set_node(index, m->dirs, 1);
+		m->dir_blocks++;
+	}
+}
+
+/* Counts the entries in the windows of directory blocks it takes from arg,
+ * a struct link_count, until there are none left.
+ */
+void *count_links(void *arg) {
+	struct link_count *lc = arg;
+	unsigned int first, k, n, offset;
+	while ((first = __atomic_fetch_add(&lc->next, PREFETCH_WINDOW, __ATOMIC_RELAXED)) < lc->nblocks) {
+		n = lc->nblocks - first < PREFETCH_WINDOW ? lc->nblocks - first : PREFETCH_WINDOW;
+		prefetch_blocks(disk, lc->blocks + first, n);
+		for (k = first; k < first + n; k++) {
+			unsigned char *block = get_block(disk, lc->blocks[k]);
+			for (offset = 0; offset + sizeof(struct ext2_dir_entry) <= bs; ) {
+				struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+				if (entry->rec_len == 0) { // Corrupt block, nothing more to read
+					break;
+				}
+				if (entry->inode != 0 && entry->inode <= sb->s_inodes_count) {
+					__atomic_fetch_add(&lc->refs[entry->inode - 1], 1, __ATOMIC_RELAXED);
 				}
+				offset += entry->rec_len;
+			}
+			release_blocks();
+		}
+	}
+	return NULL;
+}
+
+/* Sets the link count of every inode in use to the number of entries
+ * referring to it, if any do.
+ */
+void check_links(struct inode_summary *s) {
+	double start = trace_begin();
+	unsigned int first_ino = sb->s_rev_level == 0 ? EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+	struct link_count lc = {NULL, 0, 0, calloc(sb->s_inodes_count, sizeof(unsigned short))};
+	unsigned int cap = 0, i, n;
+	// List the blocks of every directory, then count them all in parallel
+	for (i = 0; i < sb->s_inodes_count; i++) {
+		if ((i != EXT2_ROOT_INO - 1 && i < first_ino - 1) || !S_ISDIR(s->mode[i]) ||
+				!inode_in_use(disk, i)) {
+			continue;
+		}
+		struct ext2_inode *ip = get_inode(disk, i);
+		unsigned int count = dir_block_count(disk, ip), block;
+		for (n = 0; n < count; n++) {
+			if ((block = file_block(disk, ip, n)) == 0 || block >= sb->s_blocks_count) {
+				continue;
+			}
+			if (lc.nblocks == cap) {
+				cap = cap ? cap * 2 : 1024;
+				lc.blocks = realloc(lc.blocks, cap * sizeof(unsigned int));
+			}
+			lc.blocks[lc.nblocks++] = block;
+		}
+		release_blocks();
+	}
+	long t, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > LINK_MAX_THREADS) nthreads = LINK_MAX_THREADS;
+	if (nthreads < 1) nthreads = 1;
+	pthread_t threads[nthreads];
+	for (t = 0; t < nthreads; t++) {
+		pthread_create(&threads[t], NULL, count_links, &lc);
+	}
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+
+	for (i = 0; i < sb->s_inodes_count; i++) {
+		if ((i != EXT2_ROOT_INO - 1 && i < first_ino - 1) || lc.refs[i] == 0 ||
+				lc.refs[i] == s->links[i] || !inode_in_use(disk, i)) {
+			continue;
+		}
+		errors++;
+		printf("Fixed: link count of inode %d was %d, should be %d\n", i + 1, s->links[i], lc.refs[i]);
+		get_inode(disk, i)->i_links_count = lc.refs[i];
+		summary_update(disk, i);
+	}
+	free(lc.blocks);
+	free(lc.refs);
+	trace_end("link count", start);
+}
+
+/* MAIN */
+int main(int argc, char **argv) {
+	parse_common_flags(&argc, argv);
+	// Take out --verify-fast wherever it is
+	int verify_fast = 0;
+	int a, b;
+	for (a = 1, b = 1; a < argc; a++) {
+		if (strcmp(argv[a], "--verify-fast") == 0) {
+			verify_fast = 1;
+		} else {
+			argv[b++] = argv[a];
+		}
+	}
+	argv[b] = NULL;
+	argc = b;
+	if (argc != 2) { // Requires only one argument, an ext2 formatted disk.
+		fprintf(stderr, "Usage: %s [--stats] [--trace file] [--verify-fast] [disk]\n", argv[0]);
+		exit(1);
+	}
+	// Opening disk
+	int fd = hold_fd(open(argv[1], O_RDWR));
+	if (!fd) {
+		fprintf(stderr, "Disk image '%s' not found.", argv[1]);
+		exit(ENOENT);
+	}
+	// mmap the whole disk
+	disk = map_disk(fd);
+	// The checker looks at and fixes everything, keep writers out until we exit
+	lock_image(1);
+	// Grabbing super block and block descriptor
+	sb = get_super(disk);
+	desc = get_group_desc(disk, 0);
+	bs = get_block_size(disk);
+	int i;
+
+	// With --verify-fast and a sidecar, only check what changed behind the
+	// tools' backs. Anything else gets the full check.
+	char *crc_file = hold_mem(crc_sidecar(argv[1]));
+	struct mismatches m = {NULL, 1, 1, NULL, 0, 0};
+	if (verify_fast && (m.crcs = hold_mem(read_checksums(disk, crc_file))) != NULL) {
+		double start = trace_begin();
+		m.super = m.tables = 0;
+		m.dirs = hold_mem(calloc(sb->s_inodes_count / 64 + 1, sizeof(uint64_t)));
+		for_each_metadata_block(disk, compare_block, &m);
+		trace_end("checksum verify", start);
+		if (m.count > 0) {
+			printf("Checksum mismatch in %d metadata blocks, checking them\n", m.count);
+		}
+	}
+
+	if (m.super) {
+		check_bitmaps();
+	}
+
+	// Check each directory entry for matching file type with its inode.
+	// The directories are found through the inode summary, which the
+	// checksum pass has already built if there was one.
+	struct inode_summary *s = inode_summary(disk);
+	double start = trace_begin();
+	for (i = 0; i < sb->s_inodes_count; i++) {
+		if (!m.tables && !check_node(i, m.dirs)) {
+			continue;
+		}
+		if ((inode_in_use(disk, i) && (i == 1 || i >= 11)) || i == 1) {
+			if (S_ISDIR(s->mode[i])) {
+				check_directory(i);
+				release_blocks();
 			}
 		}
 	}
+	trace_end("directory scan", start);
+
+	if (m.tables || m.dir_blocks > 0) {
+		check_links(s);
+	}
+
+	// The image is now what the sidecar should vouch for
+	if (verify_fast || access(crc_file, F_OK) == 0) {
+		rebuild_checksums(disk, crc_file);
+	}
 
 	// Output final message
 	if (errors > 0) {
@@ -6,6 +6,24 @@
  *
  * The program should work like cp, copying the file on your native system
  * to the specified location on the disk.
+ *
+ * With --dedup, a file whose contents are already on the disk is not copied
+ * again: the new name is made a hard link to the existing file instead, as
+ * ext2_ln would. Files are found by a content hash kept in a sidecar next to
+ * the disk (disk.dedup), which is rebuilt by scanning the disk if it is
+ * missing. Once the sidecar exists every copy is recorded in it, with
+ * --dedup or not. Entries can go stale as files are removed, so a match is
+ * always checked byte for byte before it is linked to.
+ *
+ * Lookups load the sidecar into a hash table by content hash. ext2d keeps
+ * the table between requests and only reads the records added since, so a
+ * bulk import through the daemon reads each record once.
+ *
+ * Given several files, the last argument must be a directory, and each file
+ * is copied into it under its own name. -j sets how many threads copy them
+ * (default 4): each file's inode and blocks are allocated and written by
+ * one of them, from a block group it has to itself if there is one, then the names are added to the directory in the order
+ * given. If the disk fills up, the files copied before it did are kept.
  */
 
 #include<stdio.h>
@@ -25,6 +43,53 @@ unsigned char *disk;
 struct ext2_super_block *sb;
 struct ext2_group_desc *desc;
 
+#define DEDUP_MAGIC 0x44443245  // "E2DD"
+
+/* The sidecar is a header followed by one record per file copied. */
+struct dedup_header {
+	unsigned int magic;
+	unsigned int block_size;
+};
+
+struct dedup_record {
+	uint64_t hash;
+	unsigned int size;
+	unsigned int inode;     // Index of the file's inode
+};
+
+/* The sidecar's records, open addressed by hash, as far as they were read.
+ * Slots with size 0 are empty, no empty file is ever recorded.
+ */
+struct dedup_table {
+	dev_t dev;              // Identity of the sidecar loaded
+	ino_t ino;
+	off_t loaded;           // Bytes of it read so far, 0 if nothing is loaded
+	struct dedup_record *slots;
+	unsigned int count, size;
+};
+
+struct dedup_table dedup_table;
+
+#define CP_DEFAULT_THREADS 4
+#define CP_MAX_THREADS 64       // The block cache serves up to 64 threads
+
+/* A file copied by import_files. */
+struct import {
+	char *name;             // Its name in the directory
+	unsigned char *source;  // Its contents, mapped
+	int size;
+	uint64_t hash;
+	int inode;              // Its inode index, or the one it duplicates
+	int duplicate;
+	const char *error;      // Why it could not be copied, NULL if it was
+};
+
+/* The files of an import, taken by the copying threads one at a time. */
+struct import_batch {
+	struct import *files;
+	int count;
+	int next;
+};
 
 /* HELPERS */
 
@@ -37,40 +102,410 @@ int check_path(char *path){
 
 }
 
-//get free blocks from the blocks bitmap
-int *get_free_blocks(int blocks_need, unsigned char *block_bit_map){
+/* DEDUP */
 
-	int i,j=22;
-	
-	int* free_blocks = malloc(sizeof(int)*blocks_need);
-	
-	for(i=0; i<blocks_need; i++){
-		while(check_node(j, block_bit_map) == 0){
-			j++;
-			//if j reaches max block count, return null
-			if(j==sb->s_blocks_count){
-				return NULL;
+/* Folds the next len bytes of a file at chunk, a block or what is left of
+ * the file, into the file's hash h.
+ */
+uint64_t hash_chunk(uint64_t h, unsigned char *chunk, unsigned int len) {
+	static unsigned char *pad = NULL;
+	unsigned int bs = get_block_size(disk);
+	if (len < bs) { // The last block, hashed zero padded
+		if (pad == NULL) pad = malloc(bs);
+		memset(pad, 0, bs);
+		memcpy(pad, chunk, len);
+		chunk = pad;
+	}
+	h = (h ^ hash_block(chunk, bs)) * 0x9E3779B97F4A7C15ULL;
+	return h ^ (h >> 32);
+}
+
+/* Returns the hash of the size bytes at data. */
+uint64_t hash_source(unsigned char *data, unsigned int size) {
+	unsigned int bs = get_block_size(disk), off;
+	uint64_t h = size;
+	for (off = 0; off < size; off += bs) {
+		h = hash_chunk(h, data + off, size - off < bs ? size - off : bs);
+	}
+	return h;
+}
+
+/* Returns the hash of the contents of the file at index, 0 if a block is
+ * missing.
+ */
+uint64_t hash_inode(unsigned int index) {
+	struct ext2_inode *ip = get_inode(disk, index);
+	unsigned int bs = get_block_size(disk), off, n;
+	uint64_t h = ip->i_size;
+	for (off = 0, n = 0; off < ip->i_size; off += bs, n++) {
+		unsigned int block = file_block(disk, ip, n);
+		if (block == 0 || block >= sb->s_blocks_count) {
+			return 0;
+		}
+		h = hash_chunk(h, get_block(disk, block), ip->i_size - off < bs ? ip->i_size - off : bs);
+	}
+	return h;
+}
+
+/* Returns 1 if the file at index holds exactly the size bytes at data. */
+int same_contents(unsigned int index, unsigned char *data, unsigned int size) {
+	struct ext2_inode *ip = get_inode(disk, index);
+	unsigned int bs = get_block_size(disk), off, n;
+	if (!inode_in_use(disk, index) || get_inode_type(ip) != 'f' || ip->i_links_count == 0 ||
+			ip->i_size != size) {
+		return 0;
+	}
+	for (off = 0, n = 0; off < size; off += bs, n++) {
+		unsigned int block = file_block(disk, ip, n);
+		if (block == 0 || block >= sb->s_blocks_count ||
+				memcmp(get_block(disk, block), data + off, size - off < bs ? size - off : bs) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Writes a sidecar at path with a record for every regular file on the disk,
+ * replacing whatever was there.
+ */
+void rebuild_index(char *path) {
+	double start = trace_begin();
+	struct dedup_header header = {DEDUP_MAGIC, get_block_size(disk)};
+	struct dedup_record record;
+	char tmp[strlen(path) + 5];
+	sprintf(tmp, "%s.new", path);
+	FILE *out = hold_file(fopen(tmp, "w"));
+	if (out == NULL) {
+		perror(tmp);
+		exit(1);
+	}
+	fwrite(&header, sizeof(header), 1, out);
+	struct inode_summary *s = inode_summary(disk);
+	unsigned int index;
+	for (index = 0; index < sb->s_inodes_count; index++) {
+		if (index + 1 < EXT2_GOOD_OLD_FIRST_INO || !S_ISREG(s->mode[index]) ||
+				s->links[index] == 0 || s->size[index] == 0 || !inode_in_use(disk, index)) {
+			continue;
+		}
+		record.hash = hash_inode(index);
+		record.size = s->size[index];
+		record.inode = index;
+		if (record.hash != 0) {
+			fwrite(&record, sizeof(record), 1, out);
+		}
+		release_blocks();
+	}
+	if (drop_file(out) != 0 || rename(tmp, path) == -1) {
+		perror(path);
+		exit(1);
+	}
+	trace_end("dedup index", start);
+}
+
+/* Adds record to the table, growing it to keep it at most half full. */
+void table_insert(struct dedup_record *record) {
+	struct dedup_table *t = &dedup_table;
+	unsigned int i;
+	if (2 * (t->count + 1) > t->size) {
+		struct dedup_record *old = t->slots;
+		unsigned int old_size = t->size;
+		t->size = t->size ? t->size * 2 : 1024;
+		t->slots = calloc(t->size, sizeof(struct dedup_record));
+		t->count = 0;
+		for (i = 0; i < old_size; i++) {
+			if (old[i].size != 0) {
+				table_insert(&old[i]);
+			}
+		}
+		free(old);
+	}
+	for (i = record->hash & (t->size - 1); t->slots[i].size != 0; i = (i + 1) & (t->size - 1));
+	t->slots[i] = *record;
+	t->count++;
+}
+
+/* Brings the table up to date with the sidecar at path: loads it whole if it
+ * is not the one loaded, it was replaced since, and the records appended to
+ * it since otherwise. Returns -1 if there is no usable sidecar.
+ */
+int load_index(char *path) {
+	struct dedup_table *t = &dedup_table;
+	struct dedup_header header;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1) close(fd);
+		return -1;
+	}
+	if (t->loaded == 0 || st.st_dev != t->dev || st.st_ino != t->ino) {
+		if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != DEDUP_MAGIC ||
+				header.block_size != get_block_size(disk)) {
+			close(fd);
+			return -1;
+		}
+		free(t->slots);
+		memset(t, 0, sizeof(*t));
+		t->dev = st.st_dev;
+		t->ino = st.st_ino;
+		t->loaded = sizeof(header);
+	}
+	struct dedup_record records[256];
+	ssize_t n;
+	while ((n = pread(fd, records, sizeof(records), t->loaded)) >= (ssize_t)sizeof(struct dedup_record)) {
+		int i, whole = n / sizeof(struct dedup_record); // A record still being appended waits
+		for (i = 0; i < whole; i++) {
+			if (records[i].size != 0) {
+				table_insert(&records[i]);
 			}
 		}
-		free_blocks[i] = j;	
-		set_node(j, block_bit_map);
+		t->loaded += whole * sizeof(struct dedup_record);
+	}
+	close(fd);
+	return 0;
+}
+
+/* Looks up the size bytes at data, which hash to hash, in the sidecar at
+ * path, building it first if need be. Returns the index of a file with the
+ * same contents, locked, -1 if there is none.
+ */
+int find_duplicate(char *path, uint64_t hash, unsigned char *data, unsigned int size) {
+	if (load_index(path) == -1) {
+		rebuild_index(path);
+		if (load_index(path) == -1) {
+			perror(path);
+			exit(1);
+		}
+	}
+	double start = trace_begin();
+	struct dedup_table *t = &dedup_table;
+	int found = -1;
+	unsigned int i;
+	for (i = hash & (t->size - 1); found == -1 && t->size > 0 && t->slots[i].size != 0;
+			i = (i + 1) & (t->size - 1)) {
+		struct dedup_record *record = &t->slots[i];
+		if (record->hash != hash || record->size != size || record->inode >= sb->s_inodes_count) {
+			continue;
+		}
+		// Hold the file so it cannot be removed between the check and the link
+		lock_inode(disk, record->inode, 1);
+		if (same_contents(record->inode, data, size)) {
+			found = record->inode;
+		} else {
+			unlock_inode(disk, record->inode);
+		}
+	}
+	trace_end("dedup lookup", start);
+	return found;
+}
+
+/* Adds a record for the file just copied to the sidecar at path. */
+void add_to_index(char *path, uint64_t hash, unsigned int size, int inode) {
+	struct dedup_record record = {hash, size, inode};
+	int fd = open(path, O_WRONLY | O_APPEND);
+	if (fd != -1) {
+		write_all(fd, &record, sizeof(record)); // One write, so appends never interleave
+		close(fd);
 	}
-	return free_blocks;
 }
 
-//find the index of a free block in the bitmap
-int find_free_block(unsigned char *bmap){
-	int bnode;
-	for (bnode = 22; bnode < sb->s_blocks_count; bnode++) {
-		if (check_node(bnode, bmap) == 0) {
+/* IMPORT */
+
+/* Sets up the inode at index inode as a regular file holding the size bytes
+ * at source, allocating its blocks as it goes. It never exits, so the
+ * copying threads can call it.
+ * Returns 0, or -1 if the disk is full.
+ */
+int write_file(int inode, unsigned char *source, int size) {
+	unsigned int bs = get_block_size(disk);
+	struct ext2_inode *new_inode = get_inode(disk, inode);
+
+	//calculate number of blocks needed to store file
+	int blocks_needed = (size - 1) / bs + 1;
+
+	//set up the inode
+	new_inode->i_mode = EXT2_S_IFREG; //file flag
+	new_inode->i_size = size;
+	new_inode->i_ctime = (unsigned int) time(0);
+	new_inode->i_dtime = 0;
+	new_inode->i_blocks = 0;
+	new_inode->i_links_count = 1;
+	memset(new_inode->i_block, 0, sizeof(new_inode->i_block));
+
+	void *db; //block where data of the file belongs.
+	//need to find free blocks for the file and read into them
+	int block_indx;
+	int copied = 0; //tracker for how much copied
+	int size_remain = size; // tracker for how much remains
+	for(block_indx=0; block_indx<blocks_needed; block_indx++){
+		//if indirect blocks are needed, set them up first so the data blocks
+		//that follow stay contiguous
+		if(block_indx>=12 && map_file_block(disk, inode, new_inode, block_indx, 0) == -1){
+			return -1;
+		}
+		//find a free block, contiguous with the last one if the inode has a window
+		int free_block = alloc_block(disk, inode, 0);
+		if (free_block == -1) {
+			return -1;
+		}
+		new_inode->i_blocks += bs / 512;
+		map_file_block(disk, inode, new_inode, block_indx, free_block);
+		//update data block, nothing in it is worth reading first
+		db = (void*)get_new_block(disk, free_block);
+		if(size_remain < bs) {
+			memcpy(db, source + copied, size_remain);
+			__atomic_fetch_add(&stats.bytes_copied, size_remain, __ATOMIC_RELAXED);
+			size_remain = 0;
 			break;
+		} else {
+			memcpy(db, source + copied, bs);
+			__atomic_fetch_add(&stats.bytes_copied, bs, __ATOMIC_RELAXED);
+			size_remain -= bs;
+			copied += bs;
+		}
+		//through the block cache, let go of the blocks written so far
+		if(block_indx % 256 == 255){
+			release_blocks();
+			new_inode = get_inode(disk, inode);
 		}
 	}
-	if(bnode == sb->s_blocks_count){
-		return -1;	
+	return 0;
+}
+
+/* Copies the files of the batch at arg until there are none left, then
+ * folds the thread's counter changes in. Run by every copying thread, each
+ * in a block group of its own while there are enough of them, so their
+ * files do not interleave.
+ */
+void *import_worker(void *arg) {
+	struct import_batch *batch = arg;
+	int i;
+	claim_arena(disk);
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+		struct import *f = &batch->files[i];
+		if (f->duplicate) {
+			continue;
+		}
+		f->inode = alloc_inode(disk, 0);
+		if (f->inode == -1) {
+			f->error = "No more inodes available.";
+		} else if (write_file(f->inode, f->source, f->size) == -1) {
+			f->error = "No more blocks available.";
+		}
+		release_blocks();
+	}
+	commit_counters(disk);
+	release_arena();
+	return NULL;
+}
+
+/* Copies the count files at paths into the directory at dir_path on the
+ * disk named image, with up to threads threads. Exits if a file cannot be
+ * copied.
+ */
+int import_files(char *image, char **paths, int count, char *dir_path, int threads, int dedup) {
+	unsigned int bs = get_block_size(disk);
+	int parent_index = lookup_path(disk, dir_path);
+	if (parent_index == -1 || get_inode_type(get_inode(disk, parent_index)) != 'd') {
+		fprintf(stderr, "'%s' No such directory\n", dir_path);
+		exit(ENOENT);
+	}
+	//held until we exit so nobody else inserts the same names
+	lock_inode(disk, parent_index, 1);
+
+	//once there is a sidecar, every copy is recorded in it
+	char *index_path = hold_mem(malloc(strlen(image) + 7));
+	sprintf(index_path, "%s.dedup", image);
+	int indexed = dedup || access(index_path, F_OK) == 0;
+
+	//map every file and check its name before anything is written
+	struct import *files = hold_mem(calloc(count, sizeof(struct import)));
+	unsigned int blocks_needed = 0;
+	int i, j;
+	for (i = 0; i < count; i++) {
+		struct import *f = &files[i];
+		int osfd = hold_fd(open(paths[i], O_RDONLY));
+		if (osfd == -1) {
+			fprintf(stderr, "os path: '%s' invalid\n", paths[i]);
+			exit(ENOENT);
+		}
+		f->name = strrchr(paths[i], '/');
+		f->name = (f->name == NULL) ? paths[i] : f->name + 1;
+		if (strlen(f->name) > EXT2_NAME_LEN) {
+			fprintf(stderr, "File name too large.\n");
+			exit(1);
+		}
+		for (j = 0; j < i && strcmp(files[j].name, f->name) != 0; j++);
+		if (j < i || search_directories(disk, get_inode(disk, parent_index), f->name, 0) != -1) {
+			fprintf(stderr, "File name '%s' already exists", f->name);
+			exit(1);
+		}
+		f->size = lseek(osfd, 0, SEEK_END);
+		f->source = hold_map(mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, osfd, 0), f->size);
+		drop_fd(osfd);
+		if (f->size > 0 && f->source == MAP_FAILED) {
+			perror(paths[i]);
+			exit(1);
+		}
+		f->inode = -1;
+		if (indexed && f->size > 0) {
+			f->hash = hash_source(f->source, f->size);
+		}
+		//with --dedup, link to a file with the same contents if there is one
+		if (dedup && f->size > 0 &&
+				(f->inode = find_duplicate(index_path, f->hash, f->source, f->size)) != -1) {
+			f->duplicate = 1;
+		} else {
+			blocks_needed += (f->size > 0 ? (f->size - 1) / bs : 0) + 1;
+		}
+		release_blocks();
 	}
-	set_node(bnode, bmap);
-	return bnode;
+	if (blocks_needed > sb->s_free_blocks_count) {
+		fprintf(stderr, "Not enough space in disk img\n");
+		exit(1);
+	}
+
+	//the threads allocate and write the files, we take a share too
+	struct import_batch batch = {files, count, 0};
+	pthread_t workers[CP_MAX_THREADS];
+	int started;
+	if (threads > count) threads = count;
+	double copy_start = trace_begin();
+	start_threaded_writes(disk);
+	for (started = 0; started < threads - 1; started++) {
+		if (pthread_create(&workers[started], NULL, import_worker, &batch) != 0) {
+			break;
+		}
+	}
+	import_worker(&batch);
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	trace_end("data copy", copy_start);
+
+	//add the files to the directory in the order given
+	const char *error = NULL;
+	for (i = 0; i < count; i++) {
+		struct import *f = &files[i];
+		if (f->error != NULL) {
+			error = f->error;
+			continue;
+		}
+		add_dir_entry(disk, parent_index, f->name, f->inode, EXT2_FT_REG_FILE);
+		if (f->duplicate) {
+			get_inode(disk, f->inode)->i_links_count++;
+		} else if (indexed && f->size > 0) {
+			add_to_index(index_path, f->hash, f->size, f->inode);
+		}
+		summary_update(disk, f->inode);
+		release_blocks();
+	}
+	commit_counters(disk);
+	finish_threaded_writes();
+	if (error != NULL) {
+		fprintf(stderr, "%s", error);
+		exit(1);
+	}
+	return 0;
 }
 
 /**
@@ -79,44 +514,66 @@ int find_free_block(unsigned char *bmap){
 
 */
 int main(int argc, char** argv){
+	parse_common_flags(&argc, argv);
+	//take out --dedup and -j wherever they are
+	int dedup = 0, threads = CP_DEFAULT_THREADS;
+	int a, b;
+	for(a = 1, b = 1; a < argc; a++){
+		if(strcmp(argv[a], "--dedup") == 0){
+			dedup = 1;
+		} else if(strcmp(argv[a], "-j") == 0 && a + 1 < argc){
+			threads = atoi(argv[++a]);
+		} else {
+			argv[b++] = argv[a];
+		}
+	}
+	argv[b] = NULL;
+	argc = b;
 	//arguments check
-	if(argc != 4){
-		fprintf(stderr, "Usage: %s [disk] [os path] [virtual disk path]\n", argv[0]);
+	if(argc < 4 || threads < 1 || threads > CP_MAX_THREADS){
+		fprintf(stderr, "Usage: %s [--stats] [--trace file] [--dedup] [-j threads] [disk] [os path]... [virtual disk path]\n", argv[0]);
 		exit(1);
 	}
 	//opening the disk
-	int fd = open(argv[1], O_RDWR);
+	int fd = hold_fd(open(argv[1], O_RDWR));
 	if(!fd){
 		fprintf(stderr, "Disk image '%s' not found\n", argv[1]);
 		exit(1);	
 	}
     //check virtual path is absolute or not.
-    int check = check_path(argv[3]);
+    int check = check_path(argv[argc - 1]);
     if(check == 1){
         fprintf(stderr, "Please provide absolute path for virtual path");
         exit(1);
     }
+	//several files go into a directory
+	if(argc > 4){
+		disk = map_disk(fd);
+		track_checksums(disk, argv[1]);
+		sb = get_super(disk);
+		desc = get_group_desc(disk, 0);
+		return import_files(argv[1], argv + 2, argc - 3, argv[argc - 1], threads, dedup);
+	}
 	//open the file from this os
-	int osfd = open(argv[2], O_RDONLY);
+	int osfd = hold_fd(open(argv[2], O_RDONLY));
 	if(osfd == -1){
 		fprintf(stderr, "os path: '%s' invalid\n", argv[2]);
 		exit(ENOENT);
 	}
-	// mmap the disk
-	disk = mmap(NULL, 128*1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (disk == MAP_FAILED) {
-		perror("mmap");
-		exit(1);
-	}
+	// mmap the whole disk
+	disk = map_disk(fd);
+	// Keep the checksum sidecar, if there is one, in step with what we write
+	track_checksums(disk, argv[1]);
 	// Grabbing super block and block descriptor
-	sb = (struct ext2_super_block *)(disk + 1024);
-	desc = (struct ext2_group_desc *)(disk + 2*1024);
+	sb = get_super(disk);
+	desc = get_group_desc(disk, 0);
+	unsigned int bs = get_block_size(disk);
 	
 	//get the file size
 	int file_size = lseek(osfd, 0, SEEK_END);
 
 	//calculate number of blocks needed to store file
-	int blocks_needed = (file_size - 1) / EXT2_BLOCK_SIZE + 1;
+	int blocks_needed = (file_size - 1) / bs + 1;
 	
 	//check if there is space in disk img
 	if(blocks_needed > sb->s_free_blocks_count){
@@ -125,40 +582,20 @@ int main(int argc, char** argv){
 	}
 	
 	
-	//get the bitmaps and inode table
-	//int inode_bitmap = desc-> bg_inode_bitmap;
-	unsigned char *block_bitmap = (unsigned char *) (disk+1024 * desc -> bg_block_bitmap);
-	//int inode_table =  desc -> bg_inode_table;
-
-	//copy osfilename into a variable
-	char *dup = strdup(argv[2]);
-	// Creating array and copying
-	int c;
-	int count=0;
-	for (c = 0; dup[c] != 0; c++) {
-		if (dup[c] == '/' && dup[c+1] != '\0') {
-			count++;
-		}
-	}
-	if(count!=0) {
-
-		char *dirs[count];
-		int cp;
-		for (cp = 0; cp < count; cp++) {
-			dirs[cp] = strsep(&dup, "/");
-		}
-
-		dup = dirs[cp - 1];
-	}
+	//copy osfilename into a variable, keeping only the last name of the path
+	char *dup = hold_mem(strdup(argv[2]));
+	char *os_name = strrchr(dup, '/');
+	os_name = (os_name == NULL) ? dup : os_name + 1;
 
 	//we need the parent directory where file should belong
 	int parent_index;
 	//we need a temp variable to hold the virtual disk path
-	char *virtual_path = strdup(argv[3]);
+	char *virtual_path = hold_mem(strdup(argv[3]));
 	//if it ends in / then append in the os file name
 	if(argv[3][strlen(argv[3]) - 1] == '/'){
 		//copy path into temp variable
-		strcat(virtual_path, dup);
+		virtual_path = renew_mem(virtual_path, strlen(argv[3]) + strlen(os_name) + 1);
+		strcat(virtual_path, os_name);
         //get the parent index
 		parent_index = check_parent(disk, virtual_path);
 		if(parent_index == -1){
@@ -175,9 +612,9 @@ int main(int argc, char** argv){
 		}
 	}
 
-	//get the parent node
-	struct ext2_inode *parent_node = (struct ext2_inode *) ((disk+EXT2_BLOCK_SIZE * desc->bg_inode_table) +
-            (sb->s_inode_size * parent_index));
+	//get the parent node, held until we exit so nobody else inserts the same name
+	struct ext2_inode *parent_node = get_inode(disk, parent_index);
+	lock_inode(disk, parent_index, 1);
 
 	//take out the last / and get the file name (could be a dir)
 	if (virtual_path[strlen(virtual_path) -1] == '/') virtual_path[strlen(virtual_path)-1] = '\0';
@@ -195,7 +632,7 @@ int main(int argc, char** argv){
 	}
 	
 	//copy the new file name
-	char file_name[file_len1];
+	char file_name[EXT2_NAME_LEN + 1];
 	strcpy(file_name, virtual_path + i + 1);
 
 	//check if last name is a directory
@@ -204,8 +641,10 @@ int main(int argc, char** argv){
 
 	//if its a directory, thats the new parent, otherwise file_name is our new file name
 	if(new_parent_index != -1){
-		parent_node = (struct ext2_inode *) ((disk+EXT2_BLOCK_SIZE * desc->bg_inode_table) + (sb->s_inode_size *
-				new_parent_index));
+		parent_index = new_parent_index;
+		parent_node = get_inode(disk, new_parent_index);
+		lock_inode(disk, parent_index, 1);
+		strcpy(file_name, os_name);
 	}
 
 	//if last name is a file and already exists, throw an err
@@ -216,163 +655,58 @@ int main(int argc, char** argv){
 
 
 	//last name is either our new parent or a new file. all is set
-	
-	// Finding a free inode and allocating (set to 1)
-	unsigned char *imap = (unsigned char *)(disk + 1024 * desc->bg_inode_bitmap);
-	int inode;
-	for (inode = 11; inode < sb->s_inodes_count; inode++) {
-		if (check_node(inode, imap) == 0) {
-			break;
+
+	//map the src file
+	unsigned char *source = hold_map(mmap(NULL, file_size, PROT_READ| PROT_WRITE,
+								 MAP_PRIVATE, osfd, 0), file_size);
+	drop_fd(osfd);
+
+	//with --dedup, link to a file with the same contents if there is one.
+	//once there is a sidecar, every copy is recorded in it
+	uint64_t hash = 0;
+	char *index_path = hold_mem(malloc(strlen(argv[1]) + 7));
+	sprintf(index_path, "%s.dedup", argv[1]);
+	int indexed = file_size > 0 && (dedup || access(index_path, F_OK) == 0);
+	if(indexed){
+		hash = hash_source(source, file_size);
+	}
+	if(dedup && file_size > 0){
+		int same = find_duplicate(index_path, hash, source, file_size);
+		if(same != -1){
+			add_dir_entry(disk, parent_index, file_name, same, EXT2_FT_REG_FILE);
+			get_inode(disk, same)->i_links_count++;
+			summary_update(disk, same);
+			drop_map(source);
+			drop_mem(index_path);
+			return 0;
 		}
 	}
-	if (inode == sb->s_inodes_count) { // Maximum reached, no more inodes
+	
+	// Finding a free inode and allocating (set to 1)
+	int inode = alloc_inode(disk, 0);
+	if (inode == -1) { // Maximum reached, no more inodes
 		fprintf(stderr, "No more inodes available.");
 		exit(1);
 	}
-	
-	//new inode init
-	struct ext2_inode *new_inode = (struct ext2_inode *)((disk + 1024 * desc->bg_inode_table)
-														 + (sb->s_inode_size * (inode)));
-	
-	//set up the inode
-	new_inode->i_mode = EXT2_S_IFREG; //file flag
-	new_inode->i_size = file_size;
-    new_inode->i_ctime = (unsigned int) time(0);
-    new_inode->i_dtime = 0;
-	new_inode->i_blocks = 1;
-	new_inode->i_links_count = 1;
-	sb->s_free_inodes_count--;
-	desc->bg_free_inodes_count--;
-
-	//map the src file
-	unsigned char *source = mmap(NULL, file_size, PROT_READ| PROT_WRITE,
-								 MAP_PRIVATE, osfd, 0);
-
-	void *db; //block where data of the file belongs.
-    void *indirect_block_ptr;
-	unsigned int indir_data_blocks[15];
-	//need to find free blocks for the file and read into them
-	int block_indx;
-    int copied = 0; //tracker for how much copied
-    int size_remain = file_size; // tracker for how much remains
-	for(block_indx=0; block_indx<blocks_needed; block_indx++){
-		//if indirect blocks aren't needed
-		if(block_indx<12){
-			//find a free block
-			int free_block = find_free_block(block_bitmap);
-			if (free_block == -1) {
-				fprintf(stderr, "No more blocks available.");
-				exit(1);
-			}
-			//update superblock and new_inode
-			adjust_free_blocks(-1, sb, desc);
-			new_inode->i_blocks++;
-			new_inode->i_block[block_indx] = (sb->s_first_data_block) + free_block-1;
-			//update data block
-			db = (void*)(disk + EXT2_BLOCK_SIZE * new_inode->i_block[block_indx]);
-		}
-		
-		//if indirect blocks are needed
-		//need to setup an indirect block
-		else if(block_indx>=12){
-			int free_block = find_free_block(block_bitmap);
-			if(free_block == -1){
-				fprintf(stderr, "No more blocks available.");
-				exit(1);
-			}
-			
-			//initialize an indirect block if i==12, since i_blocks[12] is the pointer to the indirect block
-			if(i==12){
-				//find space for this indirect block to set up a pointer to blocks
- 				int indir_block_indx = find_free_block(block_bitmap);
-				if(indir_block_indx == -1){
-					fprintf(stderr, "No more blocks available.");
-					exit(1);
-				}
-				new_inode->i_block[block_indx] = (sb->s_first_data_block) + indir_block_indx;
-				indirect_block_ptr = (void*)(disk + EXT2_BLOCK_SIZE * new_inode->i_block[block_indx]);	
-				indir_data_blocks[block_indx-12]  = (sb->s_first_data_block) + free_block - 1;
-				memcpy(indirect_block_ptr, (void*)indirect_block_ptr, 16);
-				
-			}
-			
-			//update the new_node
-			new_inode->i_block[block_indx] = (sb->s_first_data_block) + free_block;
-			//update superblock
-			adjust_free_blocks(-1, sb, desc);
-			//update the data block
-			db = (void*)(disk + EXT2_BLOCK_SIZE * indir_data_blocks[block_indx-12]);
-		}
-        if(size_remain < EXT2_BLOCK_SIZE) {
-            memcpy(db, source + copied, size_remain);
-            size_remain = 0;
-            break;
-        } else {
-            memcpy(db, source + copied, EXT2_BLOCK_SIZE);
-            size_remain -= EXT2_BLOCK_SIZE;
-            copied += EXT2_BLOCK_SIZE;
-        }
-
-	}
-	// set the new inode in the imap
-	set_node(inode, imap);
-	// set the block sectors occupied
-	new_inode->i_blocks = (unsigned int)((new_inode->i_size / 512) + 1);
+	double copy_start = trace_begin();
+	if (write_file(inode, source, file_size) == -1) {
+		fprintf(stderr, "No more blocks available.");
+		exit(1);
+	}
+	trace_end("data copy", copy_start);
+	summary_update(disk, inode);
 	/* update parent directory */
-	
-	int par_block_index;
-	int k;
-	for(k=0; parent_node->i_block[k] != 0; k++){
-		par_block_index = parent_node -> i_block[k];	
+	add_dir_entry(disk, parent_index, file_name, inode, EXT2_FT_REG_FILE);
+	if(indexed){
+		add_to_index(index_path, hash, file_size, inode);
 	}
+	drop_mem(index_path);
 
-	struct ext2_dir_entry *curdir = (struct ext2_dir_entry *)(disk + (1024 * par_block_index));
-	int total_rec_len;
-	//make curdir the last dir
-	for(total_rec_len=0; total_rec_len + curdir->rec_len < 1024;){
-		total_rec_len += curdir->rec_len;
-		curdir = (struct ext2_dir_entry *) (disk + (1024 * par_block_index) + total_rec_len);
-	}
-	
-	//check theres enough space to place the new dir entry
-	struct ext2_dir_entry *newdir;
-	int remaining_rec_len = sizeof(curdir) + curdir->name_len; // Actual size of curdir
-	remaining_rec_len += 4 - (remaining_rec_len % 4); // Add padding
-	remaining_rec_len = 1024 - remaining_rec_len - total_rec_len; // Remaining space
-	if (remaining_rec_len < (8 + strlen(file_name))) { // Not enough space
-		// Allocate new block
-		int newblock;
-		for (newblock = 22; newblock < sb->s_blocks_count; newblock++) {
-			if (check_node(newblock, block_bitmap) == 0) {
-				break;
-			}
-		}
-		if (newblock == sb->s_blocks_count) {
-			fprintf(stderr, "No more blocks available.");
-			exit(1);
-		}
-		set_node(newblock, block_bitmap);
-		sb->s_free_blocks_count--;
-		parent_node->i_block[i] = newblock; // i should still hold the first block space unused by parent
-		parent_node->i_blocks += 2; // One more block being added
-		newdir = (struct ext2_dir_entry *)(disk + (1024 * newblock));
-		newdir->rec_len = 1024; // Takes up the whole of the new block.
-	} else { // Enough space
-		// Change curdir, add new directory
-		curdir->rec_len = sizeof(curdir) + curdir->name_len;
-		curdir->rec_len += 4 - (curdir->rec_len % 4);
-		total_rec_len += curdir->rec_len;
-		newdir = (struct ext2_dir_entry *)(disk + (1024 * par_block_index) + total_rec_len);
-		newdir->rec_len = 1024 - total_rec_len; // Takes up the rest of the block.
-	}
-	newdir->inode = inode + 1;
-	newdir->name_len = strlen(file_name);
-	newdir->file_type = EXT2_FT_REG_FILE;
-	strncpy(newdir->name, file_name, newdir->name_len);
-
-	free(dup); //free dup variable
-	free(virtual_path); // free the virtual path
-	close(fd);
+	drop_map(source);
+	drop_mem(dup); //free dup variable
+	drop_mem(virtual_path); // free the virtual path
+	// fd stays open: closing it would drop our locks before the image is
+	// written back on exit
 	return 0;
 }
 
@@ -0,0 +1,317 @@
+/*
+ * Takes two arguments, plus an option:
+ * First: the name of the original ext2 formatted disk, e.g. a golden image.
+ * Second: the name of a disk derived from it, with the same layout.
+ *
+ * -q: only report whether the disks differ, through the exit status.
+ *
+ * The program should print every file and directory that differs between
+ * the two disks, one per line, as "A path" if it was added, "D path" if it
+ * was deleted and "M path" if its inode or any of its blocks changed, sorted
+ * by path. It exits with 1 if anything differs and 0 otherwise, like diff.
+ *
+ * Files are never read one by one. Blocks allocated in either disk are
+ * compared in place, a bitmap word at a time so blocks free in both are
+ * skipped, and the blocks that differ are traced back to their owners
+ * through an inverted block to inode map. Only the inode table blocks that
+ * differ are compared inode by inode. Changes to blocks no inode owns, such
+ * as the superblock's counters and the bitmaps, are not reported.
+ */
+
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include "ext2.h"
+#include<errno.h>
+#include<limits.h>
+#include "ext2_utils.c"
+
+unsigned char *old_disk, *new_disk;
+struct ext2_super_block *sb;  // The old disk's, the layout is the same
+unsigned int bs;
+unsigned char *changed;       // Bitmap of the inodes that differ
+char **old_paths, **new_paths; // Paths of the changed inodes, by index
+
+/* A line of the report. */
+struct diff_entry {
+	char status;
+	char *path;
+};
+
+/* HELPERS */
+
+/* Opens and maps a disk, exiting if it cannot be opened. */
+unsigned char *open_disk(char *name) {
+	int fd = open(name, O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "Disk image '%s' not found.\n", name);
+		exit(ENOENT);
+	}
+	return map_disk(fd);
+}
+
+/* Returns 1 if the two disks are laid out the same way, block for block. */
+int same_layout() {
+	struct ext2_super_block *nsb = get_super(new_disk);
+	unsigned int g, groups = get_group_count(old_disk);
+	if (sb->s_blocks_count != nsb->s_blocks_count || sb->s_inodes_count != nsb->s_inodes_count ||
+			sb->s_log_block_size != nsb->s_log_block_size ||
+			sb->s_blocks_per_group != nsb->s_blocks_per_group ||
+			sb->s_inodes_per_group != nsb->s_inodes_per_group ||
+			sb->s_inode_size != nsb->s_inode_size) {
+		return 0;
+	}
+	for (g = 0; g < groups; g++) {
+		struct ext2_group_desc *a = get_group_desc(old_disk, g), *b = get_group_desc(new_disk, g);
+		if (a->bg_block_bitmap != b->bg_block_bitmap || a->bg_inode_bitmap != b->bg_inode_bitmap ||
+				a->bg_inode_table != b->bg_inode_table) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Compares every block allocated in either disk, setting the bits of the
+ * ones that differ in the bitmap blocks, indexed by block number.
+ * Returns the number of blocks that differ.
+ */
+unsigned int diff_blocks(unsigned char *blocks) {
+	double start = trace_begin();
+	unsigned int g, groups = get_group_count(old_disk), i, count = 0;
+	for (g = 0; g < groups; g++) {
+		unsigned int first = sb->s_first_data_block + g * sb->s_blocks_per_group;
+		unsigned int n = sb->s_blocks_count - first;
+		if (n > sb->s_blocks_per_group) {
+			n = sb->s_blocks_per_group;
+		}
+		for (i = 0; i < n; i += 64) {
+			// Looked up again every word, the blocks compared may have evicted them
+			uint64_t *a = (uint64_t *)get_block(old_disk, get_group_desc(old_disk, g)->bg_block_bitmap);
+			uint64_t *b = (uint64_t *)get_block(new_disk, get_group_desc(new_disk, g)->bg_block_bitmap);
+			uint64_t used = a[i / 64] | b[i / 64];
+			stats.bitmap_bits_scanned += 64;
+			if (n - i < 64) {
+				used &= (1ULL << (n - i)) - 1;
+			}
+			while (used != 0) {
+				unsigned int block = first + i + __builtin_ctzll(used);
+				used &= used - 1;
+				if (memcmp(get_block(old_disk, block), get_block(new_disk, block), bs) != 0) {
+					set_node(block, blocks, 1);
+					count++;
+				}
+				release_blocks();
+			}
+		}
+	}
+	trace_end("compare blocks", start);
+	return count;
+}
+
+/* Records inode (index + 1) as the owner of block and, for an indirect block
+ * of the given level, of every block below it.
+ */
+void own_block(unsigned char *disk, unsigned int *owner, unsigned int block, int level,
+		unsigned int index) {
+	unsigned int i;
+	if (block == 0 || block >= sb->s_blocks_count) {
+		return;
+	}
+	owner[block] = index + 1;
+	if (level > 0) {
+		unsigned int *entries = (unsigned int *)get_block(disk, block);
+		for (i = 0; i < bs / sizeof(unsigned int); i++) {
+			own_block(disk, owner, entries[i], level - 1, index);
+		}
+	}
+}
+
+/* Builds the inverted map of disk: for every block, the number of the inode
+ * using it, 0 if none does.
+ */
+unsigned int *build_owners(unsigned char *disk) {
+	double start = trace_begin();
+	unsigned int *owner = calloc(sb->s_blocks_count, sizeof(unsigned int));
+	unsigned int index, i;
+	for (index = 0; index < sb->s_inodes_count; index++) {
+		if (!inode_in_use(disk, index)) {
+			continue;
+		}
+		struct ext2_inode *ip = get_inode(disk, index);
+		if (is_fast_symlink(ip)) {
+			continue;
+		}
+		for (i = 0; i < 15; i++) {
+			own_block(disk, owner, ip->i_block[i], i < 12 ? 0 : i - 11, index);
+		}
+		release_blocks();
+	}
+	trace_end("block owners", start);
+	return owner;
+}
+
+/* Marks the inodes whose slots in inode table block differ, if block is part
+ * of a group's inode table. Returns 1 if it is.
+ */
+int diff_inode_table(unsigned int block) {
+	unsigned int g = (block - sb->s_first_data_block) / sb->s_blocks_per_group;
+	unsigned int table = get_group_desc(old_disk, g)->bg_inode_table;
+	unsigned int per_block = bs / sb->s_inode_size;
+	if (block < table || block >= table + sb->s_inodes_per_group / per_block) {
+		return 0;
+	}
+	unsigned int index = g * sb->s_inodes_per_group + (block - table) * per_block, i;
+	for (i = index; i < index + per_block; i++) {
+		if ((inode_in_use(old_disk, i) || inode_in_use(new_disk, i)) &&
+				memcmp(get_inode(old_disk, i), get_inode(new_disk, i), sb->s_inode_size) != 0) {
+			set_node(i, changed, 1);
+		}
+	}
+	return 1;
+}
+
+/* Where a tree walk looking for the paths of changed inodes is. */
+struct path_walk {
+	unsigned char *disk;
+	char **paths;
+	char *path;
+	int len;
+};
+
+/* Records the path of one entry if its inode changed, and walks into it if
+ * it is a directory.
+ */
+int visit_entry(struct ext2_dir_entry *entry, void *arg) {
+	struct path_walk *walk = arg;
+	int index = entry->inode - 1;
+	int len = walk->len;
+	if (len + entry->name_len + 2 > PATH_MAX) {
+		return 0;
+	}
+	walk->path[len] = '/';
+	memcpy(walk->path + len + 1, entry->name, entry->name_len);
+	walk->path[len + 1 + entry->name_len] = '\0';
+	if (check_node(index, changed) && walk->paths[index] == NULL) {
+		walk->paths[index] = strdup(walk->path);
+	}
+	struct ext2_inode *ip = get_inode(walk->disk, index);
+	if (get_inode_type(ip) == 'd') {
+		walk->len = len + 1 + entry->name_len;
+		iterate_dir(walk->disk, ip, visit_entry, walk);
+		walk->len = len;
+	}
+	return 0;
+}
+
+/* Finds a path for every changed inode reachable from the root of disk. */
+char **find_paths(unsigned char *disk) {
+	double start = trace_begin();
+	char **paths = calloc(sb->s_inodes_count, sizeof(char *));
+	char path[PATH_MAX];
+	struct path_walk walk = {disk, paths, path, 0};
+	if (check_node(EXT2_ROOT_INO - 1, changed)) {
+		paths[EXT2_ROOT_INO - 1] = strdup("/");
+	}
+	iterate_dir(disk, get_inode(disk, EXT2_ROOT_INO - 1), visit_entry, &walk);
+	trace_end("find paths", start);
+	return paths;
+}
+
+/* Orders report lines by path. */
+int by_path(const void *a, const void *b) {
+	return strcmp(((struct diff_entry *)a)->path, ((struct diff_entry *)b)->path);
+}
+
+/* MAIN */
+int main(int argc, char **argv) {
+	parse_common_flags(&argc, argv);
+	int opt, bad = 0, quiet = 0;
+	while ((opt = getopt(argc, argv, "q")) != -1) {
+		switch (opt) {
+			case 'q':
+				quiet = 1;
+				break;
+			default:
+				bad = 1;
+		}
+	}
+	if (bad || optind != argc - 2) {
+		fprintf(stderr, "Usage: %s [--stats] [--trace file] [-q] [old disk] [new disk]\n", argv[0]);
+		exit(1);
+	}
+	// Nothing changes under us while we compare. lock_image only knows the
+	// last disk mapped, so the new disk's lock is taken by hand.
+	old_disk = open_disk(argv[optind]);
+	lock_image(0);
+	new_disk = open_disk(argv[optind + 1]);
+	set_range_lock(0, 0, F_RDLCK);
+	sb = get_super(old_disk);
+	bs = get_block_size(old_disk);
+	if (!same_layout()) {
+		fprintf(stderr, "'%s' and '%s' are not laid out the same way.\n",
+				argv[optind], argv[optind + 1]);
+		exit(EINVAL);
+	}
+
+	unsigned char *blocks = calloc(sb->s_blocks_count / 64 + 1, sizeof(uint64_t));
+	changed = calloc(sb->s_inodes_count / 64 + 1, sizeof(uint64_t));
+	unsigned int count = diff_blocks(blocks);
+	if (quiet || count == 0) {
+		return count != 0;
+	}
+
+	// Trace the blocks that differ back to the inodes using them, in the new
+	// disk or, for blocks it no longer uses, the old one.
+	unsigned int *new_owner = build_owners(new_disk);
+	unsigned int *old_owner = build_owners(old_disk);
+	unsigned int block, index;
+	for (block = 0; block < sb->s_blocks_count; block++) {
+		if (block % 64 == 0 && ((uint64_t *)blocks)[block / 64] == 0) {
+			block += 63;
+			continue;
+		}
+		if (!check_node(block, blocks) || diff_inode_table(block)) {
+			continue;
+		}
+		if (new_owner[block] != 0) {
+			set_node(new_owner[block] - 1, changed, 1);
+		}
+		if (old_owner[block] != 0) {
+			set_node(old_owner[block] - 1, changed, 1);
+		}
+	}
+
+	old_paths = find_paths(old_disk);
+	new_paths = find_paths(new_disk);
+	struct diff_entry *report = malloc(2 * sb->s_inodes_count * sizeof(struct diff_entry));
+	int n = 0, i;
+	for (index = 0; index < sb->s_inodes_count; index++) {
+		if (!check_node(index, changed)) {
+			continue;
+		}
+		int in_old = inode_in_use(old_disk, index), in_new = inode_in_use(new_disk, index);
+		// A reused inode number is a deletion and an addition
+		if (in_old && (!in_new || old_paths[index] == NULL || new_paths[index] == NULL ||
+				get_inode_type(get_inode(old_disk, index)) != get_inode_type(get_inode(new_disk, index)))) {
+			if (old_paths[index] != NULL) {
+				report[n].status = 'D';
+				report[n++].path = old_paths[index];
+			}
+			in_old = 0;
+		}
+		if (in_new && new_paths[index] != NULL) {
+			report[n].status = in_old ? 'M' : 'A';
+			report[n++].path = new_paths[index];
+		}
+	}
+	qsort(report, n, sizeof(struct diff_entry), by_path);
+	for (i = 0; i < n; i++) {
+		printf("%c %s\n", report[i].status, report[i].path);
+	}
+	return 1;
+}
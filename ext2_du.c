@@ -0,0 +1,201 @@
+/*
+ * Takes one or two arguments, plus options:
+ * First: the name of an ext2 formatted disk.
+ * Second: the absolute path of the directory to start from (default /).
+ *
+ * -d: only print directories at most this many levels below the start.
+ * -n: only print the n directories using the most space, largest first.
+ * -j: number of threads (default one per CPU).
+ *
+ * The program should work like du, printing for every directory under the
+ * start the space used by everything below it, in KiB from i_blocks, its
+ * apparent size in bytes from i_size, and its path. Directories are printed
+ * as soon as their whole subtree is added up, children before parents.
+ * Inodes with several hard links are only counted the first time they are
+ * seen. Subtrees are added up in parallel by a work-stealing pool
+ * (ext2_pool.c).
+ */
+
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include "ext2.h"
+#include<errno.h>
+#include "ext2_utils.c"
+#include "ext2_pool.c"
+
+unsigned char *disk;
+struct inode_summary *inodes;  // Built before the walk, only read during it
+unsigned char *visited;  // Bitmap of the inodes counted so far
+int max_depth = -1;      // -1 for no limit
+int top_n = 0;           // 0 to print every directory as it completes
+
+/* A directory being added up. Its totals only include a subdirectory's once
+ * that is complete, pending counts the subdirectories still going plus one
+ * for its own listing.
+ */
+struct du_dir {
+	struct du_dir *parent;
+	char *path;
+	int depth;
+	int pending;
+	unsigned long long blocks;  // In 512-byte sectors, like i_blocks
+	unsigned long long size;
+};
+
+/* Completed directories kept for -n, appended under results_lock. */
+struct du_dir **results;
+int result_count = 0, result_cap = 0;
+pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* HELPERS */
+
+/* Adds the inode at index to dir's totals unless it has been counted. */
+void count_inode(struct du_dir *dir, int index) {
+	if (set_node(index, visited, 1) == 0) {
+		__atomic_fetch_add(&dir->blocks, inodes->blocks[index], __ATOMIC_RELAXED);
+		__atomic_fetch_add(&dir->size, inodes->size[index], __ATOMIC_RELAXED);
+	}
+}
+
+/* Reports dir, whose subtree is complete. */
+void report(struct du_dir *dir) {
+	if (max_depth != -1 && dir->depth > max_depth) {
+		free(dir->path);
+		free(dir);
+	} else if (top_n == 0) {
+		printf("%llu\t%llu\t%s\n", dir->blocks / 2, dir->size, dir->path);
+		free(dir->path);
+		free(dir);
+	} else {
+		pthread_mutex_lock(&results_lock);
+		if (result_count == result_cap) {
+			result_cap = result_cap ? result_cap * 2 : 256;
+			results = realloc(results, result_cap * sizeof(struct du_dir *));
+		}
+		results[result_count++] = dir;
+		pthread_mutex_unlock(&results_lock);
+	}
+}
+
+/* Drops one of dir's pending counts. The last one completes dir, which adds
+ * its totals to its parent and drops one of the parent's in turn.
+ */
+void finish_dir(struct du_dir *dir) {
+	while (dir != NULL && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct du_dir *parent = dir->parent;
+		if (parent != NULL) {
+			__atomic_fetch_add(&parent->blocks, dir->blocks, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&parent->size, dir->size, __ATOMIC_RELAXED);
+		}
+		report(dir);
+		dir = parent;
+	}
+}
+
+/* Where the entries of the directory being listed go. */
+struct list_state {
+	struct pool_queue *queue;
+	struct du_dir *dir;
+};
+
+/* Counts one directory entry, queueing it if it is a directory. */
+int list_entry(struct ext2_dir_entry *entry, void *arg) {
+	struct list_state *list = arg;
+	struct du_dir *dir = list->dir;
+	int index = entry->inode - 1;
+	if (!S_ISDIR(inodes->mode[index])) {
+		count_inode(dir, index);
+		return 0;
+	}
+	struct du_dir *child = calloc(1, sizeof(struct du_dir));
+	int len = strlen(dir->path);
+	child->parent = dir;
+	child->depth = dir->depth + 1;
+	child->pending = 1;
+	child->path = malloc(len + entry->name_len + 2);
+	sprintf(child->path, "%s%s%.*s", dir->path, dir->path[len - 1] == '/' ? "" : "/",
+			entry->name_len, entry->name);
+	__atomic_fetch_add(&dir->pending, 1, __ATOMIC_RELAXED);
+	pool_push(list->queue, index, child);
+	return 0;
+}
+
+/* Counts a directory and lists its entries. */
+void run_task(struct pool_queue *q, struct pool_task *task) {
+	struct du_dir *dir = task->data;
+	struct list_state list = {q, dir};
+	count_inode(dir, task->inode);
+	iterate_dir(disk, get_inode(disk, task->inode), list_entry, &list);
+	finish_dir(dir);
+}
+
+/* Orders directories by space used, largest first. */
+int by_blocks(const void *a, const void *b) {
+	const struct du_dir *x = *(struct du_dir **)a, *y = *(struct du_dir **)b;
+	return x->blocks < y->blocks ? 1 : x->blocks > y->blocks ? -1 : strcmp(x->path, y->path);
+}
+
+/* MAIN */
+int main(int argc, char **argv) {
+	parse_common_flags(&argc, argv);
+	int opt, bad = 0;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "d:n:j:")) != -1) {
+		switch (opt) {
+			case 'd':
+				max_depth = atoi(optarg);
+				break;
+			case 'n':
+				top_n = atoi(optarg);
+				break;
+			case 'j':
+				nthreads = atoi(optarg);
+				break;
+			default:
+				bad = 1;
+		}
+	}
+	if (bad || (optind != argc - 1 && optind != argc - 2)) {
+		fprintf(stderr, "Usage: %s [--stats] [--trace file] [-d depth] [-n count] [-j threads] "
+				"[disk] [path]\n", argv[0]);
+		exit(1);
+	}
+	if (nthreads < 1) nthreads = 1;
+	// Opening disk
+	int fd = open(argv[optind], O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "Disk image '%s' not found.\n", argv[optind]);
+		exit(ENOENT);
+	}
+	disk = map_disk(fd);
+	// Nothing changes under us while we walk, writers wait until we exit
+	lock_image(0);
+	char *start = optind == argc - 2 ? argv[optind + 1] : "/";
+	int root = lookup_path(disk, start);
+	if (root == -1 || get_inode_type(get_inode(disk, root)) != 'd') {
+		fprintf(stderr, "'%s' No such directory\n", start);
+		exit(ENOENT);
+	}
+
+	inodes = inode_summary(disk);
+	visited = calloc(get_super(disk)->s_inodes_count / 64 + 1, sizeof(uint64_t));
+	struct du_dir *top = calloc(1, sizeof(struct du_dir));
+	top->path = strdup(start);
+	top->pending = 1;
+	pool_run(nthreads, root, top, run_task);
+
+	if (top_n > 0) {
+		int i;
+		qsort(results, result_count, sizeof(struct du_dir *), by_blocks);
+		for (i = 0; i < result_count && i < top_n; i++) {
+			printf("%llu\t%llu\t%s\n", results[i]->blocks / 2, results[i]->size, results[i]->path);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * Takes one or two arguments, plus options:
+ * First: the name of an ext2 formatted disk.
+ * Second: the absolute path to start from (default /).
+ *
+ * -n: only paths whose last name matches a glob, e.g. '*.txt'.
+ * -t: only files of a type, f, d or l.
+ * -s: only files whose size is in a range min:max, in bytes unless suffixed
+ *     with K, M or G; either end may be left out, e.g. 1M: or :512.
+ * -c: only files whose ctime is in a range from:to, in seconds since the
+ *     epoch; either end may be left out.
+ * -j: number of threads (default one per CPU).
+ *
+ * The program should work like find, printing the path of every file under
+ * the start that matches all the options, as soon as it is found. Sibling
+ * subtrees are walked in parallel by a work-stealing pool (ext2_pool.c).
+ */
+
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<fnmatch.h>
+#include "ext2.h"
+#include<errno.h>
+#include "ext2_utils.c"
+#include "ext2_pool.c"
+
+unsigned char *disk;
+struct inode_summary *inodes;  // Built before the walk, only read during it
+
+/* Filters set from the command line, unset ends are 0 and ~0. */
+struct find_filter {
+	char *name;               // Glob for the last name, NULL for any
+	unsigned char type;       // 'f', 'd' or 'l', 0 for any
+	unsigned long long min_size, max_size;
+	unsigned long long min_ctime, max_ctime;
+};
+
+struct find_filter filter = {NULL, 0, 0, ~0ULL, 0, ~0ULL};
+
+/* HELPERS */
+
+/* Parses a size such as 512, 4K or 2M into bytes. */
+unsigned long long parse_bytes(char *arg) {
+	char *end;
+	unsigned long long n = strtoull(arg, &end, 10);
+	switch (*end) {
+		case 'G': case 'g': n *= 1024;
+		case 'M': case 'm': n *= 1024;
+		case 'K': case 'k': n *= 1024;
+	}
+	return n;
+}
+
+/* Parses a range "min:max" into its ends, leaving an end alone if it is
+ * missing. A single number is both ends.
+ */
+void parse_range(char *arg, unsigned long long *min, unsigned long long *max) {
+	char *colon = strchr(arg, ':');
+	if (colon == NULL) {
+		*min = *max = parse_bytes(arg);
+		return;
+	}
+	*colon = '\0';
+	if (*arg != '\0') *min = parse_bytes(arg);
+	if (colon[1] != '\0') *max = parse_bytes(colon + 1);
+}
+
+/* Returns 1 if the inode at index, named name, passes every filter. */
+int matches(unsigned int index, char *name) {
+	if (filter.type != 0 && get_mode_type(inodes->mode[index]) != filter.type) {
+		return 0;
+	}
+	if (inodes->size[index] < filter.min_size || inodes->size[index] > filter.max_size) {
+		return 0;
+	}
+	// ctime is not in the summary, so only this filter reads the inode
+	if (filter.min_ctime != 0 || filter.max_ctime != ~0ULL) {
+		unsigned int ctime = get_inode(disk, index)->i_ctime;
+		if (ctime < filter.min_ctime || ctime > filter.max_ctime) {
+			return 0;
+		}
+	}
+	return filter.name == NULL || fnmatch(filter.name, name, 0) == 0;
+}
+
+/* Where the entries of the directory being walked go. */
+struct walk_state {
+	struct pool_queue *queue;
+	char *path;
+};
+
+/* Queues one directory entry as a task. */
+int queue_entry(struct ext2_dir_entry *entry, void *arg) {
+	struct walk_state *walk = arg;
+	int len = strlen(walk->path);
+	char *path = malloc(len + entry->name_len + 2);
+	memcpy(path, walk->path, len);
+	if (len == 0 || path[len - 1] != '/') {
+		path[len++] = '/';
+	}
+	memcpy(path + len, entry->name, entry->name_len);
+	path[len + entry->name_len] = '\0';
+	pool_push(walk->queue, entry->inode - 1, path);
+	return 0;
+}
+
+/* Prints the task's path if it matches and queues its entries if it is a
+ * directory.
+ */
+void run_task(struct pool_queue *q, struct pool_task *task) {
+	char *path = task->data;
+	char *name = strrchr(path, '/');
+	name = (name != NULL && name[1] != '\0') ? name + 1 : path;
+	if (matches(task->inode, name)) {
+		printf("%s\n", path); // One call, so lines never interleave
+	}
+	if (S_ISDIR(inodes->mode[task->inode])) {
+		struct walk_state walk = {q, path};
+		iterate_dir(disk, get_inode(disk, task->inode), queue_entry, &walk);
+	}
+	free(path);
+}
+
+/* MAIN */
+int main(int argc, char **argv) {
+	parse_common_flags(&argc, argv);
+	int opt, bad = 0;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "n:t:s:c:j:")) != -1) {
+		switch (opt) {
+			case 'n':
+				filter.name = optarg;
+				break;
+			case 't':
+				filter.type = optarg[0];
+				break;
+			case 's':
+				parse_range(optarg, &filter.min_size, &filter.max_size);
+				break;
+			case 'c':
+				parse_range(optarg, &filter.min_ctime, &filter.max_ctime);
+				break;
+			case 'j':
+				nthreads = atoi(optarg);
+				break;
+			default:
+				bad = 1;
+		}
+	}
+	if (bad || (optind != argc - 1 && optind != argc - 2)) {
+		fprintf(stderr, "Usage: %s [--stats] [--trace file] [-n glob] [-t f|d|l] [-s min:max] "
+				"[-c from:to] [-j threads] [disk] [path]\n", argv[0]);
+		exit(1);
+	}
+	if (nthreads < 1) nthreads = 1;
+	// Opening disk
+	int fd = open(argv[optind], O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "Disk image '%s' not found.\n", argv[optind]);
+		exit(ENOENT);
+	}
+	disk = map_disk(fd);
+	// Nothing changes under us while we walk, writers wait until we exit
+	lock_image(0);
+	char *start = optind == argc - 2 ? argv[optind + 1] : "/";
+	int root = lookup_path(disk, start);
+	if (root == -1) {
+		fprintf(stderr, "'%s' No such file or directory\n", start);
+		exit(ENOENT);
+	}
+
+	inodes = inode_summary(disk);
+	// Hand every match on as it is found, even into a pipe
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	pool_run(nthreads, root, strdup(start), run_task);
+	return 0;
+}
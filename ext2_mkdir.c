@@ -1,10 +1,22 @@
 /*
- * Takes two arguments:
+ * Takes two or more arguments, plus options:
  * First: name of an ext2 formatted disk.
- * Second: absolute path on the ext2 formatted disk.
+ * Rest: absolute paths on the ext2 formatted disk.
  *
- * This program should work like mkdir, creating the final directory on the
- * specified path on the disk.
+ * -p: also create any missing parents, and let directories that already
+ *     exist be.
+ * -f: read more paths, one per line, from this manifest file (- for stdin).
+ *     Blank lines and lines starting with # are skipped. Implies -p.
+ *
+ * This program should work like mkdir, creating the final directory on each
+ * of the specified paths on the disk.
+ *
+ * All the paths are resolved first, each directory on disk searched once,
+ * into a tree of the directories to create. Their inodes and blocks are then
+ * allocated in one batch, the blocks back to back, their entries, "." and
+ * ".." included, are laid out in memory and the blocks are written in order.
+ * New directories under existing ones are added to those last, and every
+ * parent's link count and every group's directory count is updated once.
  */
 
 #include<stdio.h>
@@ -20,169 +32,377 @@
 #include<errno.h>
 #include "ext2_utils.c"
 
+#define MAX_BATCH_RUN 256   // Blocks reserved at a time for the new directories
+
 unsigned char *disk;
 struct ext2_super_block *sb;
 struct ext2_group_desc *desc;
+unsigned int bs;
 
-/* MAIN */
+/* A directory on a path being created: one that exists, or one to create. */
+struct mk_dir {
+	char *name;
+	int parent;         // Node of the parent, -1 for the root
+	int inode;          // Inode index, once allocated for a new directory
+	int is_new;
+	int locked;         // Held exclusively, for existing directories
+	int first_child;    // New directories under this one, linked by next
+	int last_child;
+	int next;
+	int new_children;
+	int nblocks;        // Blocks laid out in data, for new directories
+	unsigned char *data;
+	unsigned int used, last; // End of the entries in data, start of the last
+};
 
-int main(int argc, char **argv) {
-	// We need two arguments, so argc must be 3.
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s [disk] [path]\n", argv[0]);
-		exit(1);
+struct mk_dir *dirs;
+int dir_count = 0, dir_cap = 0;
+
+/* Hash of (parent node, name) to node, so each name is looked up once. */
+int *dir_table;
+unsigned int table_size = 0;
+
+/* HELPERS */
+
+/* Returns the table slot for name under node parent, empty (-1) if there is
+ * no such node.
+ */
+int *table_slot(int parent, char *name) {
+	unsigned int h = parent * 0x9E3779B1u;
+	char *c;
+	for (c = name; *c; c++) {
+		h = (h ^ (unsigned char)*c) * 16777619u;
 	}
-	// Opening disk
-	int fd = open(argv[1], O_RDWR);
-	if (!fd) {
-		fprintf(stderr, "Disk image '%s' not found.", argv[1]);
-		exit(ENOENT);
+	int *slot = &dir_table[h & (table_size - 1)];
+	while (*slot != -1 && (dirs[*slot].parent != parent || strcmp(dirs[*slot].name, name) != 0)) {
+		if (++slot == dir_table + table_size) {
+			slot = dir_table;
+		}
 	}
-	// mmap the disk
-	disk = mmap(NULL, 128*1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (disk == MAP_FAILED) {
-		perror("mmap");
-		exit(1);
+	return slot;
+}
+
+/* Adds a node for name under parent and returns it. */
+int add_node(int parent, char *name, int inode, int is_new) {
+	if (dir_count == dir_cap) {
+		dir_cap = dir_cap ? dir_cap * 2 : 64;
+		dirs = realloc(dirs, dir_cap * sizeof(struct mk_dir));
 	}
-	// Grabbing super block and block descriptor
-	sb = (struct ext2_super_block *)(disk + 1024);
-	desc = (struct ext2_group_desc *)(disk + 2*1024);
-	// Getting the parent inode index
-	int parent_inode_index = check_parent(disk, argv[2]);
-	if (parent_inode_index == -1) { // Directory not found.
-		fprintf(stderr, "Directory does not exist.");
+	if (2 * (dir_count + 1) > table_size) { // Keep the table at most half full
+		int i;
+		free(dir_table);
+		table_size = table_size ? table_size * 2 : 128;
+		dir_table = malloc(table_size * sizeof(int));
+		memset(dir_table, -1, table_size * sizeof(int));
+		for (i = 1; i < dir_count; i++) {
+			*table_slot(dirs[i].parent, dirs[i].name) = i;
+		}
+	}
+	int n = dir_count++;
+	memset(&dirs[n], 0, sizeof(struct mk_dir));
+	dirs[n].name = strdup(name);
+	dirs[n].parent = parent;
+	dirs[n].inode = inode;
+	dirs[n].is_new = is_new;
+	dirs[n].first_child = dirs[n].last_child = dirs[n].next = -1;
+	if (parent != -1) {
+		*table_slot(parent, name) = n;
+	}
+	if (is_new) {
+		struct mk_dir *p = &dirs[parent];
+		if (p->last_child == -1) {
+			p->first_child = n;
+		} else {
+			dirs[p->last_child].next = n;
+		}
+		p->last_child = n;
+		p->new_children++;
+	}
+	return n;
+}
+
+/* Looks name up in the existing directory of node parent. The directory is
+ * held exclusively from the first time a name is not found in it, until we
+ * exit, so nobody else creates the name meanwhile.
+ * Returns the index of the inode found, -1 if there is none.
+ */
+int search_existing(int parent, char *name) {
+	struct mk_dir *p = &dirs[parent];
+	int found;
+	if (!p->locked) {
+		lock_inode(disk, p->inode, 0);
+		found = search_directories(disk, get_inode(disk, p->inode), name, 0);
+		unlock_inode(disk, p->inode);
+		if (found != -1) {
+			return found;
+		}
+		lock_inode(disk, p->inode, 1);
+		p->locked = 1;
+	}
+	return search_directories(disk, get_inode(disk, p->inode), name, 0);
+}
+
+/* Adds the directories on path to the tree, creating only the last one
+ * unless parents is set. Exits if path cannot be created.
+ */
+void add_path(char *path, int parents) {
+	char *copy = hold_mem(strdup(path)), *tail = copy, *name;
+	int node = 0;
+	if (path[0] != '/') {
+		fprintf(stderr, "Invalid directory.\n");
 		exit(ENOENT);
 	}
-	// Get new dir name
-	int i;
-	int dir_len = 0;
-	if (argv[2][strlen(argv[2]) -1] == '/') argv[2][strlen(argv[2])-1] = '\0';
-	for (i = strlen(argv[2]); argv[2][i] != '/'; i--) {
-		dir_len++;
-		if (dir_len > 255) {
+	while ((name = strsep(&tail, "/")) != NULL) {
+		if (name[0] == '\0' || strcmp(name, ".") == 0) {
+			continue;
+		}
+		if (strcmp(name, "..") == 0) {
+			fprintf(stderr, "Invalid directory.\n");
+			exit(ENOENT);
+		}
+		if (strlen(name) > EXT2_NAME_LEN) {
 			fprintf(stderr, "Directory name too large.");
 			exit(1);
 		}
+		// The rest of the path, to tell the last name from the others
+		char *rest = tail;
+		while (rest != NULL && *rest == '/') rest++;
+		int last = rest == NULL || *rest == '\0';
+		int *slot = table_slot(node, name);
+		int child = *slot;
+		stats.path_components++;
+		if (child == -1 && !dirs[node].is_new) {
+			int found = search_existing(node, name);
+			if (found != -1) {
+				if (get_inode_type(get_inode(disk, found)) != 'd') {
+					fprintf(stderr, "'%s' is not a directory.\n", name);
+					exit(parents || !last ? ENOTDIR : EEXIST);
+				}
+				child = add_node(node, name, found, 0);
+			}
+		}
+		if (child != -1) {
+			if (last && !parents) {
+				fprintf(stderr, "Directory name already in use.\n");
+				exit(EEXIST);
+			}
+		} else if (!last && !parents) {
+			fprintf(stderr, "Directory does not exist.");
+			exit(ENOENT);
+		} else {
+			child = add_node(node, name, -1, 1);
+		}
+		node = child;
 	}
-	char new_dir[dir_len];
-	strcpy(new_dir, argv[2] + i + 1);
-	// Check that there aren't any files with that name.
-	struct ext2_inode *parent = (struct ext2_inode *)((disk + 1024 * desc->bg_inode_table) +
-		   											(sb->s_inode_size * parent_inode_index));
-	if (search_directories(disk, parent, new_dir, 0) != -1) {
+	if (node == 0 && !parents) {
 		fprintf(stderr, "Directory name already in use.\n");
 		exit(EEXIST);
 	}
-	// Finding a free inode and allocating (set to 1)
-	unsigned char *imap = (unsigned char *)(disk + 1024 * desc->bg_inode_bitmap);
-	int inode;
-	for (inode = 11; inode < sb->s_inodes_count; inode++) {
-		if (check_node(inode, imap) == 0) {
-			break;
+	drop_mem(copy);
+}
+
+/* Adds every path listed in the manifest at file, - for stdin. */
+void read_manifest(char *file) {
+	FILE *in = strcmp(file, "-") == 0 ? stdin : hold_file(fopen(file, "r"));
+	char line[4096];
+	if (in == NULL) {
+		perror(file);
+		exit(ENOENT);
+	}
+	while (fgets(line, sizeof(line), in) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#') {
+			continue;
 		}
+		add_path(line, 1);
 	}
-	if (inode == sb->s_inodes_count) { // Maximum reached, no more inodes
-		fprintf(stderr, "No more inodes available.");
-		exit(1);
+	if (in != stdin) {
+		drop_file(in);
 	}
-	// Finding a free block and allocating (set to 1)
-	unsigned char *bmap = (unsigned char *)(disk + 1024 * desc->bg_block_bitmap);
-	int bnode;
-	for (bnode = 22; bnode < sb->s_blocks_count; bnode++) {
-		if (check_node(bnode, bmap) == 0) {
-			break;
+}
+
+/* Appends an entry to the blocks laid out for new directory d, starting a
+ * new block when the current one is full.
+ */
+void layout_entry(struct mk_dir *d, char *name, int inode) {
+	unsigned int need = entry_size(strlen(name));
+	if (d->nblocks == 0 || d->used + need > d->nblocks * bs) {
+		if (d->nblocks > 0) { // The last entry takes up the rest of its block
+			((struct ext2_dir_entry *)(d->data + d->last))->rec_len = d->nblocks * bs - d->last;
 		}
+		d->data = realloc(d->data, (d->nblocks + 1) * bs);
+		memset(d->data + d->nblocks * bs, 0, bs);
+		d->used = d->nblocks++ * bs;
 	}
-	if (bnode == sb->s_blocks_count) {
-		fprintf(stderr, "No more blocks available.");
+	struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(d->data + d->used);
+	entry->inode = inode + 1;
+	entry->rec_len = need;
+	entry->name_len = strlen(name);
+	entry->file_type = EXT2_FT_DIR;
+	memcpy(entry->name, name, entry->name_len);
+	d->last = d->used;
+	d->used += need;
+}
+
+/* Lays out the blocks of new directory d: ".", ".." and its new children. */
+void layout_dir(struct mk_dir *d) {
+	int c;
+	layout_entry(d, ".", d->inode);
+	layout_entry(d, "..", dirs[d->parent].inode);
+	for (c = d->first_child; c != -1; c = dirs[c].next) {
+		layout_entry(d, dirs[c].name, dirs[c].inode);
+	}
+	((struct ext2_dir_entry *)(d->data + d->last))->rec_len = d->nblocks * bs - d->last;
+}
+
+/* MAIN */
+
+int main(int argc, char **argv) {
+	parse_common_flags(&argc, argv);
+	int parents = 0, i, j;
+	char *manifest = NULL;
+	// Take out -p and -f wherever they are
+	for (i = 1, j = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-p") == 0) {
+			parents = 1;
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			manifest = argv[++i];
+			parents = 1;
+		} else {
+			argv[j++] = argv[i];
+		}
+	}
+	argc = j;
+	if (argc < (manifest != NULL ? 2 : 3)) {
+		fprintf(stderr, "Usage: %s [--stats] [--trace file] [-p] [-f manifest] [disk] [path...]\n",
+				argv[0]);
 		exit(1);
 	}
-	// Actual allocation.
-	set_node(inode, imap);
-	set_node(bnode, bmap);
-	adjust_free_blocks(-1, sb, desc);
-	adjust_free_inodes(-1, sb, desc);
-	// Writing data to the ext2_inode struct in the inode index.
-	struct ext2_inode *new_inode = (struct ext2_inode *)((disk + 1024 * desc->bg_inode_table)
-														 + (sb->s_inode_size * (inode)));
-	new_inode->i_mode = EXT2_S_IFDIR;
-	new_inode->i_uid = 0;
-	new_inode->i_size = 1024;
-	new_inode->i_ctime = (unsigned int) time(0);
-	new_inode->i_dtime = 0;
-	new_inode->i_gid = 0;
-	new_inode->i_blocks = 2;
-	new_inode->osd1 = 0;
-	new_inode->i_block[0] = bnode;
-	new_inode->i_generation = 0;
-	new_inode->i_file_acl = 0;
-	new_inode->i_dir_acl = 0;
-	new_inode->i_faddr = 0;
-	new_inode->i_links_count = 2; // Itself and from parent.
-	parent->i_links_count++; // Parent gets one more link from parent dir in new directory.
-	// Adding self and parent directories to allocated block.
-	struct ext2_dir_entry *self = (struct ext2_dir_entry *)(disk + (1024 * bnode));
-	self->inode = inode + 1; // the variable inode is the index, not actual inode.
-	self->rec_len = 12; // self rec-len is always 12
-	self->name_len = 1; // length of . is 1
-	self->file_type = EXT2_FT_DIR;
-	strncpy(self->name, ".", 1);
-	struct ext2_dir_entry *par = (struct ext2_dir_entry *)(disk + (1024 * bnode) + self->rec_len);
-	par->inode = parent_inode_index + 1;
-	par->rec_len = 1024 - 12; // Fill in the rest of the 1024 bytes of space
-	par->name_len = 2; // length of .. is 2
-	par->file_type = EXT2_FT_DIR;
-	strncpy(par->name, "..", 2);
-	// Adding new inode/directory entry into the parent block.
-	int par_block_index = 0;
-	for (i = 0; parent->i_block[i] != 0; i++) {
-		par_block_index = parent->i_block[i];
-	}
-	int total_rec_len;
-	struct ext2_dir_entry *curdir = (struct ext2_dir_entry *)(disk + (1024 * par_block_index));
-	// When this for loop exits, curdir should be the last directory 
-	for (total_rec_len = 0; total_rec_len + curdir->rec_len < 1024; ) {
-		total_rec_len += curdir->rec_len;
-		curdir = (struct ext2_dir_entry *)(disk + (1024 * par_block_index) + total_rec_len);
-	}
-	// Check there's enough space to place the new dir entry in the current block
-	// Reuse total_rec_len to find remaining bytes if curdir was reduced to proper size
-	struct ext2_dir_entry *newdir;
-	int remaining_rec_len = sizeof(curdir) + curdir->name_len; // Actual size of curdir
-	remaining_rec_len += 4 - (remaining_rec_len % 4); // Add padding
-	remaining_rec_len = 1024 - remaining_rec_len - total_rec_len; // Remaining space
-	if (remaining_rec_len < (8 + strlen(new_dir))) { // Not enough space
-		// Allocate new block
-		int newblock;
-		for (newblock = 22; newblock < sb->s_blocks_count; newblock++) {
-			if (check_node(newblock, bmap) == 0) {
-				break;
-			}
+	// Opening disk
+	int fd = hold_fd(open(argv[1], O_RDWR));
+	if (!fd) {
+		fprintf(stderr, "Disk image '%s' not found.", argv[1]);
+		exit(ENOENT);
+	}
+	// mmap the whole disk
+	disk = map_disk(fd);
+	// Keep the checksum sidecar, if there is one, in step with what we write
+	track_checksums(disk, argv[1]);
+	// Grabbing super block and block descriptor
+	sb = get_super(disk);
+	desc = get_group_desc(disk, 0);
+	bs = get_block_size(disk);
+
+	// Resolve every path into the tree of directories to create
+	double start = trace_begin();
+	add_node(-1, "", EXT2_ROOT_INO - 1, 0);
+	for (i = 2; i < argc; i++) {
+		add_path(argv[i], parents);
+	}
+	if (manifest != NULL) {
+		read_manifest(manifest);
+	}
+	trace_end("path resolution", start);
+
+	// Inodes first, so every entry can be laid out with its inode number.
+	// Directories are counted per group once they are all allocated.
+	start = trace_begin();
+	unsigned int groups = get_group_count(disk), g;
+	int group_dirs[groups];
+	memset(group_dirs, 0, sizeof(group_dirs));
+	int owner = -1;
+	for (i = 0; i < dir_count; i++) {
+		if (!dirs[i].is_new) {
+			continue;
 		}
-		if (newblock == sb->s_blocks_count) {
-			fprintf(stderr, "No more blocks available.");
+		dirs[i].inode = alloc_inode(disk, 0);
+		if (dirs[i].inode == -1) { // Maximum reached, no more inodes
+			fprintf(stderr, "No more inodes available.");
 			exit(1);
 		}
-		set_node(newblock, bmap);
-		adjust_free_blocks(-1, sb, desc);
-		parent->i_block[i] = newblock; // i should still hold the first block space unused by parent
-		parent->i_blocks += 2; // One more block being added
-		newdir = (struct ext2_dir_entry *)(disk + (1024 * newblock));
-		newdir->rec_len = 1024; // Takes up the whole of the new block.
-	} else { // Enough space
-		// Change curdir, add new directory
-		curdir->rec_len = sizeof(curdir) + curdir->name_len;
-		curdir->rec_len += 4 - (curdir->rec_len % 4);
-		total_rec_len += curdir->rec_len;
-		newdir = (struct ext2_dir_entry *)(disk + (1024 * par_block_index) + total_rec_len);
-		newdir->rec_len = 1024 - total_rec_len; // Takes up the rest of the block.
-	}
-	newdir->inode = inode + 1;
-	newdir->name_len = strlen(new_dir);
-	newdir->file_type = EXT2_FT_DIR;
-	strncpy(newdir->name, new_dir, newdir->name_len);
-
-	// Done with the directories, minor upkeep
-	desc->bg_used_dirs_count++;
+		group_dirs[dirs[i].inode / sb->s_inodes_per_group]++;
+		if (owner == -1) {
+			owner = dirs[i].inode;
+		}
+	}
+	for (g = 0; g < groups; g++) {
+		if (group_dirs[g] != 0) {
+			__atomic_fetch_add(&get_group_desc(disk, g)->bg_used_dirs_count, group_dirs[g],
+					__ATOMIC_RELAXED);
+		}
+	}
+	trace_end("inode allocation", start);
+
+	// Lay out the new directories' blocks, then allocate them back to back
+	// from windows shared by the batch, and write them in order
+	start = trace_begin();
+	int remaining = 0;
+	for (i = 0; i < dir_count; i++) {
+		if (dirs[i].is_new) {
+			layout_dir(&dirs[i]);
+			remaining += dirs[i].nblocks;
+		}
+	}
+	unsigned int now = (unsigned int) time(0);
+	for (i = 0; i < dir_count; i++) {
+		struct mk_dir *d = &dirs[i];
+		int k;
+		if (!d->is_new) {
+			continue;
+		}
+		// Writing data to the ext2_inode struct in the inode index.
+		struct ext2_inode *new_inode = get_inode(disk, d->inode);
+		new_inode->i_mode = EXT2_S_IFDIR;
+		new_inode->i_uid = 0;
+		new_inode->i_size = d->nblocks * bs;
+		new_inode->i_ctime = now;
+		new_inode->i_dtime = 0;
+		new_inode->i_gid = 0;
+		new_inode->i_blocks = d->nblocks * bs / 512;
+		new_inode->osd1 = 0;
+		memset(new_inode->i_block, 0, sizeof(new_inode->i_block));
+		new_inode->i_generation = 0;
+		new_inode->i_file_acl = 0;
+		new_inode->i_dir_acl = 0;
+		new_inode->i_faddr = 0;
+		// Itself, its parent's entry, and the ".." of each new child
+		new_inode->i_links_count = 2 + d->new_children;
+		for (k = 0; k < d->nblocks; k++) {
+			int block = alloc_block_run(disk, owner, remaining < MAX_BATCH_RUN ? remaining : MAX_BATCH_RUN);
+			if (block == -1) {
+				fprintf(stderr, "No more blocks available.");
+				exit(1);
+			}
+			remaining--;
+			// Past the direct blocks this allocates the indirect ones too
+			if (map_file_block(disk, d->inode, new_inode, k, block) == -1) {
+				fprintf(stderr, "No more blocks available.");
+				exit(1);
+			}
+			memcpy(get_new_block(disk, block), d->data + k * bs, bs);
+		}
+		summary_update(disk, d->inode);
+		free(d->data);
+		d->data = NULL;
+		release_blocks();
+	}
+	trace_end("directory build", start);
+
+	// Adding the new directories to the existing ones they are in
+	for (i = 0; i < dir_count; i++) {
+		struct mk_dir *d = &dirs[i];
+		int c;
+		if (d->is_new || d->new_children == 0) {
+			continue;
+		}
+		for (c = d->first_child; c != -1; c = dirs[c].next) {
+			add_dir_entry(disk, d->inode, dirs[c].name, dirs[c].inode, EXT2_FT_DIR);
+		}
+		// Each new child's ".." links to it
+		get_inode(disk, d->inode)->i_links_count += d->new_children;
+		summary_update(disk, d->inode);
+		release_blocks();
+	}
+
 	return 0;
 }
@@ -0,0 +1,332 @@
+/*
+ * Takes two arguments, plus options:
+ * First: the name of the image to create (or a block device).
+ * Second: the size of the file system, in KiB unless suffixed with K, M or G.
+ *
+ * -b: block size, 1024, 2048 or 4096 (default 1024).
+ * -i: inodes per group (default one inode per 4 KiB of space).
+ * -N: total number of inodes, spread evenly over the groups.
+ * -g: number of block groups (default as few as the block size allows).
+ *
+ * The program should work like mke2fs, writing an empty ext2 file system
+ * (root directory and lost+found) with the requested geometry.
+ */
+
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<time.h>
+#include "ext2.h"
+#include<errno.h>
+#include "ext2_utils.c"
+
+#define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT2_LOST_FOUND_INO 11
+#define BYTES_PER_INODE 4096
+#define ZERO_CHUNK (1024 * 1024)
+
+int fd;
+unsigned int block_size;
+
+/* HELPERS */
+
+/* Parses a size such as 128, 64M or 2G into bytes. Plain numbers are KiB. */
+long long parse_size(char *arg) {
+	char *end;
+	long long size = strtoll(arg, &end, 10);
+	switch (*end) {
+		case 'G': case 'g': size *= 1024;
+		case 'M': case 'm': size *= 1024;
+		case 'K': case 'k': case '\0': size *= 1024; break;
+		default: return -1;
+	}
+	return size;
+}
+
+/* Writes len bytes of buf at block number block, offset bytes into it. */
+void write_block(unsigned int block, unsigned int offset, void *buf, size_t len) {
+	if (pwrite(fd, buf, len, (off_t)block * block_size + offset) != len) {
+		perror("pwrite");
+		exit(1);
+	}
+}
+
+/* Zeroes len bytes at off, with fallocate if the file supports it and with
+ * large sequential writes otherwise.
+ */
+void zero_range(off_t off, off_t len) {
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (fallocate(fd, FALLOC_FL_ZERO_RANGE, off, len) == 0) {
+		return;
+	}
+#endif
+	static char *zeros = NULL;
+	if (zeros == NULL) {
+		zeros = calloc(1, ZERO_CHUNK);
+	}
+	while (len > 0) {
+		size_t n = len < ZERO_CHUNK ? len : ZERO_CHUNK;
+		if (pwrite(fd, zeros, n, off) != n) {
+			perror("pwrite");
+			exit(1);
+		}
+		off += n;
+		len -= n;
+	}
+}
+
+/* Sets bits from..to-1 in the bitmap map. */
+void set_range(unsigned char *map, int from, int to) {
+	int i;
+	for (i = from; i < to; i++) {
+		set_node(i, map, 1);
+	}
+}
+
+/* Fills in a directory inode owning the single block block. */
+void init_dir_inode(struct ext2_inode *ip, unsigned short perm, unsigned int block,
+		unsigned short links, unsigned int now) {
+	memset(ip, 0, sizeof(struct ext2_inode));
+	ip->i_mode = EXT2_S_IFDIR | perm;
+	ip->i_size = block_size;
+	ip->i_atime = ip->i_ctime = ip->i_mtime = now;
+	ip->i_links_count = links;
+	ip->i_blocks = block_size / 512;
+	ip->i_block[0] = block;
+}
+
+/* Appends an entry to the directory block buf at offset off.
+ * Returns the offset of the next entry. last makes it span the rest of the block.
+ */
+int add_entry(unsigned char *buf, int off, unsigned int inode, char *name, int last) {
+	struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(buf + off);
+	entry->inode = inode;
+	entry->name_len = strlen(name);
+	entry->file_type = EXT2_FT_DIR;
+	memcpy(entry->name, name, entry->name_len);
+	entry->rec_len = last ? block_size - off : (8 + entry->name_len + 3) & ~3;
+	return off + entry->rec_len;
+}
+
+/* MAIN */
+
+int main(int argc, char **argv) {
+	unsigned int log_block_size = 0;
+	unsigned int inodes_per_group = 0;
+	unsigned int total_inodes = 0;
+	unsigned int groups = 0;
+	int c;
+	while ((c = getopt(argc, argv, "b:i:N:g:")) != -1) {
+		switch (c) {
+			case 'b':
+				block_size = atoi(optarg);
+				for (log_block_size = 0; (1024U << log_block_size) < block_size; log_block_size++);
+				if (block_size != 1024 && block_size != 2048 && block_size != 4096) {
+					fprintf(stderr, "Block size must be 1024, 2048 or 4096.\n");
+					exit(1);
+				}
+				break;
+			case 'i': inodes_per_group = atoi(optarg); break;
+			case 'N': total_inodes = atoi(optarg); break;
+			case 'g': groups = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-b block size] [-i inodes per group | -N inodes] "
+						"[-g groups] [disk] [size]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, "Usage: %s [-b block size] [-i inodes per group | -N inodes] "
+				"[-g groups] [disk] [size]\n", argv[0]);
+		exit(1);
+	}
+	if (block_size == 0) block_size = 1024;
+	long long size = parse_size(argv[optind + 1]);
+	if (size <= 0) {
+		fprintf(stderr, "Invalid size '%s'.\n", argv[optind + 1]);
+		exit(1);
+	}
+
+	/* Geometry */
+	unsigned int first_data_block = block_size == 1024 ? 1 : 0;
+	unsigned int blocks_count = size / block_size;
+	unsigned int max_per_group = 8 * block_size; // One bitmap block per group
+	unsigned int blocks_per_group = max_per_group;
+	if (groups > 0) {
+		blocks_per_group = (blocks_count - first_data_block + groups - 1) / groups;
+		blocks_per_group = (blocks_per_group + 7) & ~7;
+		if (blocks_per_group > max_per_group) {
+			fprintf(stderr, "Too few groups, at most %u blocks fit in a group.\n", max_per_group);
+			exit(1);
+		}
+	}
+	groups = (blocks_count - first_data_block + blocks_per_group - 1) / blocks_per_group;
+	unsigned int gdt_blocks = (groups * sizeof(struct ext2_group_desc) + block_size - 1) / block_size;
+
+	// Inodes per group must fill whole inode table blocks and whole bitmap bytes.
+	unsigned int inodes_per_block = block_size / sizeof(struct ext2_inode);
+	if (inodes_per_group == 0) {
+		if (total_inodes > 0) {
+			inodes_per_group = (total_inodes + groups - 1) / groups;
+		} else {
+			inodes_per_group = (long long)blocks_per_group * block_size / BYTES_PER_INODE;
+			if (groups == 1) {
+				inodes_per_group = (long long)(blocks_count - first_data_block) * block_size / BYTES_PER_INODE;
+			}
+		}
+	}
+	if (inodes_per_group < 16) inodes_per_group = 16;
+	inodes_per_group = (inodes_per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+	if (inodes_per_group > max_per_group) {
+		fprintf(stderr, "Too many inodes, at most %u fit in a group.\n", max_per_group);
+		exit(1);
+	}
+	unsigned int itable_blocks = inodes_per_group / inodes_per_block;
+	unsigned int overhead = 1 + gdt_blocks + 2 + itable_blocks;
+
+	// Drop a last group too small to hold its own metadata and some data.
+	unsigned int last_size = blocks_count - first_data_block - (groups - 1) * blocks_per_group;
+	if (last_size < overhead + 16) {
+		if (groups == 1) {
+			fprintf(stderr, "File system too small.\n");
+			exit(1);
+		}
+		groups--;
+		blocks_count = first_data_block + groups * blocks_per_group;
+	}
+
+	/* Image */
+	char *disk_path = argv[optind];
+	fd = open(disk_path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		perror(disk_path);
+		exit(1);
+	}
+	struct stat st;
+	fstat(fd, &st);
+	// A fresh sparse file reads back as zeroes, so only devices need zeroing.
+	int needs_zeroing = !S_ISREG(st.st_mode);
+	if (!needs_zeroing && (ftruncate(fd, 0) == -1 ||
+			ftruncate(fd, (off_t)blocks_count * block_size) == -1)) {
+		perror("ftruncate");
+		exit(1);
+	}
+
+	unsigned int now = (unsigned int) time(0);
+	struct ext2_super_block sb;
+	memset(&sb, 0, sizeof(sb));
+	sb.s_inodes_count = groups * inodes_per_group;
+	sb.s_blocks_count = blocks_count;
+	sb.s_first_data_block = first_data_block;
+	sb.s_log_block_size = log_block_size;
+	sb.s_log_frag_size = log_block_size;
+	sb.s_blocks_per_group = blocks_per_group;
+	sb.s_frags_per_group = blocks_per_group;
+	sb.s_inodes_per_group = inodes_per_group;
+	sb.s_wtime = now;
+	sb.s_max_mnt_count = 0xFFFF;
+	sb.s_magic = EXT2_SUPER_MAGIC;
+	sb.s_state = 1; // Cleanly unmounted
+	sb.s_errors = 1; // Continue
+	sb.s_lastcheck = now;
+	sb.s_rev_level = 1; // Dynamic
+	sb.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+	sb.s_inode_size = sizeof(struct ext2_inode);
+	sb.s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+	sb.s_feature_compat = EXT2_FEATURE_COMPAT_DIR_PREALLOC;
+	sb.s_prealloc_blocks = PREALLOC_DEFAULT_BLOCKS;
+	sb.s_prealloc_dir_blocks = PREALLOC_DEFAULT_DIR_BLOCKS;
+	int i;
+	srand(now ^ getpid());
+	for (i = 0; i < 16; i++) {
+		sb.s_uuid[i] = rand() & 0xff;
+	}
+
+	struct ext2_group_desc *gdt = calloc(gdt_blocks, block_size);
+	unsigned char *bmap = malloc(block_size);
+	unsigned char *imap = malloc(block_size);
+	unsigned int g;
+	for (g = 0; g < groups; g++) {
+		unsigned int start = first_data_block + g * blocks_per_group;
+		unsigned int group_blocks = (g == groups - 1) ?
+			blocks_count - start : blocks_per_group;
+		struct ext2_group_desc *desc = &gdt[g];
+		desc->bg_block_bitmap = start + 1 + gdt_blocks;
+		desc->bg_inode_bitmap = desc->bg_block_bitmap + 1;
+		desc->bg_inode_table = desc->bg_inode_bitmap + 1;
+		desc->bg_free_blocks_count = group_blocks - overhead;
+		desc->bg_free_inodes_count = inodes_per_group;
+
+		// Metadata and the bits past the end of the group are in use.
+		memset(bmap, 0, block_size);
+		memset(imap, 0, block_size);
+		set_range(bmap, 0, overhead);
+		set_range(bmap, group_blocks, 8 * block_size);
+		set_range(imap, inodes_per_group, 8 * block_size);
+		if (g == 0) {
+			// Reserved inodes, the root directory and lost+found with a block each.
+			set_range(imap, 0, EXT2_LOST_FOUND_INO);
+			set_range(bmap, overhead, overhead + 2);
+			desc->bg_free_inodes_count -= EXT2_LOST_FOUND_INO;
+			desc->bg_free_blocks_count -= 2;
+			desc->bg_used_dirs_count = 2;
+		}
+		write_block(desc->bg_block_bitmap, 0, bmap, block_size);
+		write_block(desc->bg_inode_bitmap, 0, imap, block_size);
+		if (needs_zeroing) {
+			zero_range((off_t)desc->bg_inode_table * block_size, (off_t)itable_blocks * block_size);
+		}
+		sb.s_free_blocks_count += desc->bg_free_blocks_count;
+		sb.s_free_inodes_count += desc->bg_free_inodes_count;
+	}
+
+	// Superblock and descriptor table, with a backup copy in every group.
+	for (g = 0; g < groups; g++) {
+		unsigned int start = first_data_block + g * blocks_per_group;
+		sb.s_block_group_nr = g;
+		if (g == 0) {
+			write_block(0, 1024, &sb, sizeof(sb));
+		} else {
+			write_block(start, 0, &sb, sizeof(sb));
+		}
+		write_block(start + 1, 0, gdt, gdt_blocks * block_size);
+	}
+
+	// Root directory and lost+found.
+	unsigned int root_block = first_data_block + overhead;
+	unsigned int lost_block = root_block + 1;
+	struct ext2_inode inode;
+	unsigned char *dir = calloc(1, block_size);
+	init_dir_inode(&inode, 0755, root_block, 3, now);
+	write_block(gdt[0].bg_inode_table, (EXT2_ROOT_INO - 1) * sizeof(inode), &inode, sizeof(inode));
+	init_dir_inode(&inode, 0700, lost_block, 2, now);
+	write_block(gdt[0].bg_inode_table, (EXT2_LOST_FOUND_INO - 1) * sizeof(inode), &inode, sizeof(inode));
+	int off = add_entry(dir, 0, EXT2_ROOT_INO, ".", 0);
+	off = add_entry(dir, off, EXT2_ROOT_INO, "..", 0);
+	add_entry(dir, off, EXT2_LOST_FOUND_INO, "lost+found", 1);
+	write_block(root_block, 0, dir, block_size);
+	memset(dir, 0, block_size);
+	off = add_entry(dir, 0, EXT2_LOST_FOUND_INO, ".", 0);
+	add_entry(dir, off, EXT2_ROOT_INO, "..", 1);
+	write_block(lost_block, 0, dir, block_size);
+
+	if (fsync(fd) == -1 && errno != EINVAL) {
+		perror("fsync");
+		exit(1);
+	}
+	printf("%u blocks of %u bytes, %u inodes, %u groups\n", blocks_count, block_size,
+			sb.s_inodes_count, groups);
+	free(dir);
+	free(gdt);
+	free(bmap);
+	free(imap);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Work-stealing thread pool for the tools that walk the directory tree,
+ * included after ext2_utils.c by the ones that need it (and linked with
+ * -pthread).
+ *
+ * Every thread has its own queue of tasks. It pushes and pops at the tail,
+ * so it works depth first, and when it runs dry it steals from the head of
+ * the others' queues, where the biggest unexplored subtrees are. A thread
+ * that finds nothing to steal sleeps until a task is pushed. The walk is
+ * over when no task is queued or running.
+ */
+
+#ifndef EXT2_POOL_C
+#define EXT2_POOL_C
+
+#include<pthread.h>
+
+/* A task: an inode to look at and whatever the tool keeps with it. */
+struct pool_task {
+	int inode;
+	void *data;
+};
+
+/* A thread's queue, both ends under the lock, which the owner rarely has to
+ * wait for.
+ */
+struct pool_queue {
+	pthread_mutex_t lock;
+	struct pool_task *tasks;
+	int head, tail, cap;
+};
+
+/* Runs one task. New tasks go on q, the running thread's own queue. */
+typedef void (*pool_fn)(struct pool_queue *q, struct pool_task *task);
+
+struct pool_queue *pool_queues;
+int pool_threads;
+pool_fn pool_run_task;
+long pool_pending = 0;  // Tasks queued or running, the walk is over at 0
+int pool_idle = 0;      // Threads asleep, or about to be, waiting for tasks
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+
+/* Wakes the threads waiting for tasks, all of them if all is set. */
+void pool_signal(int all) {
+	pthread_mutex_lock(&pool_lock);
+	if (all) {
+		pthread_cond_broadcast(&pool_wake);
+	} else {
+		pthread_cond_signal(&pool_wake);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Adds a task to the tail of queue q. */
+void pool_push(struct pool_queue *q, int inode, void *data) {
+	__atomic_fetch_add(&pool_pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&q->lock);
+	if (q->head == q->tail) {
+		q->head = q->tail = 0;
+	}
+	if (q->tail == q->cap) {
+		q->cap = q->cap ? q->cap * 2 : 64;
+		q->tasks = realloc(q->tasks, q->cap * sizeof(struct pool_task));
+	}
+	q->tasks[q->tail].inode = inode;
+	q->tasks[q->tail].data = data;
+	q->tail++;
+	pthread_mutex_unlock(&q->lock);
+	// A thread going idle counts itself before it looks at the queues, so
+	// either it sees this task or it is woken for it
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool_idle, __ATOMIC_RELAXED) > 0) {
+		pool_signal(0);
+	}
+}
+
+/* Returns 1 if some queue has a task. */
+int pool_has_tasks() {
+	int i, any = 0;
+	for (i = 0; i < pool_threads && !any; i++) {
+		pthread_mutex_lock(&pool_queues[i].lock);
+		any = pool_queues[i].head < pool_queues[i].tail;
+		pthread_mutex_unlock(&pool_queues[i].lock);
+	}
+	return any;
+}
+
+/* Takes a task from the tail of q if steal is 0, the head otherwise.
+ * Returns 1 if there was one.
+ */
+int pool_take(struct pool_queue *q, struct pool_task *task, int steal) {
+	int got = 0;
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		*task = steal ? q->tasks[q->head++] : q->tasks[--q->tail];
+		got = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return got;
+}
+
+/* Works through this thread's queue, then the others', until every task is
+ * done.
+ */
+void *pool_worker(void *arg) {
+	int self = (long)arg;
+	struct pool_task task;
+	int i;
+	while (1) {
+		int got = pool_take(&pool_queues[self], &task, 0);
+		for (i = 1; !got && i < pool_threads; i++) {
+			got = pool_take(&pool_queues[(self + i) % pool_threads], &task, 1);
+		}
+		if (got) {
+			pool_run_task(&pool_queues[self], &task);
+			release_blocks();
+			if (__atomic_sub_fetch(&pool_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+				pool_signal(1); // The walk is over
+			}
+			continue;
+		}
+		// Nothing to steal: sleep until a task is pushed or the walk is over
+		pthread_mutex_lock(&pool_lock);
+		__atomic_fetch_add(&pool_idle, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pool_pending, __ATOMIC_ACQUIRE) > 0 && !pool_has_tasks()) {
+			pthread_cond_wait(&pool_wake, &pool_lock);
+		}
+		__atomic_fetch_sub(&pool_idle, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&pool_lock);
+		if (__atomic_load_n(&pool_pending, __ATOMIC_ACQUIRE) == 0) {
+			return NULL;
+		}
+	}
+}
+
+/* Runs fn on the task (inode, data) and every task it spawns with nthreads
+ * threads, returning once they are all done.
+ */
+void pool_run(int nthreads, int inode, void *data, pool_fn fn) {
+	double start = trace_begin();
+	pthread_t threads[nthreads];
+	long i;
+	pool_threads = nthreads;
+	pool_run_task = fn;
+	pool_queues = calloc(nthreads, sizeof(struct pool_queue));
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&pool_queues[i].lock, NULL);
+	}
+	pool_push(&pool_queues[0], inode, data);
+	for (i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, pool_worker, (void *)i);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_destroy(&pool_queues[i].lock);
+		free(pool_queues[i].tasks);
+	}
+	free(pool_queues);
+	trace_end("tree walk", start);
+}
+
+#endif
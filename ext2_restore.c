@@ -31,6 +31,80 @@ int align(int val) {
 	    return val + 4 - (val % 4);
 	}
 }
+/* Notes, in the int at arg, that block is in use again. */
+void check_free(unsigned int block, void *arg) {
+	if (block_in_use(disk, block)) {
+		*(int *)arg = 1;
+	}
+}
+
+/* Marks block as in use. */
+void claim_block(unsigned int block, void *arg) {
+	mark_block(disk, block, 1);
+}
+
+/* Brings back the deleted inode at index, unless it or any of its blocks
+ * has been allocated again since. Returns 1 if it did.
+ */
+int restore_inode(unsigned int index) {
+    if (index >= sb->s_inodes_count || inode_in_use(disk, index)) {
+        return 0;
+    }
+    struct ext2_inode *found_node = get_inode(disk, index);
+    //check if inode has been overwritten.
+    if (found_node->i_dtime == 0) {
+        return 0;
+    }
+    //check blocks, the indirect ones too, none may have been allocated since
+    int taken = 0;
+    for_each_file_block(disk, found_node, check_free, &taken);
+    if (taken) {
+        return 0;
+    }
+    //blocks weren't allocated, set them
+    for_each_file_block(disk, found_node, claim_block, NULL);
+    //set deletion time to 0 and mark the bit in the map
+    found_node->i_dtime = 0;
+    mark_inode(disk, index, 1);
+    found_node->i_links_count = 1;
+    summary_update(disk, index);
+    return 1;
+}
+
+/* Looks for a deleted entry named name in the gap the live entry leaves
+ * after its own name, going through every deleted entry in the gap, since
+ * rm leaves a run of them there when it removes neighbours. Restores the
+ * first one it can and splits the gap around it: the deleted entries before
+ * it stay in entry's gap and the ones after it go into its own, so none of
+ * them comes back with it. Returns 1 if it restored one.
+ */
+int restore_in_gap(struct ext2_dir_entry *entry, char *name) {
+    unsigned char *base = (unsigned char *)entry;
+    unsigned int end = entry->rec_len, pos = align(8 + entry->name_len);
+    unsigned int len = strlen(name);
+    while (pos + 8 <= end) {
+        struct ext2_dir_entry *hit = (struct ext2_dir_entry *)(base + pos);
+        unsigned int size = align(8 + hit->name_len);
+        // Entries inserted over deleted ones can leave pieces of them behind,
+        // so anything that does not look like an entry is stepped over
+        if (hit->inode == 0 || hit->name_len == 0 || pos + size > end ||
+                hit->rec_len < size || hit->rec_len % 4 != 0) {
+            pos += 4;
+            continue;
+        }
+        if (hit->name_len == len && memcmp(hit->name, name, len) == 0 &&
+                restore_inode(hit->inode - 1)) {
+            entry->rec_len = pos;
+            hit->rec_len = end - pos;
+            return 1;
+        }
+        // The next deleted entry starts right after this one's name, the
+        // length it kept may cover others deleted before it
+        pos += size;
+    }
+    return 0;
+}
+
 /* remove the last / and get the last file name */
 char *get_last_file_name(char *path){
 
@@ -50,38 +124,34 @@ char *get_last_file_name(char *path){
     }
 
     //copy the new file name
-    char *file_name = malloc(sizeof(char) * file_len1);
+    char *file_name = hold_mem(malloc(sizeof(char) * file_len1));
     strcpy(file_name, path + i + 1);
 
     return file_name;
 }
 
 int main(int argc, char **argv){
+    parse_common_flags(&argc, argv);
 
     if(argc != 3){
-        fprintf(stderr, "Usage: ./ext2_restore [disk] [path]\n");
+        fprintf(stderr, "Usage: ext2_restore [--stats] [--trace file] [disk] [path]\n");
         exit(1);
     }
 
     // Opening disk
-    int fd = open(argv[1], O_RDWR);
+    int fd = hold_fd(open(argv[1], O_RDWR));
     if (!fd) {
         fprintf(stderr, "Disk image '%s' not found.", argv[1]);
         exit(ENOENT);
     }
-    // mmap the disk
-    disk = mmap(NULL, 128*1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
+    // mmap the whole disk
+    disk = map_disk(fd);
+    // Keep the checksum sidecar, if there is one, in step with what we write
+    track_checksums(disk, argv[1]);
     // Grabbing super block and block descriptor
-    sb = (struct ext2_super_block *)(disk + 1024);
-    desc = (struct ext2_group_desc *)(disk + 2*1024);
-    //get the bitmap
-    unsigned char *map = (unsigned char *)(disk + 1024 * desc->bg_block_bitmap);
-    //get the inode map
-    unsigned char *imap = (unsigned char *)(disk + 1024 * desc->bg_inode_bitmap);
+    sb = get_super(disk);
+    desc = get_group_desc(disk, 0);
+    unsigned int bs = get_block_size(disk);
     //get the parent index
     int parent_inode_index = check_parent(disk, argv[2]);
     if (parent_inode_index == -1) { // Directory not found.
@@ -89,6 +159,9 @@ int main(int argc, char **argv){
         exit(ENOENT);
     }
 
+    //hold the parent until we exit, we are editing its entries
+    lock_inode(disk, parent_inode_index, 1);
+
     if (argv[2][strlen(argv[2])-1] == '/') {
         fprintf(stderr, "Invalid filename.");
         exit(ENOENT);
@@ -97,88 +170,32 @@ int main(int argc, char **argv){
     char *file_name = get_last_file_name(argv[2]);
 
     //get the parent node
-    struct ext2_inode *parent = (struct ext2_inode *)((disk + 1024 * desc->bg_inode_table) +
-                                                      (sb->s_inode_size * parent_inode_index));
+    struct ext2_inode *parent = get_inode(disk, parent_inode_index);
 
     /* check gaps */
     /*
      * look for any dir_entry that, when subtracting its  real space, might
-     * contain another dir_entry with the original filename
+     * contain deleted dir_entries, one of them with the original filename
      */
-    int i;
-    int cur_rec_len;
-	char hit_name[256];
     struct ext2_dir_entry *cur_dir;
-    struct ext2_dir_entry *poss_hit;
-    struct ext2_inode *found_node;
-    for (i = 0; parent->i_block[i] != 0; i++) {
-        for (cur_rec_len = 0; cur_rec_len < EXT2_BLOCK_SIZE;) {
-            cur_dir = (struct ext2_dir_entry *) (disk + (EXT2_BLOCK_SIZE *
-                                                         parent->i_block[i]) +
-                                                 cur_rec_len);
-            if ((strcmp(cur_dir->name, ".") == 0)) {
-                cur_rec_len += cur_dir->rec_len;
-                continue;
+    unsigned int cur_rec_len;
+    unsigned int n, nblocks = dir_block_count(disk, parent), block;
+    for (n = 0; n < nblocks; n++) {
+        if ((block = file_block(disk, parent, n)) == 0) {
+            continue;
+        }
+        for (cur_rec_len = 0; cur_rec_len < bs; cur_rec_len += cur_dir->rec_len) {
+            cur_dir = (struct ext2_dir_entry *) (get_block(disk, block) + cur_rec_len);
+            if (cur_dir->rec_len == 0) { // Corrupt block, nothing more to read
+                break;
             }
-            int check = align(8 + cur_dir->name_len);
-            if (check < cur_dir->rec_len) {
-                //possible hit get the entry and check name and i_dtime.
-                poss_hit = (struct ext2_dir_entry *) (disk +
-						(EXT2_BLOCK_SIZE * parent->i_block[i]) +
-                        ((cur_rec_len + check)));
-
-                strcpy(hit_name, poss_hit->name);
-
-                //check if name equal
-                if (strcmp(hit_name, file_name) == 0) {
-                    //check if inode isn't used up
-                    if (check_node(poss_hit->inode - 1, imap)) {
-                        fprintf(stderr, "Cannot restore File\n");
-                        exit(1);
-                    }
-
-                    //get the inode
-                    found_node = (struct ext2_inode *) 
-						(disk + (1024 * desc->bg_inode_table) +
-                            (sizeof(struct ext2_inode) * (poss_hit->inode-1)));
-
-                    //check if inode has been overwritten.
-                    if (found_node->i_dtime == 0) {
-                        fprintf(stderr, "Cannot restore File\n");
-                        exit(1);
-                    }
-                    //set deletion time to 0
-                    found_node->i_dtime = 0;
-
-                    //check blocks
-                    int x;
-                    for (x = 0; found_node->i_block[x] != 0; x++) {
-                        //block was allocated
-                        if (check_node(found_node->i_block[x] - 1, map)) {
-                            fprintf(stderr, "Cannot restore File\n");
-                            exit(1);
-                        } else {
-                            //block wasn't allocated, set it
-                            set_node(found_node->i_block[x] - 1, map);
-                            adjust_free_blocks(-1, sb, desc);
-                        }
-                    }
-                    //mark the bit in the map
-                    set_node(poss_hit->inode - 1, imap);
-					adjust_free_inodes(-1, sb, desc);
-					found_node->i_links_count = 1;
-                    cur_dir->rec_len = check;
-                    free(file_name);
-
-                    return 0;
-                }
+            if (restore_in_gap(cur_dir, file_name)) {
+                drop_mem(file_name);
+                return 0;
             }
-            //incr the cur len
-            cur_rec_len += cur_dir->rec_len;
-			memset(hit_name, 0, sizeof(hit_name));
         }
     }
     fprintf(stderr, "Cannot restore File\n");
-    free(file_name);
+    drop_mem(file_name);
     return 1;
 }
@@ -6,6 +6,9 @@
  * less likely.
  */
 
+#ifndef EXT2_UTILS_C
+#define EXT2_UTILS_C
+
 #include<stdio.h>
 #include<string.h>
 #include<unistd.h>
@@ -16,17 +19,1936 @@
 #include<sys/mman.h>
 #include "ext2.h"
 #include<errno.h>
+#include<time.h>
+#include<sys/file.h>
+#include<stdint.h>
+
+unsigned char *mapped_disk = NULL;  // Image mapped by map_disk
+size_t mapped_size = 0;
+dev_t mapped_dev;                   // Identity of the mapped image, so a
+ino_t mapped_ino;                   // request served by ext2d can reuse it
+int mapped_fd = -1;                 // Image fd, for byte-range locks
+int image_pinned = 0;               // Set by ext2d: no image but the mapped one
+int use_cache = 0;                  // Set by --io pread, see BLOCK CACHE
+size_t cache_size = 64 << 20;       // Cap set by --cache-size
+
+void sync_disk(unsigned char *disk);
+void lock_image(int exclusive);
+int is_fast_symlink(struct ext2_inode *ip);
+void summary_update(unsigned char *disk, unsigned int index);
+
+/* STATS */
+
+/*
+ * Counters for the work an operation does, printed as JSON on exit when a
+ * tool is run with --stats. They are plain increments on paths that are
+ * already doing far more work, so they are always on, and only approximate
+ * when several threads allocate at once.
+ */
+struct ext2_stats {
+	unsigned long long bitmap_bits_scanned;
+	unsigned long long dir_entries_compared;
+	unsigned long long path_components;
+	unsigned long long inodes_allocated;
+	unsigned long long inodes_freed;
+	unsigned long long blocks_allocated;
+	unsigned long long blocks_freed;
+	unsigned long long bytes_copied;
+	unsigned long long lock_waits;
+	unsigned long long cache_misses;
+	unsigned long long cache_writebacks;
+	unsigned long long blocks_prefetched;
+};
+
+struct ext2_stats stats;
+char *stats_tool = NULL;       // Tool name, set when --stats is given
+
+/* Returns the number of dirty pages in the mapping starting at addr, as
+ * reported by /proc/self/smaps, 0 if that is not available.
+ */
+unsigned long long count_dirty_pages(void *addr) {
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	if (smaps == NULL) {
+		return 0;
+	}
+	char line[256];
+	unsigned long start, end, kb;
+	unsigned long long dirty_kb = 0;
+	int in_map = 0;
+	while (fgets(line, sizeof(line), smaps) != NULL) {
+		if (sscanf(line, "%lx-%lx", &start, &end) == 2) { // Start of a new mapping
+			in_map = ((void *)start == addr);
+		} else if (in_map && (sscanf(line, "Shared_Dirty: %lu kB", &kb) == 1 ||
+				sscanf(line, "Private_Dirty: %lu kB", &kb) == 1)) {
+			dirty_kb += kb;
+		}
+	}
+	fclose(smaps);
+	return dirty_kb * 1024 / sysconf(_SC_PAGESIZE);
+}
+
+/* Prints the counters as a single JSON object on stderr. */
+void print_stats() {
+	fprintf(stderr, "{\"tool\": \"%s\", \"bitmap_bits_scanned\": %llu, "
+			"\"dir_entries_compared\": %llu, \"path_components\": %llu, "
+			"\"inodes_allocated\": %llu, \"inodes_freed\": %llu, "
+			"\"blocks_allocated\": %llu, \"blocks_freed\": %llu, "
+			"\"bytes_copied\": %llu, \"lock_waits\": %llu, \"cache_misses\": %llu, "
+			"\"cache_writebacks\": %llu, \"blocks_prefetched\": %llu, \"pages_dirtied\": %llu}\n",
+			stats_tool, stats.bitmap_bits_scanned, stats.dir_entries_compared,
+			stats.path_components, stats.inodes_allocated, stats.inodes_freed,
+			stats.blocks_allocated, stats.blocks_freed, stats.bytes_copied, stats.lock_waits,
+			stats.cache_misses, stats.cache_writebacks, stats.blocks_prefetched,
+			mapped_size != 0 ? count_dirty_pages(mapped_disk) : 0);
+}
+
+/* TRACING */
+
+/*
+ * Phase spans recorded with --trace FILE. Spans go into a fixed ring buffer,
+ * overwriting the oldest ones, and are only formatted on exit, so tracing
+ * costs two clock reads per span and can stay on for long batches. On exit
+ * the image is msynced inside a "writeback" span and the spans are appended
+ * to FILE in the Chrome/Perfetto JSON array format (the closing bracket is
+ * optional), so many runs can share one trace file.
+ */
+#define TRACE_RING_SIZE 4096
+
+struct trace_span {
+	const char *name;
+	double start_us;
+	double dur_us;
+};
+
+struct trace_span trace_ring[TRACE_RING_SIZE];
+unsigned long trace_count = 0;  // Spans recorded so far, including overwritten ones
+char *trace_path = NULL;
+char *trace_tool = NULL;
+double trace_start_us;
+
+double trace_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Returns the start time of a span, 0 if tracing is off. */
+double trace_begin() {
+	return trace_path != NULL ? trace_now() : 0;
+}
+
+/* Records the span name that started at start, as returned by trace_begin. */
+void trace_end(const char *name, double start) {
+	if (trace_path == NULL) {
+		return;
+	}
+	struct trace_span *span = &trace_ring[__atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED) %
+			TRACE_RING_SIZE];
+	span->name = name;
+	span->start_us = start;
+	span->dur_us = trace_now() - start;
+}
+
+/* Writes back the image and appends the recorded spans to the trace file. */
+void write_trace() {
+	double start = trace_begin();
+	sync_disk(mapped_disk);
+	trace_end("writeback", start);
+	trace_end(trace_tool, trace_start_us);
+
+	unsigned long n = trace_count < TRACE_RING_SIZE ? trace_count : TRACE_RING_SIZE;
+	unsigned long first = trace_count - n;
+	size_t cap = (n + 1) * 160, len = 0;
+	char *buf = malloc(cap);
+	unsigned long i;
+	int pid = getpid();
+	for (i = first; i < trace_count; i++) {
+		struct trace_span *span = &trace_ring[i % TRACE_RING_SIZE];
+		len += snprintf(buf + len, cap - len, "{\"name\": \"%s\", \"cat\": \"ext2\", \"ph\": \"X\", "
+				"\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d},\n",
+				span->name, span->start_us, span->dur_us, pid, pid);
+	}
+	int fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd == -1) {
+		perror(trace_path);
+		free(buf);
+		return;
+	}
+	// Lock so concurrent runs don't both start the array.
+	flock(fd, LOCK_EX);
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size == 0) {
+		write(fd, "[\n", 2);
+	}
+	if (write(fd, buf, len) != len) {
+		perror(trace_path);
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+	free(buf);
+}
+
+/* Reports stats before tracing writes the image back, which would clean
+ * the pages they count.
+ */
+void common_exit() {
+	if (stats_tool != NULL) {
+		print_stats();
+	}
+	if (trace_path != NULL) {
+		write_trace();
+	}
+}
+
+/*
+ * Work a tool leaves until it is done, such as writing back its cache and
+ * its checksums, run in the reverse of the order it was added. A tool's
+ * hooks run when it exits, ext2d runs them after every request instead.
+ */
+#define MAX_EXIT_HOOKS 8
+
+void (*exit_hooks[MAX_EXIT_HOOKS])();
+int exit_hook_count = 0;
+
+/* Runs the exit hooks, the last added first, and forgets them. */
+void run_exit_hooks() {
+	while (exit_hook_count > 0) {
+		exit_hooks[--exit_hook_count]();
+	}
+}
+
+/* Has hook run when the tool is done, once however often it is added. */
+void at_tool_exit(void (*hook)()) {
+	static int registered = 0;
+	int i;
+	for (i = 0; i < exit_hook_count; i++) {
+		if (exit_hooks[i] == hook) {
+			return;
+		}
+	}
+	if (!registered) {
+		atexit(run_exit_hooks);
+		registered = 1;
+	}
+	if (exit_hook_count < MAX_EXIT_HOOKS) {
+		exit_hooks[exit_hook_count++] = hook;
+	}
+}
+
+/*
+ * What a tool has open or allocated on its way: file descriptors, mappings,
+ * streams and memory. Exiting gives them all back, but in ext2d an exit only
+ * ends the request, so a tool holds what it gets with the hold_ calls and
+ * whatever it has not let go of with the drop_ calls by the time it is done
+ * is let go of by release_resources, an exit hook.
+ */
+enum resource_kind {RESOURCE_FD, RESOURCE_MAP, RESOURCE_FILE, RESOURCE_MEM};
+
+struct resource {
+	enum resource_kind kind;
+	void *ptr;          // Mapping, stream or memory, NULL if the slot is free
+	int fd;
+	size_t len;         // Length of a mapping
+};
+
+struct resource *resources = NULL;
+int resource_count = 0, resource_cap = 0;
+
+/* Lets go of everything still held, the last held first. */
+void release_resources() {
+	while (resource_count > 0) {
+		struct resource *r = &resources[--resource_count];
+		switch (r->kind) {
+			case RESOURCE_FD:   if (r->fd != -1) close(r->fd); break;
+			case RESOURCE_MAP:  if (r->ptr != NULL) munmap(r->ptr, r->len); break;
+			case RESOURCE_FILE: if (r->ptr != NULL) fclose(r->ptr); break;
+			case RESOURCE_MEM:  free(r->ptr); break;
+		}
+	}
+}
+
+/* Adds a resource to let go of when the tool is done. */
+void hold_resource(enum resource_kind kind, void *ptr, int fd, size_t len) {
+	if (resource_count == resource_cap) {
+		resource_cap = resource_cap ? resource_cap * 2 : 16;
+		resources = realloc(resources, resource_cap * sizeof(struct resource));
+	}
+	struct resource r = {kind, ptr, fd, len};
+	resources[resource_count++] = r;
+	at_tool_exit(release_resources);
+}
+
+/* Forgets held resources let go of at the end of the list, so a tool that
+ * holds and drops in a loop does not grow it.
+ */
+void trim_resources() {
+	while (resource_count > 0) {
+		struct resource *r = &resources[resource_count - 1];
+		if (r->kind == RESOURCE_FD ? r->fd != -1 : r->ptr != NULL) {
+			break;
+		}
+		resource_count--;
+	}
+}
+
+/* Returns the held resource of kind for ptr, or fd, NULL if there is none. */
+struct resource *find_resource(enum resource_kind kind, void *ptr, int fd) {
+	int i;
+	for (i = resource_count - 1; i >= 0; i--) {
+		struct resource *r = &resources[i];
+		if (r->kind == kind && (kind == RESOURCE_FD ? r->fd == fd : r->ptr == ptr)) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+/* Holds fd until the tool is done, and returns it. -1 is passed through. */
+int hold_fd(int fd) {
+	if (fd != -1) {
+		hold_resource(RESOURCE_FD, NULL, fd, 0);
+	}
+	return fd;
+}
+
+/* Stops holding fd without closing it, for whoever it is handed to. */
+void disown_fd(int fd) {
+	struct resource *r = find_resource(RESOURCE_FD, NULL, fd);
+	if (r != NULL) {
+		r->fd = -1;
+		trim_resources();
+	}
+}
+
+/* Closes a held fd. */
+void drop_fd(int fd) {
+	disown_fd(fd);
+	close(fd);
+}
+
+/* Holds the len bytes mapped at addr, and returns addr. MAP_FAILED is passed
+ * through.
+ */
+void *hold_map(void *addr, size_t len) {
+	if (addr != MAP_FAILED) {
+		hold_resource(RESOURCE_MAP, addr, -1, len);
+	}
+	return addr;
+}
+
+/* Unmaps a held mapping. */
+void drop_map(void *addr) {
+	struct resource *r = find_resource(RESOURCE_MAP, addr, -1);
+	if (r != NULL) {
+		munmap(addr, r->len);
+		r->ptr = NULL;
+		trim_resources();
+	}
+}
+
+/* Holds stream f, and returns it. NULL is passed through. */
+FILE *hold_file(FILE *f) {
+	if (f != NULL) {
+		hold_resource(RESOURCE_FILE, f, -1, 0);
+	}
+	return f;
+}
+
+/* Closes a held stream. Returns what fclose does. */
+int drop_file(FILE *f) {
+	struct resource *r = find_resource(RESOURCE_FILE, f, -1);
+	if (r != NULL) {
+		r->ptr = NULL;
+		trim_resources();
+	}
+	return fclose(f);
+}
+
+/* Holds memory from malloc, and returns it. */
+void *hold_mem(void *p) {
+	if (p != NULL) {
+		hold_resource(RESOURCE_MEM, p, -1, 0);
+	}
+	return p;
+}
+
+/* Resizes held memory like realloc, still holding it. */
+void *renew_mem(void *p, size_t size) {
+	struct resource *r = find_resource(RESOURCE_MEM, p, -1);
+	void *q = realloc(p, size);
+	if (r != NULL) {
+		r->ptr = q;
+	} else {
+		hold_mem(q);
+	}
+	return q;
+}
+
+/* Frees held memory. */
+void drop_mem(void *p) {
+	struct resource *r = find_resource(RESOURCE_MEM, p, -1);
+	if (r != NULL) {
+		r->ptr = NULL;
+		trim_resources();
+	}
+	free(p);
+}
+
+/* Strips the options every tool understands (--stats, --trace FILE,
+ * --io mmap|pread, --cache-size MiB) out of argv, updating argc, so the
+ * tool's own argument handling never sees them.
+ */
+void parse_common_flags(int *argc, char **argv) {
+	char *tool = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+	int i, j;
+	for (i = 1, j = 1; i < *argc; i++) {
+		if (strcmp(argv[i], "--stats") == 0) {
+			stats_tool = tool;
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < *argc) {
+			trace_tool = tool;
+			trace_start_us = trace_now();
+			trace_path = argv[++i];
+		} else if (strcmp(argv[i], "--io") == 0 && i + 1 < *argc) {
+			use_cache = strcmp(argv[++i], "pread") == 0;
+		} else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < *argc) {
+			cache_size = (size_t)atol(argv[++i]) << 20;
+		} else {
+			argv[j++] = argv[i];
+		}
+	}
+	argv[j] = NULL;
+	*argc = j;
+	if (stats_tool != NULL || trace_path != NULL) {
+		at_tool_exit(common_exit);
+	}
+}
+
+/* HELPERS */
+
+/* Writes all len bytes of buf to fd. Returns 0 on success, -1 on error. */
+int write_all(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Returns the node value at the index of the bitmap map. */
+int check_node(int index, unsigned char *map) {
+	stats.bitmap_bits_scanned++;
+	return (map[index/8] >> (index % 8)) & 0x1;
+}
+
+/*
+ * Bitmaps are also handled a 64-bit word at a time below. Bit n of the
+ * bitmap is bit n % 8 of byte n / 8, which on a little-endian host (like the
+ * on-disk format) is bit n % 64 of word n / 64. Bitmap blocks, and any
+ * buffer a bitmap is built in, are at least 8-byte aligned.
+ */
+
+/* Sets the node at index in the bitmap map to value (0 or 1) with an atomic
+ * compare-and-swap on the word holding it, so threads can share a bitmap.
+ * Setting a node to the value it already has writes nothing.
+ * Returns the previous value of the node.
+ */
+int set_node(int index, unsigned char *map, int value) {
+	uint64_t *word = (uint64_t *)map + index / 64;
+	uint64_t bit = 1ULL << (index % 64);
+	uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED), new;
+	do {
+		new = value ? old | bit : old & ~bit;
+		if (new == old) {
+			return value;
+		}
+	} while (!__atomic_compare_exchange_n(word, &old, new, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	return !value;
+}
+
+/* Returns the index of the first clear node in map from index from up to
+ * count, -1 if there is none.
+ */
+int find_free_node(unsigned char *map, int from, int count) {
+	uint64_t *words = (uint64_t *)map;
+	int i = from;
+	while (i < count) {
+		uint64_t clear = ~__atomic_load_n(&words[i / 64], __ATOMIC_RELAXED) & (~0ULL << (i % 64));
+		stats.bitmap_bits_scanned += 64 - i % 64;
+		if (clear != 0) {
+			int found = i / 64 * 64 + __builtin_ctzll(clear);
+			return found < count ? found : -1;
+		}
+		i = (i / 64 + 1) * 64;
+	}
+	return -1;
+}
+
+/* Returns the index of the first set node in map from index from up to
+ * count, -1 if there is none.
+ */
+int find_used_node(unsigned char *map, int from, int count) {
+	uint64_t *words = (uint64_t *)map;
+	int i = from;
+	while (i < count) {
+		uint64_t set = __atomic_load_n(&words[i / 64], __ATOMIC_RELAXED) & (~0ULL << (i % 64));
+		stats.bitmap_bits_scanned += 64 - i % 64;
+		if (set != 0) {
+			int found = i / 64 * 64 + __builtin_ctzll(set);
+			return found < count ? found : -1;
+		}
+		i = (i / 64 + 1) * 64;
+	}
+	return -1;
+}
+
+/* Returns a 64-bit hash of len bytes at data, a multiple of 32 such as a
+ * block. It reads four words at a time into independent lanes so the
+ * multiplies overlap, and is never 0, which callers can keep for "no hash".
+ * Not cryptographic: it is meant to spot changed blocks, not tampering.
+ */
+uint64_t hash_block(const unsigned char *data, size_t len) {
+	const uint64_t k = 0x9E3779B97F4A7C15ULL;
+	uint64_t lane[4] = {k, k ^ 1, k ^ 2, k ^ 3}, w, h = len;
+	size_t i;
+	int j;
+	for (i = 0; i + 32 <= len; i += 32) {
+		for (j = 0; j < 4; j++) {
+			memcpy(&w, data + i + 8 * j, 8);
+			lane[j] = (lane[j] ^ w) * k;
+			lane[j] ^= lane[j] >> 29;
+		}
+	}
+	for (j = 0; j < 4; j++) {
+		h = (h ^ lane[j]) * 0xBF58476D1CE4E5B9ULL;
+		h ^= h >> 31;
+	}
+	return h ? h : 1;
+}
+
+/* CHECKSUMS */
+
+/*
+ * CRC32C (Castagnoli) checksums of the metadata blocks, kept in a sidecar
+ * next to the image (see CHECKSUM SIDECAR below) so ext2_checker
+ * --verify-fast can tell which blocks changed behind the tools' backs. The
+ * SSE4.2 or ARMv8 CRC instructions are used when the CPU has them, a table
+ * otherwise; all three give the same result.
+ */
+
+uint32_t crc32c_table[256];
+
+/* Folds len bytes at p into crc a byte at a time. */
+uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t len) {
+	size_t i;
+	int j;
+	if (crc32c_table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (j = 0; j < 8; j++) {
+				c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+			}
+			crc32c_table[i] = c;
+		}
+	}
+	for (i = 0; i < len; i++) {
+		crc = crc32c_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+#include<nmmintrin.h>
+
+/* Folds len bytes at p into crc eight at a time with the SSE4.2 crc32. */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t c = crc, w;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	for (; len > 0; p++, len--) {
+		c = _mm_crc32_u8(c, *p);
+	}
+	return c;
+}
+
+int crc32c_hw_present() {
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+#include<arm_acle.h>
+#include<sys/auxv.h>
+
+/* Folds len bytes at p into crc eight at a time with the ARMv8 crc32cx. */
+__attribute__((target("arch=armv8-a+crc")))
+uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t w;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		crc = __crc32cd(crc, w);
+	}
+	for (; len > 0; p++, len--) {
+		crc = __crc32cb(crc, *p);
+	}
+	return crc;
+}
+
+int crc32c_hw_present() {
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#else
+uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+	return crc32c_soft(crc, p, len);
+}
+
+int crc32c_hw_present() {
+	return 0;
+}
+#endif
+
+/* Returns the CRC32C of len bytes at data. */
+uint32_t crc32c(const unsigned char *data, size_t len) {
+	static int hw = -1;
+	if (hw == -1) {
+		hw = crc32c_hw_present();
+	}
+	return ~(hw ? crc32c_hw(~0U, data, len) : crc32c_soft(~0U, data, len));
+}
+
+/* What a tool keeping the sidecar up to date has written: the inodes it has
+ * looked at, whose table blocks and, for directories, directory blocks are
+ * checksummed again on exit, and the bitmap blocks it has marked. Past the
+ * end of either list everything is checksummed again.
+ */
+#define CRC_MAX_TOUCHED 4096
+
+char *crc_path = NULL;      // Sidecar to update on exit, NULL if not kept
+unsigned int crc_inodes[CRC_MAX_TOUCHED], crc_blocks[CRC_MAX_TOUCHED];
+int crc_inode_count = 0, crc_block_count = 0;
+
+/* Notes that the inode at index may be written. */
+void touch_inode(unsigned int index) {
+	int i = __atomic_fetch_add(&crc_inode_count, 1, __ATOMIC_RELAXED);
+	if (i < CRC_MAX_TOUCHED) {
+		crc_inodes[i] = index;
+	}
+}
+
+/* Notes that block, a bitmap block, was written. */
+void touch_block(unsigned int block) {
+	int i = __atomic_fetch_add(&crc_block_count, 1, __ATOMIC_RELAXED);
+	if (i < CRC_MAX_TOUCHED) {
+		crc_blocks[i] = block;
+	}
+}
+
+/* I/O ENGINE */
+
+/*
+ * The block cache's reads and writes that can be in flight together: blocks
+ * prefetched ahead of a scan, and the runs of dirty blocks written back on
+ * exit. Built with liburing (the Makefile finds it with pkg-config), they go
+ * through an io_uring; without it, or if the kernel will not set up a ring,
+ * a few threads run them with preadv and pwritev. Either way io_queue hands
+ * a request over, io_kick submits everything queued, and io_wait blocks
+ * until a request is done.
+ */
+#include<pthread.h>
+#include<sys/uio.h>
+#ifdef HAVE_LIBURING
+#include<liburing.h>
+#endif
+
+#define IO_MAX_IOV 32       // Blocks in one request
+#define IO_THREADS 4        // Threads running requests without io_uring
+#define IO_RING_SIZE 256
+
+struct io_req {
+	int fd;
+	int write;
+	off_t offset;
+	struct iovec iov[IO_MAX_IOV];
+	int iovcnt;
+	size_t len;             // Sum of the iov lengths
+	ssize_t result;         // Bytes done, or -errno
+	int done;
+	struct io_req *next;    // Next in the threads' queue
+};
+
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_queued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t io_finished = PTHREAD_COND_INITIALIZER;
+struct io_req *io_head = NULL, *io_tail = NULL;
+pid_t io_pid = 0;           // Process the engine was started in, 0 if none
+#ifdef HAVE_LIBURING
+struct io_uring io_ring;
+int io_use_ring = 0;
+unsigned int io_in_ring = 0; // Requests queued or in flight on the ring
+#endif
+
+/* Runs queued requests until the process exits. */
+void *io_worker(void *arg) {
+	pthread_mutex_lock(&io_lock);
+	while (1) {
+		while (io_head == NULL) {
+			pthread_cond_wait(&io_queued, &io_lock);
+		}
+		struct io_req *r = io_head;
+		io_head = r->next;
+		if (io_head == NULL) {
+			io_tail = NULL;
+		}
+		pthread_mutex_unlock(&io_lock);
+		ssize_t n = r->write ? pwritev(r->fd, r->iov, r->iovcnt, r->offset) :
+			preadv(r->fd, r->iov, r->iovcnt, r->offset);
+		pthread_mutex_lock(&io_lock);
+		r->result = n == -1 ? -errno : n;
+		r->done = 1;
+		pthread_cond_broadcast(&io_finished);
+	}
+	return NULL;
+}
+
+/* Sets the engine up in this process, a ring if there can be one and the
+ * threads otherwise. Called with io_lock held. Threads do not survive a
+ * fork, so a forked child sets up its own.
+ */
+void io_start() {
+	int i;
+	pthread_t thread;
+	io_pid = getpid();
+	io_head = io_tail = NULL;
+#ifdef HAVE_LIBURING
+	io_in_ring = 0;
+	if (io_uring_queue_init(IO_RING_SIZE, &io_ring, 0) == 0) {
+		io_use_ring = 1;
+		return;
+	}
+	io_use_ring = 0;
+#endif
+	for (i = 0; i < IO_THREADS; i++) {
+		if (pthread_create(&thread, NULL, io_worker, NULL) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+		pthread_detach(thread);
+	}
+}
+
+#ifdef HAVE_LIBURING
+/* Submits what is queued on the ring and waits for one completion, marking
+ * its request done. Called with io_lock held.
+ */
+void io_reap() {
+	struct io_uring_cqe *cqe;
+	int ret;
+	io_uring_submit(&io_ring);
+	while ((ret = io_uring_wait_cqe(&io_ring, &cqe)) == -EINTR);
+	if (ret < 0) {
+		errno = -ret;
+		perror("io_uring_wait_cqe");
+		exit(1);
+	}
+	struct io_req *r = io_uring_cqe_get_data(cqe);
+	r->result = cqe->res;
+	r->done = 1;
+	io_uring_cqe_seen(&io_ring, cqe);
+	io_in_ring--;
+}
+#endif
+
+/* Hands r over to the engine. It may not start until io_kick or io_wait. */
+void io_queue(struct io_req *r) {
+	pthread_mutex_lock(&io_lock);
+	if (io_pid != getpid()) {
+		io_start();
+	}
+	r->done = 0;
+	r->next = NULL;
+#ifdef HAVE_LIBURING
+	if (io_use_ring) {
+		// Never more requests than the ring has completion slots for
+		while (io_in_ring >= IO_RING_SIZE) {
+			io_reap();
+		}
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&io_ring);
+		if (sqe == NULL) {
+			io_uring_submit(&io_ring);
+			sqe = io_uring_get_sqe(&io_ring);
+		}
+		if (r->write) {
+			io_uring_prep_writev(sqe, r->fd, r->iov, r->iovcnt, r->offset);
+		} else {
+			io_uring_prep_readv(sqe, r->fd, r->iov, r->iovcnt, r->offset);
+		}
+		io_uring_sqe_set_data(sqe, r);
+		io_in_ring++;
+		pthread_mutex_unlock(&io_lock);
+		return;
+	}
+#endif
+	if (io_tail == NULL) {
+		io_head = r;
+	} else {
+		io_tail->next = r;
+	}
+	io_tail = r;
+	pthread_cond_signal(&io_queued);
+	pthread_mutex_unlock(&io_lock);
+}
+
+/* Submits the requests queued so far in one go. */
+void io_kick() {
+#ifdef HAVE_LIBURING
+	pthread_mutex_lock(&io_lock);
+	if (io_use_ring && io_pid == getpid()) {
+		io_uring_submit(&io_ring);
+	}
+	pthread_mutex_unlock(&io_lock);
+#endif
+}
+
+/* Waits until r is done. Returns the bytes it read or wrote, or -errno. */
+ssize_t io_wait(struct io_req *r) {
+	pthread_mutex_lock(&io_lock);
+	while (!r->done) {
+#ifdef HAVE_LIBURING
+		if (io_use_ring) {
+			io_reap();
+			continue;
+		}
+#endif
+		pthread_cond_wait(&io_finished, &io_lock);
+	}
+	pthread_mutex_unlock(&io_lock);
+	return r->result;
+}
+
+/* BLOCK CACHE */
+
+/*
+ * Images are mapped whole by default. With --io pread they are read and
+ * written a block at a time through a cache of --cache-size MiB (64 by
+ * default) instead, for images bigger than the address space or devices
+ * whose memory use must be capped. get_block then returns the block's slot
+ * in the cache, so every tool works with either backend unchanged.
+ *
+ * - The superblock and group descriptors, everything up to the end of the
+ *   descriptor table, are read once into the disk's head and never evicted;
+ *   the pointer returned by map_disk is the head.
+ * - A slot stays pinned from the time a thread gets the block until the
+ *   thread calls release_blocks, which the long walks do whenever they hold
+ *   no block pointers. Past the cap, pinned slots are never evicted, the
+ *   cache grows instead. The rest are evicted with the clock algorithm, so
+ *   blocks in use again and again, like bitmaps and inode tables, stay.
+ * - Tools write to blocks in place, so each slot keeps a copy of its block
+ *   as read or last written, and is dirty if the block no longer matches
+ *   it, or if it was handed out by get_new_block to be overwritten. Dirty
+ *   slots are written back when they are evicted or on exit, where runs of
+ *   contiguous dirty blocks, like the extents a copy allocates, go out
+ *   together in one request each. The copies count towards --cache-size.
+ * - Scans can prefetch the blocks they are about to get, which are then
+ *   read in the background by the I/O ENGINE above.
+ * - The cache is private to the process, so the whole image is locked
+ *   exclusively while it is open and other tools wait their turn.
+ */
+
+#define CACHE_MAX_DISKS 4
+#define CACHE_MAX_THREADS 64
+
+struct cache_slot {
+	unsigned int block;
+	int next;               // Next slot in the hash bucket, -1 at the end
+	uint64_t pins;          // Bit per thread holding the block
+	unsigned char referenced;
+	unsigned char fresh;    // Handed out to be overwritten, always written back
+	unsigned char *data;
+	unsigned char *clean;   // The block as read or last written
+	struct io_req *io;      // Prefetch read in flight, NULL if none
+};
+
+struct block_cache {
+	int fd;
+	unsigned int bs;
+	unsigned int blocks_count;
+	unsigned char *head;    // Blocks before head_blocks, never evicted
+	unsigned char *head_clean;
+	unsigned int head_blocks;
+	struct cache_slot *slots;
+	unsigned int count, cap, max; // Slots in use, allocated, and the size cap
+	int *buckets;           // Slot chains by block, nbuckets a power of two
+	unsigned int nbuckets;
+	unsigned int hand;      // Clock hand
+	pthread_mutex_t lock;
+};
+
+struct block_cache caches[CACHE_MAX_DISKS];
+int cache_count = 0;
+uint64_t cache_threads = 0;         // Bit per thread slot in use
+pthread_key_t cache_thread_key;
+pthread_once_t cache_thread_once = PTHREAD_ONCE_INIT;
+__thread int cache_thread = -1;
+
+/* The slots each thread has pinned since it last called release_blocks. */
+struct cache_pin {
+	struct block_cache *cache;
+	int slot;
+};
+__thread struct cache_pin *pinned;
+__thread int pinned_count, pinned_cap;
+
+/* Returns the cache of the disk whose head is disk, NULL if it is mapped. */
+struct block_cache *find_cache(unsigned char *disk) {
+	int i;
+	for (i = 0; i < cache_count; i++) {
+		if (caches[i].head == disk) {
+			return &caches[i];
+		}
+	}
+	return NULL;
+}
+
+/* Waits for the slot's prefetch read, if it has one in flight, to finish. */
+void finish_read(struct block_cache *c, struct cache_slot *s) {
+	if (s->io == NULL) {
+		return;
+	}
+	if (io_wait(s->io) != c->bs) {
+		memset(s->data, 0, c->bs);
+	}
+	memcpy(s->clean, s->data, c->bs);
+	free(s->io);
+	s->io = NULL;
+}
+
+/* Returns 1 if the slot's block has to be written back. */
+int slot_dirty(struct block_cache *c, struct cache_slot *s) {
+	return s->fresh || memcmp(s->data, s->clean, c->bs) != 0;
+}
+
+/* Notes that the slot's block is now as it is on the image. */
+void slot_written(struct block_cache *c, struct cache_slot *s) {
+	memcpy(s->clean, s->data, c->bs);
+	s->fresh = 0;
+}
+
+/* Writes the slot's block back if it changed since it was read. */
+void write_back(struct block_cache *c, struct cache_slot *s) {
+	if (slot_dirty(c, s)) {
+		if (pwrite(c->fd, s->data, c->bs, (off_t)s->block * c->bs) != c->bs) {
+			perror("pwrite");
+			exit(1);
+		}
+		stats.cache_writebacks++;
+		slot_written(c, s);
+	}
+}
+
+/* Returns the slot holding block, -1 if it is not cached. */
+int find_slot(struct block_cache *c, unsigned int block) {
+	int i = c->buckets[block & (c->nbuckets - 1)];
+	while (i != -1 && c->slots[i].block != block) {
+		i = c->slots[i].next;
+	}
+	return i;
+}
+
+/* Puts slot i, just loaded with block, in its hash bucket. */
+void hash_slot(struct block_cache *c, int i, unsigned int block) {
+	int *bucket = &c->buckets[block & (c->nbuckets - 1)];
+	c->slots[i].block = block;
+	c->slots[i].pins = 0;
+	c->slots[i].next = *bucket;
+	*bucket = i;
+}
+
+/* Takes slot i out of its hash bucket. */
+void unhash_slot(struct block_cache *c, int i) {
+	int *link = &c->buckets[c->slots[i].block & (c->nbuckets - 1)];
+	while (*link != i) {
+		link = &c->slots[*link].next;
+	}
+	*link = c->slots[i].next;
+}
+
+/* Returns a slot to load a block into, evicting an unpinned one if the cache
+ * is at its cap and growing it otherwise. If everything is pinned or still
+ * being read, the cache only goes over its cap when grow is set; -1 is
+ * returned otherwise.
+ */
+int free_slot(struct block_cache *c, int grow) {
+	unsigned int tries;
+	if (c->count == c->max) {
+		for (tries = 0; tries < 2 * c->count; tries++) {
+			int i = c->hand;
+			struct cache_slot *s = &c->slots[i];
+			c->hand = (c->hand + 1) % c->count;
+			if (s->pins != 0 || s->io != NULL) {
+				continue;
+			}
+			if (s->referenced) {
+				s->referenced = 0;
+				continue;
+			}
+			write_back(c, s);
+			unhash_slot(c, i);
+			return i;
+		}
+		if (!grow) {
+			return -1;
+		}
+		c->max++; // Everything is pinned, go over the cap
+	}
+	if (c->count == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 64;
+		c->slots = realloc(c->slots, c->cap * sizeof(struct cache_slot));
+	}
+	if (c->count * 2 >= c->nbuckets) { // Keep the chains short
+		unsigned int i;
+		c->nbuckets *= 2;
+		c->buckets = realloc(c->buckets, c->nbuckets * sizeof(int));
+		memset(c->buckets, -1, c->nbuckets * sizeof(int));
+		for (i = 0; i < c->count; i++) {
+			int *bucket = &c->buckets[c->slots[i].block & (c->nbuckets - 1)];
+			c->slots[i].next = *bucket;
+			*bucket = i;
+		}
+	}
+	c->slots[c->count].data = malloc(2 * c->bs);
+	c->slots[c->count].clean = c->slots[c->count].data + c->bs;
+	c->slots[c->count].io = NULL;
+	return c->count++;
+}
+
+void release_blocks();
+
+/* Gives up the calling thread's slot when it exits, unpinning its blocks, so
+ * a long-running process such as ext2d can keep starting threads.
+ */
+void drop_cache_thread(void *unused) {
+	release_blocks();
+	__atomic_fetch_and(&cache_threads, ~(1ULL << cache_thread), __ATOMIC_RELAXED);
+	cache_thread = -1;
+}
+
+void make_cache_thread_key() {
+	pthread_key_create(&cache_thread_key, drop_cache_thread);
+}
+
+/* Takes a free thread slot for pinning blocks. Exits if all are taken. */
+void claim_cache_thread() {
+	uint64_t used = __atomic_load_n(&cache_threads, __ATOMIC_RELAXED);
+	int slot;
+	do {
+		if (~used == 0) {
+			fprintf(stderr, "Too many threads for the block cache.\n");
+			exit(1);
+		}
+		slot = __builtin_ctzll(~used);
+	} while (!__atomic_compare_exchange_n(&cache_threads, &used, used | (1ULL << slot), 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	cache_thread = slot;
+	pthread_once(&cache_thread_once, make_cache_thread_key);
+	pthread_setspecific(cache_thread_key, &cache_thread);
+}
+
+/* Returns the cached copy of block, reading it in if need be, pinned for the
+ * calling thread. If fresh is set the caller overwrites the whole block, so
+ * it is zeroed instead of read, and always written back.
+ */
+unsigned char *cache_block(struct block_cache *c, unsigned int block, int fresh) {
+	if (block < c->head_blocks) {
+		return c->head + (size_t)block * c->bs;
+	}
+	if (cache_thread == -1) {
+		claim_cache_thread();
+	}
+	pthread_mutex_lock(&c->lock);
+	int i = find_slot(c, block);
+	if (i == -1) {
+		i = free_slot(c, 1);
+		struct cache_slot *s = &c->slots[i];
+		s->fresh = fresh;
+		if (fresh) {
+			memset(s->data, 0, c->bs);
+		} else {
+			if (pread(c->fd, s->data, c->bs, (off_t)block * c->bs) != c->bs) {
+				memset(s->data, 0, c->bs);
+			}
+			stats.cache_misses++;
+			memcpy(s->clean, s->data, c->bs);
+		}
+		hash_slot(c, i, block);
+	}
+	struct cache_slot *s = &c->slots[i];
+	finish_read(c, s);
+	s->referenced = 1;
+	uint64_t bit = 1ULL << cache_thread;
+	if (!(s->pins & bit)) {
+		s->pins |= bit;
+		if (pinned_count == pinned_cap) {
+			pinned_cap = pinned_cap ? pinned_cap * 2 : 64;
+			pinned = realloc(pinned, pinned_cap * sizeof(struct cache_pin));
+		}
+		pinned[pinned_count].cache = c;
+		pinned[pinned_count++].slot = i;
+	}
+	unsigned char *data = s->data;
+	pthread_mutex_unlock(&c->lock);
+	return data;
+}
+
+/* Starts reading the n blocks listed into the cache, all in one batch,
+ * skipping those already there. They are not pinned, and at most a quarter
+ * of the cache is given to them, evicting nothing pinned.
+ */
+void cache_prefetch(struct block_cache *c, unsigned int *blocks, int n) {
+	int i;
+	pthread_mutex_lock(&c->lock);
+	if (n > c->max / 4) {
+		n = c->max / 4;
+	}
+	for (i = 0; i < n; i++) {
+		unsigned int block = blocks[i];
+		if (block < c->head_blocks || block >= c->blocks_count || find_slot(c, block) != -1) {
+			continue;
+		}
+		int j = free_slot(c, 0);
+		if (j == -1) {
+			break;
+		}
+		struct cache_slot *s = &c->slots[j];
+		struct io_req *r = calloc(1, sizeof(struct io_req));
+		r->fd = c->fd;
+		r->offset = (off_t)block * c->bs;
+		r->iov[0].iov_base = s->data;
+		r->iov[0].iov_len = c->bs;
+		r->iovcnt = 1;
+		r->len = c->bs;
+		s->io = r;
+		s->referenced = 1;
+		s->fresh = 0;
+		hash_slot(c, j, block);
+		io_queue(r);
+		stats.blocks_prefetched++;
+	}
+	io_kick();
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Unpins every block the calling thread has got since it last called this.
+ * Only call it while holding no pointers into blocks, other than the
+ * superblock and group descriptors.
+ */
+void release_blocks() {
+	int i;
+	for (i = 0; i < pinned_count; i++) {
+		struct block_cache *c = pinned[i].cache;
+		pthread_mutex_lock(&c->lock);
+		c->slots[pinned[i].slot].pins &= ~(1ULL << cache_thread);
+		pthread_mutex_unlock(&c->lock);
+	}
+	pinned_count = 0;
+}
+
+/* A slot to write back. */
+struct dirty_slot {
+	unsigned int block;
+	int slot;
+};
+
+/* Orders dirty slots by block. */
+int dirty_by_block(const void *a, const void *b) {
+	unsigned int x = ((struct dirty_slot *)a)->block, y = ((struct dirty_slot *)b)->block;
+	return x < y ? -1 : x > y;
+}
+
+/* Writes back every dirty slot of c. Runs of contiguous blocks are written
+ * with one request each, and all the requests are in flight at once.
+ */
+void write_back_all(struct block_cache *c) {
+	struct dirty_slot *dirty = malloc((c->count + 1) * sizeof(struct dirty_slot));
+	struct io_req *reqs = malloc((c->count + 1) * sizeof(struct io_req));
+	unsigned int j;
+	int n = 0, nreqs = 0, k;
+	for (j = 0; j < c->count; j++) {
+		struct cache_slot *s = &c->slots[j];
+		finish_read(c, s);
+		if (slot_dirty(c, s)) {
+			dirty[n].block = s->block;
+			dirty[n++].slot = j;
+		}
+	}
+	qsort(dirty, n, sizeof(struct dirty_slot), dirty_by_block);
+	for (k = 0; k < n; k++) {
+		struct io_req *r = nreqs > 0 ? &reqs[nreqs - 1] : NULL;
+		if (r == NULL || dirty[k].block != dirty[k - 1].block + 1 || r->iovcnt == IO_MAX_IOV) {
+			r = &reqs[nreqs++];
+			memset(r, 0, sizeof(*r));
+			r->fd = c->fd;
+			r->write = 1;
+			r->offset = (off_t)dirty[k].block * c->bs;
+		}
+		r->iov[r->iovcnt].iov_base = c->slots[dirty[k].slot].data;
+		r->iov[r->iovcnt++].iov_len = c->bs;
+		r->len += c->bs;
+	}
+	for (k = 0; k < nreqs; k++) {
+		io_queue(&reqs[k]);
+	}
+	io_kick();
+	for (k = 0; k < nreqs; k++) {
+		ssize_t done = io_wait(&reqs[k]);
+		if (done != reqs[k].len) {
+			errno = done < 0 ? -done : EIO;
+			perror("write back");
+			exit(1);
+		}
+	}
+	for (k = 0; k < n; k++) {
+		slot_written(c, &c->slots[dirty[k].slot]);
+	}
+	stats.cache_writebacks += n;
+	free(dirty);
+	free(reqs);
+}
+
+/* Writes back every dirty block of every cached disk. */
+void flush_caches() {
+	int i;
+	for (i = 0; i < cache_count; i++) {
+		struct block_cache *c = &caches[i];
+		pthread_mutex_lock(&c->lock);
+		write_back_all(c);
+		size_t head_size = (size_t)c->head_blocks * c->bs;
+		if (memcmp(c->head, c->head_clean, head_size) != 0) {
+			if (pwrite(c->fd, c->head, head_size, 0) == -1) {
+				perror("pwrite");
+			}
+			memcpy(c->head_clean, c->head, head_size);
+		}
+		fsync(c->fd);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+/* Opens the disk on fd through a new block cache. Returns its head. */
+unsigned char *open_cache(int fd) {
+	if (cache_count == CACHE_MAX_DISKS) {
+		fprintf(stderr, "Too many disks open.\n");
+		exit(1);
+	}
+	struct block_cache *c = &caches[cache_count];
+	struct ext2_super_block sb;
+	if (pread(fd, &sb, sizeof(sb), 1024) != sizeof(sb)) {
+		perror("pread");
+		exit(1);
+	}
+	memset(c, 0, sizeof(*c));
+	c->fd = dup(fd); // Written back on exit, after the tool may have closed fd
+	c->bs = EXT2_BLOCK_SIZE(&sb);
+	c->blocks_count = sb.s_blocks_count;
+	unsigned int groups = (sb.s_blocks_count - sb.s_first_data_block + sb.s_blocks_per_group - 1) /
+		sb.s_blocks_per_group;
+	c->head_blocks = sb.s_first_data_block + 1 +
+		(groups * sizeof(struct ext2_group_desc) + c->bs - 1) / c->bs;
+	c->head = malloc((size_t)c->head_blocks * c->bs);
+	if (pread(fd, c->head, (size_t)c->head_blocks * c->bs, 0) != (size_t)c->head_blocks * c->bs) {
+		perror("pread");
+		exit(1);
+	}
+	c->head_clean = malloc((size_t)c->head_blocks * c->bs);
+	memcpy(c->head_clean, c->head, (size_t)c->head_blocks * c->bs);
+	c->max = cache_size / (2 * c->bs); // Each slot holds the block and its copy
+	if (c->max < 64) c->max = 64;
+	c->nbuckets = 128;
+	c->buckets = malloc(c->nbuckets * sizeof(int));
+	memset(c->buckets, -1, c->nbuckets * sizeof(int));
+	pthread_mutex_init(&c->lock, NULL);
+	cache_count++;
+	// The cache only sees our own writes, keep everyone else out
+	mapped_fd = fd;
+	lock_image(1);
+	return c->head;
+}
+
+/* GEOMETRY */
+
+/* Maps the whole image open on fd, read-write and shared, or opens it
+ * through a block cache with --io pread. If the image is already open, as
+ * it is in a request served by ext2d, its mapping or cache is returned
+ * instead, whatever --io says, and fd is closed: the image stays on the fd
+ * it was first opened with. Exits if the image cannot be mapped, or if
+ * image_pinned is set and it is not the one already open.
+ */
+unsigned char *map_disk(int fd) {
+	double start = trace_begin();
+	struct stat st;
+	unsigned char *disk;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror("open");
+		exit(ENOENT);
+	}
+	if (mapped_disk != NULL && st.st_dev == mapped_dev && st.st_ino == mapped_ino &&
+			(mapped_size == 0 || st.st_size == mapped_size)) {
+		disown_fd(fd);
+		if (fd != mapped_fd) {
+			close(fd);
+		}
+		if (mapped_size == 0) {
+			at_tool_exit(flush_caches);
+		}
+		trace_end("open/reuse", start);
+		return mapped_disk;
+	}
+	if (image_pinned) { // Its locks and mapping are not ours to take
+		fprintf(stderr, "Disk image is not the one being served.\n");
+		exit(EXDEV);
+	}
+	disown_fd(fd); // The image's fd is ours from here on
+	if (use_cache) {
+		disk = open_cache(fd);
+		mapped_size = 0;
+		at_tool_exit(flush_caches);
+	} else {
+		disk = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (disk == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		if (stats_tool != NULL) {
+			// Write back pages left dirty by earlier runs so only ours get counted.
+			msync(disk, st.st_size, MS_SYNC);
+		}
+		mapped_size = st.st_size;
+		mapped_fd = fd;
+	}
+	mapped_disk = disk;
+	mapped_dev = st.st_dev;
+	mapped_ino = st.st_ino;
+	trace_end(use_cache ? "open/cache" : "open/mmap", start);
+	return disk;
+}
+
+/* Ends a tool's run without exiting, as ext2d does after every request: the
+ * exit hooks run and the run's flags, counters and pins are dropped. The
+ * image, its cache and summary, and the lock table are left for the next run.
+ */
+void finish_run() {
+	run_exit_hooks();
+	release_blocks();
+	memset(&stats, 0, sizeof(stats));
+	stats_tool = NULL;
+	trace_path = trace_tool = NULL;
+	trace_count = 0;
+	crc_path = NULL;
+	crc_inode_count = crc_block_count = 0;
+}
+
+/* Returns the superblock, always 1024 bytes into the image. */
+struct ext2_super_block *get_super(unsigned char *disk) {
+	return (struct ext2_super_block *)(disk + 1024);
+}
+
+/* Returns the block size recorded in the superblock. */
+unsigned int get_block_size(unsigned char *disk) {
+	return EXT2_BLOCK_SIZE(get_super(disk));
+}
+
+/* Returns a pointer to the start of block number block. */
+unsigned char *get_block(unsigned char *disk, unsigned int block) {
+	if (cache_count > 0) {
+		struct block_cache *c = find_cache(disk);
+		if (c != NULL) {
+			return cache_block(c, block, 0);
+		}
+	}
+	return disk + (size_t)block * get_block_size(disk);
+}
+
+/* Returns block like get_block, for a caller about to overwrite all of it,
+ * such as a newly allocated data block. Through the block cache it is not
+ * read first.
+ */
+unsigned char *get_new_block(unsigned char *disk, unsigned int block) {
+	if (cache_count > 0) {
+		struct block_cache *c = find_cache(disk);
+		if (c != NULL) {
+			return cache_block(c, block, 1);
+		}
+	}
+	return get_block(disk, block);
+}
+
+/* Writes everything written to disk so far back to the image. */
+void sync_disk(unsigned char *disk) {
+	if (disk == NULL) {
+		return;
+	}
+	if (find_cache(disk) != NULL) {
+		flush_caches();
+	} else {
+		msync(disk, mapped_size, MS_SYNC);
+	}
+}
+
+/* Starts reading the n blocks listed, 0 for none, in the background so a
+ * scan about to get them does not wait for each in turn. A mapped image has
+ * the kernel read their pages ahead instead.
+ */
+void prefetch_blocks(unsigned char *disk, unsigned int *blocks, int n) {
+	struct block_cache *c = cache_count > 0 ? find_cache(disk) : NULL;
+	if (c != NULL) {
+		cache_prefetch(c, blocks, n);
+		return;
+	}
+	unsigned int bs = get_block_size(disk), count = get_super(disk)->s_blocks_count;
+	size_t page = sysconf(_SC_PAGESIZE);
+	int i;
+	for (i = 0; i < n; i++) {
+		if (blocks[i] != 0 && blocks[i] < count) {
+			size_t offset = (size_t)blocks[i] * bs;
+			madvise(disk + offset / page * page, offset % page + bs, MADV_WILLNEED);
+		}
+	}
+}
+
+/* Returns the number of block groups on the disk. */
+unsigned int get_group_count(unsigned char *disk) {
+	struct ext2_super_block *sb = get_super(disk);
+	return (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) /
+		sb->s_blocks_per_group;
+}
+
+/* Returns the descriptor of block group group. The table starts in the block
+ * right after the superblock's.
+ */
+struct ext2_group_desc *get_group_desc(unsigned char *disk, unsigned int group) {
+	struct ext2_super_block *sb = get_super(disk);
+	return (struct ext2_group_desc *)get_block(disk, sb->s_first_data_block + 1) + group;
+}
+
+/* Returns the inode table block holding the inode at index. */
+unsigned int inode_table_block(unsigned char *disk, unsigned int index) {
+	struct ext2_super_block *sb = get_super(disk);
+	struct ext2_group_desc *gd = get_group_desc(disk, index / sb->s_inodes_per_group);
+	return gd->bg_inode_table + (size_t)sb->s_inode_size * (index % sb->s_inodes_per_group) /
+		get_block_size(disk);
+}
+
+/* Returns the inode at index (inode number - 1), in whichever group holds it. */
+struct ext2_inode *get_inode(unsigned char *disk, unsigned int index) {
+	struct ext2_super_block *sb = get_super(disk);
+	size_t offset = (size_t)sb->s_inode_size * (index % sb->s_inodes_per_group);
+	if (crc_path != NULL) {
+		touch_inode(index);
+	}
+	return (struct ext2_inode *)(get_block(disk, inode_table_block(disk, index)) +
+		offset % get_block_size(disk));
+}
+
+/* Returns the block holding logical block n of the file or directory ip,
+ * through the indirect, double and triple indirect pointers past the first
+ * 12, 0 for a hole or for a block beyond what the pointers reach.
+ */
+unsigned int file_block(unsigned char *disk, struct ext2_inode *ip, unsigned int n) {
+	unsigned int per = get_block_size(disk) / sizeof(unsigned int);
+	uint64_t span = 1; // Blocks reachable through one pointer at a level
+	int level;
+	if (n < 12) {
+		return ip->i_block[n];
+	}
+	n -= 12;
+	for (level = 1; level <= 3; level++) {
+		span *= per;
+		if (n < span) {
+			break;
+		}
+		n -= span;
+	}
+	if (level > 3) {
+		return 0;
+	}
+	unsigned int block = ip->i_block[11 + level];
+	for (; level > 0 && block != 0; level--) {
+		if (block >= get_super(disk)->s_blocks_count) {
+			return 0;
+		}
+		span /= per;
+		block = ((unsigned int *)get_block(disk, block))[n / span];
+		n %= span;
+	}
+	return block;
+}
+
+/* Returns the number of blocks in directory ip, from its size. */
+unsigned int dir_block_count(unsigned char *disk, struct ext2_inode *ip) {
+	return ip->i_size / get_block_size(disk);
+}
+
+/* Calls visit on block and, for an indirect block of the given level, on
+ * every block below it.
+ */
+void visit_block_tree(unsigned char *disk, unsigned int block, int level,
+		void (*visit)(unsigned int, void *), void *arg) {
+	unsigned int i, per = get_block_size(disk) / sizeof(unsigned int);
+	if (block == 0 || block >= get_super(disk)->s_blocks_count) {
+		return;
+	}
+	visit(block, arg);
+	for (i = 0; level > 0 && i < per; i++) {
+		visit_block_tree(disk, ((unsigned int *)get_block(disk, block))[i], level - 1, visit, arg);
+	}
+}
+
+/* Calls visit with arg on every block ip uses, its data blocks and the
+ * indirect blocks pointing to them. A fast symlink has none.
+ */
+void for_each_file_block(unsigned char *disk, struct ext2_inode *ip,
+		void (*visit)(unsigned int, void *), void *arg) {
+	int i;
+	if (is_fast_symlink(ip)) {
+		return;
+	}
+	for (i = 0; i < 15; i++) {
+		visit_block_tree(disk, ip->i_block[i], i < 12 ? 0 : i - 11, visit, arg);
+	}
+}
+
+/* Returns 1 if the inode at index is marked in its group's inode bitmap. */
+int inode_in_use(unsigned char *disk, unsigned int index) {
+	struct ext2_super_block *sb = get_super(disk);
+	struct ext2_group_desc *gd = get_group_desc(disk, index / sb->s_inodes_per_group);
+	return check_node(index % sb->s_inodes_per_group, get_block(disk, gd->bg_inode_bitmap));
+}
+
+/* Returns 1 if block is marked in its group's block bitmap. */
+int block_in_use(unsigned char *disk, unsigned int block) {
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int bit = block - sb->s_first_data_block;
+	struct ext2_group_desc *gd = get_group_desc(disk, bit / sb->s_blocks_per_group);
+	return check_node(bit % sb->s_blocks_per_group, get_block(disk, gd->bg_block_bitmap));
+}
+
+/* LOCKING */
+
+/*
+ * Advisory fcntl locks on byte ranges of the image, so several processes
+ * can write to one image at once:
+ * - a directory's inode, held exclusively by a tool from the time it has
+ *   resolved the directory until it exits, and shared while a path is
+ *   resolved through it;
+ * - a group's block or inode bitmap block, held while it is scanned and
+ *   marked;
+ * - the superblock, held just while its free counters are updated.
+ * Locks are always taken in that order. fcntl locks do not nest and a second
+ * lock on a range replaces the first, so every range is counted here and
+ * only locked and unlocked with the kernel at the outermost level. Ranges
+ * inside a whole-image lock that already covers them are left alone, since
+ * unlocking them would punch a hole in it. All locks go when the process
+ * exits.
+ *
+ * While a tool keeps the checksum sidecar up to date, exclusive locks it
+ * lets go of are deferred instead: they stay held until the sidecar has the
+ * checksums of what was written under them, so no other process can change
+ * those blocks in between. The sidecar is brought up to date, and the
+ * deferred locks let go, on exit, and before waiting for any other lock, so
+ * a deferred lock is never held while waiting and the lock order still holds.
+ */
+#define LOCK_MAX_HELD 64
+
+struct held_lock {
+	off_t start;
+	off_t len;
+	int exclusive;
+	int depth;      /* Nesting level, 0 if the slot is unused */
+	int deferred;   /* Let go of, held until the checksums are written */
+};
+
+struct held_lock held_locks[LOCK_MAX_HELD];
+int threaded_writes = 0;    // Set between start_threaded_writes and finish_threaded_writes
+int deferred_count = 0;
+
+void sync_checksums();
+
+/* Returns the held lock on exactly start and len, NULL if there is none. */
+struct held_lock *get_held_lock(off_t start, off_t len) {
+	int i;
+	for (i = 0; i < LOCK_MAX_HELD; i++) {
+		if (held_locks[i].depth > 0 && held_locks[i].start == start && held_locks[i].len == len) {
+			return &held_locks[i];
+		}
+	}
+	return NULL;
+}
+
+/* Returns 1 if a whole-image lock held by us covers a lock of that kind. */
+int image_lock_covers(off_t start, off_t len, int exclusive) {
+	struct held_lock *image = get_held_lock(0, 0);
+	return image != NULL && (start != 0 || len != 0) && (image->exclusive || !exclusive);
+}
+
+/* Sets an fcntl lock of type on the image, waiting for it if need be.
+ * Exits if it cannot be taken, which fcntl reports when waiting would deadlock.
+ */
+void set_range_lock(off_t start, off_t len, short type) {
+	struct flock fl = {.l_type = type, .l_whence = SEEK_SET, .l_start = start, .l_len = len};
+	if (fcntl(mapped_fd, F_SETLK, &fl) == 0) {
+		return;
+	}
+	if (deferred_count > 0) {
+		sync_checksums();
+	}
+	double wait_start = trace_begin();
+	stats.lock_waits++;
+	while (fcntl(mapped_fd, F_SETLKW, &fl) == -1) {
+		if (errno != EINTR) {
+			perror("lock");
+			exit(1);
+		}
+	}
+	trace_end("lock wait", wait_start);
+}
+
+/* Locks len bytes of the image at start, exclusively or shared. A range that
+ * is already held is only upgraded, never downgraded.
+ */
+void lock_range(off_t start, off_t len, int exclusive) {
+	if (mapped_fd == -1 || threaded_writes || image_lock_covers(start, len, exclusive)) {
+		return;
+	}
+	struct held_lock *held = get_held_lock(start, len);
+	if (held != NULL) {
+		if (exclusive && !held->exclusive) {
+			set_range_lock(start, len, F_WRLCK);
+			held->exclusive = 1;
+		}
+		if (held->deferred) {
+			held->deferred = 0;
+			deferred_count--;
+		} else {
+			held->depth++;
+		}
+		return;
+	}
+	int i;
+	for (i = 0; i < LOCK_MAX_HELD && held_locks[i].depth > 0; i++);
+	if (i == LOCK_MAX_HELD && deferred_count > 0) {
+		sync_checksums();
+		for (i = 0; i < LOCK_MAX_HELD && held_locks[i].depth > 0; i++);
+	}
+	if (i == LOCK_MAX_HELD) {
+		fprintf(stderr, "Too many locks held.\n");
+		exit(1);
+	}
+	set_range_lock(start, len, exclusive ? F_WRLCK : F_RDLCK);
+	held_locks[i].start = start;
+	held_locks[i].len = len;
+	held_locks[i].exclusive = exclusive;
+	held_locks[i].depth = 1;
+	held_locks[i].deferred = 0;
+}
+
+/* Drops one level of the lock on len bytes at start, unlocking at the last. */
+void unlock_range(off_t start, off_t len) {
+	if (threaded_writes) {
+		return;
+	}
+	struct held_lock *held = get_held_lock(start, len);
+	if (held == NULL || held->deferred || --held->depth > 0) {
+		return;
+	}
+	if (crc_path != NULL && held->exclusive) {
+		held->depth = 1;
+		held->deferred = 1;
+		deferred_count++;
+		return;
+	}
+	set_range_lock(start, len, F_UNLCK);
+}
+
+/* Lets go of the locks deferred until the checksums were written. */
+void release_deferred_locks() {
+	int i;
+	for (i = 0; i < LOCK_MAX_HELD && deferred_count > 0; i++) {
+		if (held_locks[i].depth > 0 && held_locks[i].deferred) {
+			held_locks[i].depth = 0;
+			held_locks[i].deferred = 0;
+			deferred_count--;
+			set_range_lock(held_locks[i].start, held_locks[i].len, F_UNLCK);
+		}
+	}
+}
+
+/* Locks the whole image, for tools that look at everything. */
+void lock_image(int exclusive) {
+	lock_range(0, 0, exclusive);
+}
+
+/* Locks the inode at index, exclusively or shared. */
+void lock_inode(unsigned char *disk, unsigned int index, int exclusive) {
+	lock_range((unsigned char *)get_inode(disk, index) - disk, get_super(disk)->s_inode_size, exclusive);
+}
+
+void unlock_inode(unsigned char *disk, unsigned int index) {
+	unlock_range((unsigned char *)get_inode(disk, index) - disk, get_super(disk)->s_inode_size);
+}
+
+/* Locks block, such as a group's bitmap, exclusively. */
+void lock_block(unsigned char *disk, unsigned int block) {
+	lock_range(get_block(disk, block) - disk, get_block_size(disk), 1);
+}
+
+void unlock_block(unsigned char *disk, unsigned int block) {
+	unlock_range(get_block(disk, block) - disk, get_block_size(disk));
+}
+
+/* Locks the superblock for a counter update. */
+void lock_super() {
+	lock_range(1024, sizeof(struct ext2_super_block), 1);
+}
+
+void unlock_super() {
+	unlock_range(1024, sizeof(struct ext2_super_block));
+}
+
+/* COUNTERS */
+
+/*
+ * Free counter changes made by mark_inode and mark_block. Normally they are
+ * applied straight away. Between start_threaded_writes and
+ * finish_threaded_writes each thread keeps its own deltas instead and folds
+ * them into the superblock and group descriptors with commit_counters when
+ * it is done, so threads do not contend on the counters for every
+ * allocation.
+ */
+struct counter_deltas {
+	int inodes;
+	int blocks;
+	unsigned int groups;  /* Size of the per-group arrays, 0 until first used */
+	int *group_inodes;
+	int *group_blocks;
+};
+
+__thread struct counter_deltas deltas;
+
+/* Adds n to the free inode (is_block 0) or block (is_block 1) counters of
+ * group and the superblock, or to this thread's deltas for them.
+ */
+void update_free_counts(unsigned char *disk, unsigned int group, int is_block, int n) {
+	struct ext2_super_block *sb = get_super(disk);
+	struct ext2_group_desc *gd = get_group_desc(disk, group);
+	if (threaded_writes) {
+		if (deltas.groups == 0) {
+			deltas.groups = get_group_count(disk);
+			deltas.group_inodes = calloc(deltas.groups, sizeof(int));
+			deltas.group_blocks = calloc(deltas.groups, sizeof(int));
+		}
+		if (is_block) {
+			deltas.blocks += n;
+			deltas.group_blocks[group] += n;
+		} else {
+			deltas.inodes += n;
+			deltas.group_inodes[group] += n;
+		}
+		return;
+	}
+	if (is_block) gd->bg_free_blocks_count += n; else gd->bg_free_inodes_count += n;
+	lock_super();
+	if (is_block) sb->s_free_blocks_count += n; else sb->s_free_inodes_count += n;
+	unlock_super();
+}
+
+/* Folds this thread's counter deltas into the superblock and group
+ * descriptors. Threads call it before they finish.
+ */
+void commit_counters(unsigned char *disk) {
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int g;
+	__atomic_fetch_add(&sb->s_free_inodes_count, deltas.inodes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sb->s_free_blocks_count, deltas.blocks, __ATOMIC_RELAXED);
+	for (g = 0; g < deltas.groups; g++) {
+		struct ext2_group_desc *gd = get_group_desc(disk, g);
+		__atomic_fetch_add(&gd->bg_free_inodes_count, deltas.group_inodes[g], __ATOMIC_RELAXED);
+		__atomic_fetch_add(&gd->bg_free_blocks_count, deltas.group_blocks[g], __ATOMIC_RELAXED);
+	}
+	free(deltas.group_inodes);
+	free(deltas.group_blocks);
+	memset(&deltas, 0, sizeof(deltas));
+}
+
+/* ARENAS */
+
+/*
+ * A writer thread can claim a whole block group as its arena. Its inodes
+ * and blocks then come from that group first, which nobody else allocates
+ * from while there is room elsewhere, so the thread's CAS updates never
+ * contend and its files stay together. Nothing is reserved on disk, the
+ * claim is just an owner per group, so releasing an arena hands back
+ * whatever is left of it.
+ */
+uintptr_t *group_owners = NULL;  // Owning thread of each group, 0 if none
+__thread int arena_group = -1;   // This thread's group, its address is the owner token
+
+#define ARENA_TOKEN ((uintptr_t)&arena_group)
+
+/* Returns the order this thread should try group g in: 0 for its own arena,
+ * 1 for groups nobody owns and 2 for other threads' arenas.
+ */
+int group_rank(unsigned int g) {
+	if (group_owners == NULL) {
+		return 1;
+	}
+	uintptr_t owner = __atomic_load_n(&group_owners[g], __ATOMIC_RELAXED);
+	if (owner == 0) {
+		return 1;
+	}
+	return owner == ARENA_TOKEN ? 0 : 2;
+}
+
+/* Claims the unowned group with the most free blocks as this thread's arena.
+ * Returns the group, -1 if every group is taken.
+ */
+int claim_arena(unsigned char *disk) {
+	unsigned int g, groups = get_group_count(disk);
+	if (group_owners == NULL) {
+		return -1;
+	}
+	while (arena_group == -1) {
+		int best = -1;
+		for (g = 0; g < groups; g++) {
+			if (__atomic_load_n(&group_owners[g], __ATOMIC_RELAXED) == 0 && (best == -1 ||
+					get_group_desc(disk, g)->bg_free_blocks_count >
+					get_group_desc(disk, best)->bg_free_blocks_count)) {
+				best = g;
+			}
+		}
+		if (best == -1) {
+			return -1;
+		}
+		uintptr_t none = 0;
+		if (__atomic_compare_exchange_n(&group_owners[best], &none, ARENA_TOKEN, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			arena_group = best;
+		}
+	}
+	return arena_group;
+}
+
+/* Lets several threads of this process allocate on the image at once. The
+ * whole image is locked against other processes, since fcntl locks cannot
+ * tell threads apart, and the finer locks are skipped until
+ * finish_threaded_writes. Every thread must commit_counters and
+ * release_arena before that. The image stays locked until the tool exits,
+ * as its other locks do, so what the threads wrote is written back under it.
+ */
+void start_threaded_writes(unsigned char *disk) {
+	lock_image(1);
+	group_owners = calloc(get_group_count(disk), sizeof(uintptr_t));
+	threaded_writes = 1;
+}
 
-/* HELPERS */
+void finish_threaded_writes() {
+	threaded_writes = 0;
+	free(group_owners);
+	group_owners = NULL;
+}
 
-/* Returns the node value at the index of the bitmap map. */
-int check_node(int index, unsigned char *map) {
-	return (map[index/8] >> (index % 8)) & 0x1;
+/* Marks the inode at index as used (1) or free (0), keeping the superblock and
+ * group counters in step. Does nothing if it already is.
+ * Returns 1 if the inode changed state, 0 if it already was.
+ */
+int mark_inode(unsigned char *disk, unsigned int index, int used) {
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int group = index / sb->s_inodes_per_group;
+	struct ext2_group_desc *gd = get_group_desc(disk, group);
+	unsigned char *imap = get_block(disk, gd->bg_inode_bitmap);
+	lock_block(disk, gd->bg_inode_bitmap);
+	int changed = set_node(index % sb->s_inodes_per_group, imap, used) != used;
+	if (changed && crc_path != NULL) {
+		touch_block(gd->bg_inode_bitmap);
+	}
+	if (changed) {
+		double start = trace_begin();
+		__atomic_fetch_add(used ? &stats.inodes_allocated : &stats.inodes_freed, 1, __ATOMIC_RELAXED);
+		update_free_counts(disk, group, 0, used ? -1 : 1);
+		trace_end("counter update", start);
+	}
+	unlock_block(disk, gd->bg_inode_bitmap);
+	return changed;
 }
 
-/* Sets the node value at the index in the bitmap map. */
-void set_node(int index, unsigned char *map) {
-	map[index/8] ^= (1 << (index % 8));
+/* Marks block as used (1) or free (0), keeping the superblock and group
+ * counters in step. Does nothing if it already is.
+ * Returns 1 if the block changed state, 0 if it already was.
+ */
+int mark_block(unsigned char *disk, unsigned int block, int used) {
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int bit = block - sb->s_first_data_block;
+	unsigned int group = bit / sb->s_blocks_per_group;
+	struct ext2_group_desc *gd = get_group_desc(disk, group);
+	unsigned char *bmap = get_block(disk, gd->bg_block_bitmap);
+	lock_block(disk, gd->bg_block_bitmap);
+	int changed = set_node(bit % sb->s_blocks_per_group, bmap, used) != used;
+	if (changed && crc_path != NULL) {
+		touch_block(gd->bg_block_bitmap);
+	}
+	if (changed) {
+		double start = trace_begin();
+		__atomic_fetch_add(used ? &stats.blocks_allocated : &stats.blocks_freed, 1, __ATOMIC_RELAXED);
+		update_free_counts(disk, group, 1, used ? -1 : 1);
+		trace_end("counter update", start);
+	}
+	unlock_block(disk, gd->bg_block_bitmap);
+	return changed;
+}
+
+/* Allocates the first free non-reserved inode, counting it as a directory in
+ * its group if is_dir is set. The thread's arena is tried first and other
+ * threads' arenas last. The inode is claimed with an atomic update of the
+ * bitmap, so threads can allocate at once; losing a race just moves on to
+ * the next free inode.
+ * Returns the inode index, -1 if there are no free inodes.
+ */
+int alloc_inode(unsigned char *disk, int is_dir) {
+	double start = trace_begin();
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int first = sb->s_rev_level == 0 ? EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+	unsigned int g, groups = get_group_count(disk);
+	unsigned int index;
+	int rank;
+	for (rank = 0; rank < 3; rank++) {
+		for (g = (first - 1) / sb->s_inodes_per_group; g < groups; g++) {
+			struct ext2_group_desc *gd = get_group_desc(disk, g);
+			unsigned char *imap = get_block(disk, gd->bg_inode_bitmap);
+			int bit = (g == (first - 1) / sb->s_inodes_per_group) ? (first - 1) % sb->s_inodes_per_group : 0;
+			if (gd->bg_free_inodes_count == 0 || group_rank(g) != rank) {
+				continue;
+			}
+			lock_block(disk, gd->bg_inode_bitmap);
+			while ((bit = find_free_node(imap, bit, sb->s_inodes_per_group)) != -1) {
+				index = g * sb->s_inodes_per_group + bit;
+				if (mark_inode(disk, index, 1)) {
+					if (is_dir) {
+						__atomic_fetch_add(&gd->bg_used_dirs_count, 1, __ATOMIC_RELAXED);
+					}
+					unlock_block(disk, gd->bg_inode_bitmap);
+					trace_end("inode allocation", start);
+					return index;
+				}
+			}
+			unlock_block(disk, gd->bg_inode_bitmap);
+		}
+	}
+	trace_end("inode allocation", start);
+	return -1;
 }
 
 /* Gets the type of the input file_type, for directories. */
@@ -42,19 +1964,31 @@ unsigned char get_dir_type(unsigned char file_type) {
 	}
 }
 
-/* Gets the type of the input inode in character form. */
-unsigned char get_inode_type(struct ext2_inode *ip) {
-	if (S_ISREG(ip->i_mode)) {
+/* Gets the type of an inode with the input mode in character form. */
+unsigned char get_mode_type(unsigned short mode) {
+	if (S_ISREG(mode)) {
 		return 'f';
-	} else if (S_ISDIR(ip->i_mode)) {
+	} else if (S_ISDIR(mode)) {
 		return 'd';
-	} else if (S_ISLNK(ip->i_mode)) {
+	} else if (S_ISLNK(mode)) {
 		return 'l';
 	} else {
 		return '?';
 	}
 }
 
+/* Gets the type of the input inode in character form. */
+unsigned char get_inode_type(struct ext2_inode *ip) {
+	return get_mode_type(ip->i_mode);
+}
+
+/* Returns 1 if ip is a fast symlink, whose i_block holds the target rather
+ * than block pointers, 0 otherwise.
+ */
+int is_fast_symlink(struct ext2_inode *ip) {
+	return S_ISLNK(ip->i_mode) && ip->i_blocks == 0;
+}
+
 /* Sets the file_type for the input dir_entry, based on the char input */
 void set_dir_type(struct ext2_dir_entry *dir_entry, unsigned char type) {
 	switch(type) {
@@ -73,42 +2007,104 @@ void set_dir_type(struct ext2_dir_entry *dir_entry, unsigned char type) {
 	}
 }
 
+/*
+ * Scans one directory block for an entry named target (len bytes long).
+ * One copy is generated per supported block size so the block size is a
+ * compile-time constant in the hot loop, plus a generic copy for anything else.
+ * Returns the entry's inode index, -1 if it is not in the block.
+ */
+#define DEFINE_SEARCH_DIR_BLOCK(suffix, size)                                        \
+int search_dir_block_##suffix(unsigned char *block, unsigned int block_size,        \
+		char *target, int len, int dir_only) {                                      \
+	unsigned int cur_rec_len;                                                        \
+	struct ext2_dir_entry *cur_dir;                                                  \
+	for (cur_rec_len = 0; cur_rec_len < (size); cur_rec_len += cur_dir->rec_len) {   \
+		cur_dir = (struct ext2_dir_entry *)(block + cur_rec_len);                    \
+		stats.dir_entries_compared++;                                                \
+		if (cur_dir->rec_len == 0) {                                                 \
+			break;                                                                   \
+		}                                                                            \
+		if (cur_dir->inode != 0 && cur_dir->name_len == len &&                       \
+				memcmp(cur_dir->name, target, len) == 0 &&                           \
+				(!dir_only || get_dir_type(cur_dir->file_type) == 'd')) {            \
+			return cur_dir->inode - 1; /* Return index, not the node itself. */      \
+		}                                                                            \
+	}                                                                                \
+	return -1;                                                                       \
+}
+
+DEFINE_SEARCH_DIR_BLOCK(1k, 1024)
+DEFINE_SEARCH_DIR_BLOCK(2k, 2048)
+DEFINE_SEARCH_DIR_BLOCK(4k, 4096)
+DEFINE_SEARCH_DIR_BLOCK(any, block_size)
+
+/* Scans a directory block of block_size bytes, picking the matching fast path. */
+int search_dir_block(unsigned char *block, unsigned int block_size, char *target, int dir_only) {
+	int len = strlen(target);
+	switch (block_size) {
+		case 1024: return search_dir_block_1k(block, block_size, target, len, dir_only);
+		case 2048: return search_dir_block_2k(block, block_size, target, len, dir_only);
+		case 4096: return search_dir_block_4k(block, block_size, target, len, dir_only);
+		default: return search_dir_block_any(block, block_size, target, len, dir_only);
+	}
+}
+
 /* Searches the directories in an inode for a target directory 
  * Returns the dir_entry's inode if it exists, -1 otherwise.
  */
 unsigned int search_directories(unsigned char *disk, struct ext2_inode *node, char *target, int dir_only) {
-	// Dir related
+	unsigned int bs = get_block_size(disk), i, n = dir_block_count(disk, node), block;
+	int found;
+	for (i = 0; i < n; i++) {
+		if ((block = file_block(disk, node, i)) == 0) {
+			continue;
+		}
+		found = search_dir_block(get_block(disk, block), bs, target, dir_only);
+		if (found != -1) {
+			return found;
+		}
+	}
+	return -1;
+}
+
+/* Calls visit with arg for every entry in use in directory node, in order,
+ * skipping "." and "..".
+ * Stops and returns 1 as soon as visit does, returns 0 otherwise.
+ */
+int iterate_dir(unsigned char *disk, struct ext2_inode *node,
+		int (*visit)(struct ext2_dir_entry *, void *), void *arg) {
+	unsigned int bs = get_block_size(disk), i, n = dir_block_count(disk, node);
 	unsigned int cur_rec_len;
-	char filename[256];
 	struct ext2_dir_entry *cur_dir;
-
-	int i;
-	for (i = 0; node->i_block[i] != 0; i++) {
-		for (cur_rec_len = 0; cur_rec_len < 1024; ) {
-			cur_dir = (struct ext2_dir_entry *)(disk + (1024 * node->i_block[i]) + cur_rec_len);
-			cur_rec_len += cur_dir->rec_len;
-			memset(filename, '\0', sizeof(filename));
-			strncpy(filename, cur_dir->name, cur_dir->name_len);
-			if (strcmp(filename, target) == 0) { // Found matching dir
-				if (dir_only) { // If we're only checking for directories
-					if (get_dir_type(cur_dir->file_type) == 'd') {
-						return cur_dir->inode-1; // Return index, not the node itself.
-					}
-				} else { // Check all types of files
-					return cur_dir->inode-1;
-				}
+	for (i = 0; i < n; i++) {
+		unsigned int number = file_block(disk, node, i);
+		if (number == 0) {
+			continue;
+		}
+		unsigned char *block = get_block(disk, number);
+		for (cur_rec_len = 0; cur_rec_len < bs; cur_rec_len += cur_dir->rec_len) {
+			cur_dir = (struct ext2_dir_entry *)(block + cur_rec_len);
+			stats.dir_entries_compared++;
+			if (cur_dir->rec_len == 0) {
+				break;
+			}
+			if (cur_dir->inode == 0 || (cur_dir->name[0] == '.' && (cur_dir->name_len == 1 ||
+					(cur_dir->name_len == 2 && cur_dir->name[1] == '.')))) {
+				continue;
+			}
+			if (visit(cur_dir, arg)) {
+				return 1;
 			}
 		}
 	}
-	return -1;
+	return 0;
 }
 
 /* Checks if the parent path exists. 
  * Returns the parent inode index if it does and -1 if it doesn't.
  */
 int check_parent(unsigned char *disk, char *path) {
-	struct ext2_super_block *sb = (struct ext2_super_block *)(disk + 1024);
-	struct ext2_group_desc *desc = (struct ext2_group_desc *)(disk + 2*1024);
+	double start = trace_begin();
 	// Copying the path string into an array
 	// Getting amount of dir inputs
 	char *dupe = strdup(path);
@@ -138,8 +2134,12 @@ int check_parent(unsigned char *disk, char *path) {
 	i = 1;
 	while (i < dircount) {
 		if (strcmp(dirs[i], ".") != 0) {
-			curinode = (struct ext2_inode *)((disk + 1024 * desc->bg_inode_table) + (sb->s_inode_size * node));
+			int dir = node;
+			curinode = get_inode(disk, dir);
+			lock_inode(disk, dir, 0);
 			node = search_directories(disk, curinode, dirs[i], 1);
+			unlock_inode(disk, dir);
+			stats.path_components++;
 			if (node == -1) {
 				break;
 			}
@@ -148,9 +2148,32 @@ int check_parent(unsigned char *disk, char *path) {
 	}
 
 	free(dupe);
+	trace_end("path resolution", start);
 	return node;
 }
 
+/* Returns the inode index of the file or directory at absolute path,
+ * -1 if it does not exist.
+ */
+int lookup_path(unsigned char *disk, char *path) {
+	char *name = strdup(path);
+	int len = strlen(name);
+	int found;
+	while (len > 1 && name[len-1] == '/') { // Trailing slashes name the same file
+		name[--len] = '\0';
+	}
+	if (strcmp(name, "/") == 0) {
+		free(name);
+		return EXT2_ROOT_INO - 1;
+	}
+	found = check_parent(disk, name);
+	if (found != -1) {
+		found = search_directories(disk, get_inode(disk, found), strrchr(name, '/') + 1, 0);
+	}
+	free(name);
+	return found;
+}
+
 /* Increments or decrements the free block count by n in superblock sb and group descriptor desc */
 void adjust_free_blocks(int n, struct ext2_super_block *sb, struct ext2_group_desc *desc) {
 	sb->s_free_blocks_count += n;
@@ -162,3 +2185,751 @@ void adjust_free_inodes(int n, struct ext2_super_block *sb, struct ext2_group_de
 	sb->s_free_inodes_count += n;
 	desc->bg_free_inodes_count += n;
 }
+
+/* PREALLOCATION */
+
+/*
+ * Preallocation windows: runs of contiguous free blocks reserved in memory
+ * for an inode while it is open in this session (a tool run, a batch or a
+ * daemon connection). Reserved blocks stay free in the bitmap until they are
+ * handed out, so dropping a window is all it takes to release it.
+ */
+#define PREALLOC_MAX_WINDOWS 32
+#define PREALLOC_DEFAULT_BLOCKS 8      // Window size when the superblock sets none
+#define PREALLOC_DEFAULT_DIR_BLOCKS 4
+
+struct prealloc_window {
+	int inode;          /* Inode index owning the window */
+	unsigned int start; /* Next reserved block number */
+	unsigned int count; /* Reserved blocks left, 0 if the slot is unused */
+};
+
+__thread struct prealloc_window own_windows[PREALLOC_MAX_WINDOWS];  // Each thread has its own
+__thread struct prealloc_window *session_windows = NULL;  // A session's the thread allocates for
+
+/* Returns the windows of the session the thread is allocating for. */
+struct prealloc_window *prealloc_windows() {
+	return session_windows != NULL ? session_windows : own_windows;
+}
+
+/* Has the thread allocate for the session whose PREALLOC_MAX_WINDOWS windows
+ * are at windows from here on, for its own if windows is NULL. ext2d switches
+ * to a connection's windows for each of its requests.
+ */
+void use_prealloc_session(struct prealloc_window *windows) {
+	session_windows = windows;
+}
+
+/* Returns the window reserved for inode index inode, NULL if there is none. */
+struct prealloc_window *get_prealloc(int inode) {
+	struct prealloc_window *windows = prealloc_windows();
+	int i;
+	for (i = 0; i < PREALLOC_MAX_WINDOWS; i++) {
+		if (windows[i].count > 0 && windows[i].inode == inode) {
+			return &windows[i];
+		}
+	}
+	return NULL;
+}
+
+/* Returns the first block from block on that is not reserved in some
+ * inode's window, block itself if it is not reserved.
+ */
+unsigned int reserved_until(unsigned int block) {
+	struct prealloc_window *windows = prealloc_windows();
+	int i, moved = 1;
+	while (moved) { // Windows can lie back to back
+		moved = 0;
+		for (i = 0; i < PREALLOC_MAX_WINDOWS; i++) {
+			struct prealloc_window *w = &windows[i];
+			if (w->count > 0 && block >= w->start && block < w->start + w->count) {
+				block = w->start + w->count;
+				moved = 1;
+			}
+		}
+	}
+	return block;
+}
+
+/* Returns the first block from from up to to that starts a window, to if
+ * none does.
+ */
+unsigned int next_reserved(unsigned int from, unsigned int to) {
+	struct prealloc_window *windows = prealloc_windows();
+	int i;
+	for (i = 0; i < PREALLOC_MAX_WINDOWS; i++) {
+		struct prealloc_window *w = &windows[i];
+		if (w->count > 0 && w->start >= from && w->start < to) {
+			to = w->start;
+		}
+	}
+	return to;
+}
+
+/* Drops the window reserved for inode index inode, if any. */
+void release_prealloc(int inode) {
+	struct prealloc_window *win = get_prealloc(inode);
+	if (win != NULL) {
+		win->count = 0;
+	}
+}
+
+/* Drops every window, called when the session closes. */
+void release_all_prealloc() {
+	memset(prealloc_windows(), 0, PREALLOC_MAX_WINDOWS * sizeof(struct prealloc_window));
+}
+
+/* Gives this thread's arena back. Its windows stay with its session. */
+void release_arena() {
+	if (arena_group != -1) {
+		__atomic_store_n(&group_owners[arena_group], 0, __ATOMIC_RELEASE);
+		arena_group = -1;
+	}
+}
+
+/* Number of blocks to preallocate for a new allocation, as hinted by sb.
+ * Images made by mke2fs leave the hints at 0, they get the defaults.
+ * Directories only get windows with the dir_prealloc feature.
+ */
+int prealloc_goal(struct ext2_super_block *sb, int is_dir) {
+	if (is_dir) {
+		if (!(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_PREALLOC)) {
+			return 0;
+		}
+		return sb->s_prealloc_dir_blocks ? sb->s_prealloc_dir_blocks : PREALLOC_DEFAULT_DIR_BLOCKS;
+	}
+	return sb->s_prealloc_blocks ? sb->s_prealloc_blocks : PREALLOC_DEFAULT_BLOCKS;
+}
+
+/* Allocates a data block for inode index inode, marking it in the bitmap and
+ * updating the free counters. The block is taken from the inode's window if it
+ * has one, otherwise a new window of up to goal blocks is reserved from the
+ * first long enough run of free blocks, looking in the thread's arena first
+ * and other threads' arenas last. Batches use goal to lay out many blocks
+ * back to back.
+ * Returns the block number, -1 if the disk is full.
+ */
+int alloc_block_run(unsigned char *disk, int inode, int goal) {
+	double start = trace_begin();
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int first = sb->s_first_data_block;
+	unsigned int block;
+
+	struct prealloc_window *win = get_prealloc(inode);
+	if (win == NULL) {
+		// Look for a run of goal free blocks, settling for the first free one.
+		// Runs never cross groups, there is metadata in between.
+		int run = 0, rank;
+		long best = -1;
+		unsigned int g, bit, groups = get_group_count(disk);
+		if (goal < 1) goal = 1;
+		for (rank = 0; rank < 3 && best == -1; rank++) {
+			for (g = 0; g < groups && run < goal; g++) {
+				struct ext2_group_desc *gd = get_group_desc(disk, g);
+				unsigned char *bmap = get_block(disk, gd->bg_block_bitmap);
+				unsigned int base = first + g * sb->s_blocks_per_group;
+				unsigned int n = sb->s_blocks_count - base;
+				if (n > sb->s_blocks_per_group) n = sb->s_blocks_per_group;
+				if (gd->bg_free_blocks_count == 0 || group_rank(g) != rank) {
+					continue;
+				}
+				// Go from one free run to the next a bitmap word at a time,
+				// stepping over reserved windows whole
+				run = 0;
+				bit = 0;
+				while (bit < n) {
+					int free = find_free_node(bmap, bit, n);
+					if (free == -1) {
+						break;
+					}
+					unsigned int skip = reserved_until(base + free) - base;
+					if (skip != (unsigned int)free) {
+						bit = skip;
+						continue;
+					}
+					int used = find_used_node(bmap, free, n);
+					unsigned int end = next_reserved(base + free, base + (used == -1 ? n : (unsigned int)used)) - base;
+					if (best == -1) best = base + free;
+					if (end - free >= (unsigned int)goal) {
+						best = base + free;
+						run = goal;
+						break;
+					}
+					bit = end;
+				}
+			}
+		}
+		if (best == -1) {
+			trace_end("block allocation", start);
+			return -1;
+		}
+		block = best;
+		if (run == goal && goal > 1) { // Reserve the rest of the run
+			// A session that outlives many files, such as an ext2d
+			// connection, fills every slot: the window with the fewest
+			// blocks left makes way
+			struct prealloc_window *windows = prealloc_windows();
+			int i, slot = 0;
+			for (i = 1; i < PREALLOC_MAX_WINDOWS && windows[slot].count > 0; i++) {
+				if (windows[i].count < windows[slot].count) {
+					slot = i;
+				}
+			}
+			windows[slot].inode = inode;
+			windows[slot].start = block + 1;
+			windows[slot].count = goal - 1;
+		}
+	} else {
+		block = win->start++;
+		win->count--;
+	}
+	// Claim the block under its group's bitmap lock. If another process or
+	// thread took it since we looked, drop the window and start over.
+	unsigned int bitmap = get_group_desc(disk, (block - first) / sb->s_blocks_per_group)->bg_block_bitmap;
+	lock_block(disk, bitmap);
+	if (!mark_block(disk, block, 1)) {
+		unlock_block(disk, bitmap);
+		release_prealloc(inode);
+		trace_end("block allocation", start);
+		return alloc_block_run(disk, inode, goal);
+	}
+	unlock_block(disk, bitmap);
+	trace_end("block allocation", start);
+	return block;
+}
+
+/* Allocates a data block for inode index inode as above, with a window of
+ * the preallocation goal the superblock hints at for files or directories.
+ */
+int alloc_block(unsigned char *disk, int inode, int is_dir) {
+	return alloc_block_run(disk, inode, prealloc_goal(get_super(disk), is_dir));
+}
+
+/* Points logical block n of ip, the inode at index, at block, allocating
+ * the indirect blocks on the way that it does not have yet.
+ * Returns 0, or -1 if the disk is full or n is beyond the triple indirect
+ * block's reach.
+ */
+int map_file_block(unsigned char *disk, int index, struct ext2_inode *ip, unsigned int n,
+		unsigned int block) {
+	unsigned int bs = get_block_size(disk), per = bs / sizeof(unsigned int);
+	uint64_t span = 1;
+	int level;
+	if (n < 12) {
+		ip->i_block[n] = block;
+		return 0;
+	}
+	n -= 12;
+	for (level = 1; level <= 3; level++) {
+		span *= per;
+		if (n < span) {
+			break;
+		}
+		n -= span;
+	}
+	if (level > 3) {
+		return -1;
+	}
+	unsigned int *slot = &ip->i_block[11 + level];
+	for (; level > 0; level--) {
+		if (*slot == 0) {
+			int indirect = alloc_block(disk, index, S_ISDIR(ip->i_mode));
+			if (indirect == -1) {
+				return -1;
+			}
+			memset(get_new_block(disk, indirect), 0, bs);
+			ip->i_blocks += bs / 512;
+			*slot = indirect;
+		}
+		span /= per;
+		slot = (unsigned int *)get_block(disk, *slot) + n / span;
+		n %= span;
+	}
+	*slot = block;
+	return 0;
+}
+
+/* DIRECTORY ENTRIES */
+
+/*
+ * A new entry goes into the first block of its directory with a gap big
+ * enough for it, so the space ext2_rm frees in earlier blocks is used
+ * before the directory grows. The largest gap of each block is kept in
+ * memory from a directory's first insert, so later inserts into it, like a
+ * batch of mkdir -p, go straight to a block with room without reading the
+ * others. A gap is found again in the block itself before it is used, so a
+ * map gone stale at worst sends an entry to a later block.
+ */
+#define DIR_GAP_MAPS 64
+
+struct dir_gaps {
+	unsigned char *disk;
+	int index;                  // Directory inode index
+	unsigned int nblocks;       // Blocks it had when mapped
+	unsigned int cap;
+	unsigned short *largest;    // Largest gap in each of them
+};
+
+struct dir_gaps dir_gap_maps[DIR_GAP_MAPS];
+int dir_gap_count = 0, dir_gap_next = 0;
+
+/* Returns the space an entry named with name_len bytes takes, padded to 4. */
+unsigned int entry_size(unsigned int name_len) {
+	return (sizeof(struct ext2_dir_entry) + name_len + 3) & ~3;
+}
+
+/* Returns the space in entry that a new entry could take: all of it if it
+ * is unused, what its name does not need otherwise.
+ */
+unsigned int entry_gap(struct ext2_dir_entry *entry) {
+	if (entry->inode == 0) {
+		return entry->rec_len;
+	}
+	unsigned int size = entry_size(entry->name_len);
+	return entry->rec_len > size ? entry->rec_len - size : 0;
+}
+
+/* Returns the first entry of the directory block with a gap of at least
+ * need bytes, NULL if there is none, or the largest gap in the block if
+ * largest is not NULL.
+ */
+struct ext2_dir_entry *find_gap(unsigned char *block, unsigned int bs, unsigned int need,
+		unsigned int *largest) {
+	unsigned int offset = 0;
+	if (largest != NULL) {
+		*largest = 0;
+	}
+	while (offset < bs) {
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+		if (entry->rec_len == 0 || offset + entry->rec_len > bs) { // Corrupt, stop here
+			break;
+		}
+		unsigned int gap = entry_gap(entry);
+		if (largest != NULL) {
+			if (gap > *largest) {
+				*largest = gap;
+			}
+		} else if (gap >= need) {
+			return entry;
+		}
+		offset += entry->rec_len;
+	}
+	return NULL;
+}
+
+/* Returns the gap map of the directory at index, building it if it has none
+ * or it has grown since.
+ */
+struct dir_gaps *get_dir_gaps(unsigned char *disk, int index, struct ext2_inode *dir) {
+	unsigned int bs = get_block_size(disk), largest, nblocks = dir_block_count(disk, dir), block;
+	int i;
+	for (i = 0; i < dir_gap_count; i++) {
+		struct dir_gaps *gaps = &dir_gap_maps[i];
+		if (gaps->disk == disk && gaps->index == index && gaps->nblocks == nblocks) {
+			return gaps;
+		}
+	}
+	struct dir_gaps *gaps;
+	if (dir_gap_count < DIR_GAP_MAPS) {
+		gaps = &dir_gap_maps[dir_gap_count++];
+	} else { // Replace the maps in turn
+		gaps = &dir_gap_maps[dir_gap_next];
+		dir_gap_next = (dir_gap_next + 1) % DIR_GAP_MAPS;
+	}
+	gaps->disk = disk;
+	gaps->index = index;
+	gaps->nblocks = nblocks;
+	if (gaps->cap < nblocks + 1) {
+		gaps->cap = nblocks + 64;
+		gaps->largest = realloc(gaps->largest, gaps->cap * sizeof(unsigned short));
+	}
+	for (i = 0; i < nblocks; i++) {
+		largest = 0;
+		if ((block = file_block(disk, dir, i)) != 0) {
+			find_gap(get_block(disk, block), bs, 0, &largest);
+		}
+		gaps->largest[i] = largest;
+	}
+	return gaps;
+}
+
+/* Adds an entry named name for inode (index) of file_type to the directory
+ * at parent_index, which the caller holds exclusively, in the first block
+ * with room for it. A new block is added when none has.
+ * Exits if the disk is full.
+ */
+void add_dir_entry(unsigned char *disk, int parent_index, char *name, int inode,
+		unsigned char file_type) {
+	double start = trace_begin();
+	struct ext2_inode *parent = get_inode(disk, parent_index);
+	struct dir_gaps *gaps = get_dir_gaps(disk, parent_index, parent);
+	unsigned int bs = get_block_size(disk), need = entry_size(strlen(name)), largest;
+	struct ext2_dir_entry *entry = NULL;
+	unsigned char *block = NULL;
+	unsigned int k;
+	for (k = 0; k < gaps->nblocks; k++) {
+		if (gaps->largest[k] < need) {
+			continue;
+		}
+		block = get_block(disk, file_block(disk, parent, k));
+		if ((entry = find_gap(block, bs, need, NULL)) != NULL) {
+			break;
+		}
+		find_gap(block, bs, 0, &largest); // The map was stale
+		gaps->largest[k] = largest;
+	}
+	if (entry == NULL) {
+		// Allocate new block, contiguous with the parent's if it has a window.
+		// k is the first block unused by parent, past the direct ones it
+		// goes through the indirect blocks.
+		int newblock = alloc_block(disk, parent_index, 1);
+		if (newblock == -1 || map_file_block(disk, parent_index, parent, k, newblock) == -1) {
+			fprintf(stderr, "No more blocks available.");
+			exit(1);
+		}
+		parent->i_blocks += bs / 512;
+		parent->i_size += bs;
+		summary_update(disk, parent_index);
+		if (gaps->cap < k + 1) {
+			gaps->cap = 2 * (k + 1);
+			gaps->largest = realloc(gaps->largest, gaps->cap * sizeof(unsigned short));
+		}
+		gaps->nblocks = k + 1;
+		block = get_block(disk, newblock);
+		entry = (struct ext2_dir_entry *)block;
+		entry->rec_len = bs; // Takes up the whole of the new block.
+	} else if (entry->inode != 0) { // Shrink entry and add after it
+		unsigned int size = entry_size(entry->name_len);
+		struct ext2_dir_entry *next = (struct ext2_dir_entry *)((unsigned char *)entry + size);
+		next->rec_len = entry->rec_len - size; // Takes up the rest of its space.
+		entry->rec_len = size;
+		entry = next;
+	}
+	entry->inode = inode + 1;
+	entry->name_len = strlen(name);
+	entry->file_type = file_type;
+	memcpy(entry->name, name, entry->name_len);
+	find_gap(block, bs, 0, &largest);
+	gaps->largest[k] = largest;
+	trace_end("directory insert", start);
+}
+
+/* INODE SUMMARY */
+
+/*
+ * The fields whole-disk scans look at, for every inode, each in an array of
+ * its own indexed by inode index: 20 bytes an inode, read from contiguous
+ * memory, rather than a full inode from the tables. It is built once per
+ * disk by the first inode_summary() call and kept current by
+ * summary_update(), which whatever changes one of these fields in an inode
+ * calls once it is done with it.
+ */
+#define SUMMARY_WINDOW 32   // Inode table blocks read ahead while building
+
+struct inode_summary {
+	unsigned char *disk;        // Disk it was built from, NULL until then
+	unsigned int count;
+	unsigned short *mode;
+	unsigned short *links;
+	unsigned int *size;
+	unsigned int *dtime;
+	unsigned int *blocks;       // i_blocks, in 512-byte sectors
+	unsigned int *first_block;  // i_block[0], part of the target for a fast symlink
+};
+
+struct inode_summary summary = {NULL};
+
+/* Copies the summarized fields of ip, the inode at index, into the summary. */
+void summary_copy(unsigned int index, struct ext2_inode *ip) {
+	summary.mode[index] = ip->i_mode;
+	summary.links[index] = ip->i_links_count;
+	summary.size[index] = ip->i_size;
+	summary.dtime[index] = ip->i_dtime;
+	summary.blocks[index] = ip->i_blocks;
+	summary.first_block[index] = ip->i_block[0];
+}
+
+/* Starts reading the inode table blocks of the window of inodes from index
+ * from.
+ */
+void summary_prefetch(unsigned char *disk, unsigned int from) {
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int blocks[SUMMARY_WINDOW], per_block = get_block_size(disk) / sb->s_inode_size, i;
+	int n = 0;
+	for (i = from; i < sb->s_inodes_count && n < SUMMARY_WINDOW; i += per_block) {
+		blocks[n++] = inode_table_block(disk, i);
+	}
+	prefetch_blocks(disk, blocks, n);
+}
+
+/* Returns the summary of disk, building it on the first call. The inode
+ * tables are read in order, a table block at a time, with the next window
+ * of blocks read ahead.
+ */
+struct inode_summary *inode_summary(unsigned char *disk) {
+	if (summary.disk == disk) {
+		return &summary;
+	}
+	double start = trace_begin();
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int per_block = get_block_size(disk) / sb->s_inode_size;
+	unsigned int count = sb->s_inodes_count, window = SUMMARY_WINDOW * per_block;
+	unsigned int index, i;
+	summary.count = count;
+	summary.mode = realloc(summary.mode, count * sizeof(unsigned short));
+	summary.links = realloc(summary.links, count * sizeof(unsigned short));
+	summary.size = realloc(summary.size, count * sizeof(unsigned int));
+	summary.dtime = realloc(summary.dtime, count * sizeof(unsigned int));
+	summary.blocks = realloc(summary.blocks, count * sizeof(unsigned int));
+	summary.first_block = realloc(summary.first_block, count * sizeof(unsigned int));
+	// Groups hold whole table blocks, so index starts a block every time
+	for (index = 0; index < count; index += per_block) {
+		if (index % window == 0) {
+			if (index == 0) {
+				summary_prefetch(disk, 0);
+			}
+			summary_prefetch(disk, index + window);
+		}
+		unsigned char *table = get_block(disk, inode_table_block(disk, index));
+		for (i = 0; i < per_block && index + i < count; i++) {
+			summary_copy(index + i, (struct ext2_inode *)(table + i * sb->s_inode_size));
+		}
+		release_blocks();
+	}
+	summary.disk = disk;
+	trace_end("inode summary", start);
+	return &summary;
+}
+
+/* Copies the inode at index into the summary of disk, if it has been built,
+ * after its mode, link count, size, deletion time or blocks changed.
+ */
+void summary_update(unsigned char *disk, unsigned int index) {
+	if (summary.disk == disk && index < summary.count) {
+		summary_copy(index, get_inode(disk, index));
+	}
+}
+
+/* CHECKSUM SIDECAR */
+
+/*
+ * The sidecar (disk.crc) is a header followed by a CRC32C slot for every
+ * block of the image. Only the metadata blocks' slots are used: the
+ * superblock and group descriptors, the bitmaps, the inode tables and the
+ * directory blocks. ext2_checker --verify-fast creates it; from then on the
+ * tools that write to the image update the slots of what they wrote as they
+ * exit.
+ */
+#define CRC_MAGIC 0x4b433245    // "E2CK"
+
+struct crc_header {
+	unsigned int magic;
+	unsigned int block_size;
+	unsigned int blocks_count;
+};
+
+/* What a metadata block holds. */
+enum crc_kind { CRC_SUPER, CRC_BITMAP, CRC_TABLE, CRC_DIR };
+
+/* Returns the sidecar's name for the image named name. */
+char *crc_sidecar(char *name) {
+	char *path = malloc(strlen(name) + 5);
+	sprintf(path, "%s.crc", name);
+	return path;
+}
+
+/* A visit of the blocks of one directory, passed through for_each_file_block. */
+struct dir_block_visit {
+	void (*visit)(unsigned int, enum crc_kind, unsigned int, void *);
+	unsigned int index;
+	void *arg;
+};
+
+void visit_dir_block(unsigned int block, void *arg) {
+	struct dir_block_visit *v = arg;
+	v->visit(block, CRC_DIR, v->index, v->arg);
+}
+
+/* Calls visit on each block of the directory ip, indirect blocks included. */
+void for_each_dir_block(unsigned char *disk, struct ext2_inode *ip,
+		void (*visit)(unsigned int, enum crc_kind, unsigned int, void *), unsigned int index, void *arg) {
+	struct dir_block_visit v = {visit, index, arg};
+	for_each_file_block(disk, ip, visit_dir_block, &v);
+}
+
+/* Calls visit on every metadata block of disk with what it holds and, for a
+ * directory block, the index of its directory.
+ */
+void for_each_metadata_block(unsigned char *disk,
+		void (*visit)(unsigned int, enum crc_kind, unsigned int, void *), void *arg) {
+	struct ext2_super_block *sb = get_super(disk);
+	unsigned int bs = get_block_size(disk), groups = get_group_count(disk), g, b, i;
+	unsigned int table_blocks = sb->s_inodes_per_group * sb->s_inode_size / bs;
+	unsigned int desc_blocks = (groups * sizeof(struct ext2_group_desc) + bs - 1) / bs;
+	for (b = 0; b <= desc_blocks; b++) {
+		visit(sb->s_first_data_block + b, CRC_SUPER, 0, arg);
+	}
+	for (g = 0; g < groups; g++) {
+		struct ext2_group_desc *gd = get_group_desc(disk, g);
+		visit(gd->bg_block_bitmap, CRC_BITMAP, 0, arg);
+		visit(gd->bg_inode_bitmap, CRC_BITMAP, 0, arg);
+		for (b = 0; b < table_blocks; b++) {
+			visit(gd->bg_inode_table + b, CRC_TABLE, 0, arg);
+			release_blocks();
+		}
+	}
+	struct inode_summary *s = inode_summary(disk);
+	for (i = 0; i < sb->s_inodes_count; i++) {
+		if (S_ISDIR(s->mode[i]) && inode_in_use(disk, i)) {
+			for_each_dir_block(disk, get_inode(disk, i), visit, i, arg);
+			release_blocks();
+		}
+	}
+}
+
+/* Stores the checksum of block in the slot array arg. */
+void crc_store(unsigned int block, enum crc_kind kind, unsigned int index, void *arg) {
+	struct ext2_super_block *sb = get_super(mapped_disk);
+	if (block < sb->s_blocks_count) {
+		((uint32_t *)arg)[block] = crc32c(get_block(mapped_disk, block), get_block_size(mapped_disk));
+	}
+}
+
+/* Reads the sidecar at path. Returns its slots, NULL if it is missing or
+ * for a disk of another size.
+ */
+uint32_t *read_checksums(unsigned char *disk, char *path) {
+	struct ext2_super_block *sb = get_super(disk);
+	struct crc_header header;
+	size_t len = (size_t)sb->s_blocks_count * sizeof(uint32_t);
+	uint32_t *crcs = malloc(len);
+	FILE *in = fopen(path, "r");
+	if (in == NULL || fread(&header, sizeof(header), 1, in) != 1 || header.magic != CRC_MAGIC ||
+			header.block_size != get_block_size(disk) || header.blocks_count != sb->s_blocks_count ||
+			fread(crcs, len, 1, in) != 1) {
+		if (in != NULL) fclose(in);
+		free(crcs);
+		return NULL;
+	}
+	fclose(in);
+	return crcs;
+}
+
+/* Takes a write lock on the whole sidecar open on fd, waiting for it. The
+ * tools' own locks may already be gone when the sidecar is updated on exit.
+ */
+void lock_sidecar(int fd) {
+	struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0};
+	while (fcntl(fd, F_SETLKW, &fl) == -1 && errno == EINTR);
+}
+
+/* Checksums every metadata block of disk and writes them all to the sidecar
+ * at path, creating it if need be.
+ */
+void rebuild_checksums(unsigned char *disk, char *path) {
+	double start = trace_begin();
+	struct ext2_super_block *sb = get_super(disk);
+	struct crc_header header = {CRC_MAGIC, get_block_size(disk), sb->s_blocks_count};
+	size_t len = (size_t)sb->s_blocks_count * sizeof(uint32_t);
+	uint32_t *crcs = calloc(sb->s_blocks_count, sizeof(uint32_t));
+	for_each_metadata_block(disk, crc_store, crcs);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd != -1) {
+		lock_sidecar(fd);
+	}
+	if (fd == -1 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			pwrite(fd, crcs, len, sizeof(header)) != len || ftruncate(fd, sizeof(header) + len) == -1) {
+		perror(path);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	free(crcs);
+	trace_end("checksum update", start);
+}
+
+/* Writes the checksum of block to its slot in the sidecar open on arg. */
+void crc_write(unsigned int block, enum crc_kind kind, unsigned int index, void *arg) {
+	struct ext2_super_block *sb = get_super(mapped_disk);
+	uint32_t crc;
+	if (block < sb->s_blocks_count) {
+		crc = crc32c(get_block(mapped_disk, block), get_block_size(mapped_disk));
+		pwrite(*(int *)arg, &crc, sizeof(crc), sizeof(struct crc_header) + (off_t)block * sizeof(crc));
+	}
+}
+
+/* Updates the sidecar with the checksums of everything this process may have
+ * written so far, still holding the locks it wrote under, then lets go of
+ * the deferred ones (see LOCKING). The sidecar is locked while the blocks
+ * are checksummed so the last process to finish writes last. Everything
+ * touched stays listed, the tool may not be done with it yet.
+ */
+void sync_checksums() {
+	unsigned char *disk = mapped_disk;
+	struct ext2_super_block *sb = get_super(disk);
+	int i;
+	char *path = crc_path;
+	if (path == NULL) {
+		return;
+	}
+	crc_path = NULL; // Nothing more to track, get_inode is used below
+	if (crc_inode_count > CRC_MAX_TOUCHED || crc_block_count > CRC_MAX_TOUCHED) {
+		rebuild_checksums(disk, path);
+		crc_path = path;
+		release_deferred_locks();
+		return;
+	}
+	double start = trace_begin();
+	int fd = open(path, O_WRONLY);
+	if (fd == -1) {
+		crc_path = path;
+		release_deferred_locks();
+		return;
+	}
+	lock_sidecar(fd);
+	unsigned int b, groups = get_group_count(disk);
+	unsigned int desc_blocks = (groups * sizeof(struct ext2_group_desc) + get_block_size(disk) - 1) /
+		get_block_size(disk);
+	for (b = 0; b <= desc_blocks; b++) { // The counters always change
+		crc_write(sb->s_first_data_block + b, CRC_SUPER, 0, &fd);
+	}
+	for (i = 0; i < crc_block_count; i++) {
+		crc_write(crc_blocks[i], CRC_BITMAP, 0, &fd);
+	}
+	for (i = 0; i < crc_inode_count; i++) {
+		unsigned int index = crc_inodes[i];
+		struct ext2_group_desc *gd = get_group_desc(disk, index / sb->s_inodes_per_group);
+		unsigned int slot = index % sb->s_inodes_per_group;
+		crc_write(gd->bg_inode_table + slot * sb->s_inode_size / get_block_size(disk), CRC_TABLE, 0, &fd);
+		struct ext2_inode *ip = get_inode(disk, index);
+		if (inode_in_use(disk, index) && get_inode_type(ip) == 'd') {
+			for_each_dir_block(disk, ip, crc_write, index, &fd);
+		}
+	}
+	close(fd);
+	trace_end("checksum update", start);
+	crc_path = path;
+	release_deferred_locks();
+}
+
+/* Brings the sidecar up to date for the last time, on exit. */
+void update_checksums() {
+	sync_checksums();
+	free(crc_path);
+	crc_path = NULL;
+}
+
+/* Keeps the checksum sidecar of the image named name, mapped as disk, up to
+ * date from here on, if it has one. Called by the tools that write.
+ */
+void track_checksums(unsigned char *disk, char *name) {
+	char *path = crc_sidecar(name);
+	if (access(path, F_OK) == -1) {
+		free(path);
+		return;
+	}
+	crc_path = path;
+	at_tool_exit(update_checksums);
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Takes the name of a tool, then that tool's own arguments:
+ * e.g. ext2c cp disk.img file /dir, or ext2c stat disk.img /dir/file.
+ *
+ * -s: path of ext2d's socket (default $EXT2D_SOCKET, then disk.sock).
+ *
+ * The program is a thin client for ext2d. It sends the request over the
+ * daemon's socket and relays back its output and exit status, so it can be
+ * used wherever the tool itself is. Installed under a tool's name, e.g.
+ * ln -s ext2c ext2_cp, it takes exactly that tool's arguments, so scripts
+ * can switch to the daemon without changes.
+ */
+
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<errno.h>
+#include "ext2d.h"
+
+/* HELPERS */
+
+void usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-s socket] [mkdir|cp|ln|rm|restore|checker|stat|read] [args]\n", prog);
+	exit(1);
+}
+
+/* Returns the disk image in a tool's arguments, the first one that is not an
+ * option such as --stats or ln's -s, NULL if there is none.
+ */
+char *find_disk(int argc, char **argv) {
+	int i;
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--trace") == 0) {
+			i++;
+		} else if (argv[i][0] != '-') {
+			return argv[i];
+		}
+	}
+	return NULL;
+}
+
+/* MAIN */
+int main(int argc, char **argv) {
+	char *prog = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+	char *socket_path = getenv("EXT2D_SOCKET");
+	char default_socket[4096];
+	int op = ext2d_op(prog);
+	int i = 1;
+	if (op == 0) { // Run as ext2c, the tool is named in the arguments
+		if (i + 1 < argc && strcmp(argv[i], "-s") == 0) {
+			socket_path = argv[i + 1];
+			i += 2;
+		}
+		if (i >= argc || (op = ext2d_op(argv[i])) == 0) {
+			usage(prog);
+		}
+		i++;
+	}
+	argc -= i;
+	argv += i;
+	if (argc > EXT2D_MAX_ARGS) {
+		fprintf(stderr, "Too many arguments.\n");
+		exit(1);
+	}
+	if (socket_path == NULL) {
+		char *disk = find_disk(argc, argv);
+		if (disk == NULL) {
+			usage(prog);
+		}
+		socket_path = ext2d_socket_path(disk, default_socket, sizeof(default_socket));
+	}
+
+	// Payload: working directory, then the arguments, all NUL terminated
+	char *payload = malloc(EXT2D_MAX_PAYLOAD);
+	if (getcwd(payload, EXT2D_MAX_PAYLOAD) == NULL) {
+		perror("getcwd");
+		exit(1);
+	}
+	size_t len = strlen(payload) + 1;
+	for (i = 0; i < argc; i++) {
+		size_t n = strlen(argv[i]) + 1;
+		if (len + n > EXT2D_MAX_PAYLOAD) {
+			fprintf(stderr, "Arguments too long.\n");
+			exit(1);
+		}
+		memcpy(payload + len, argv[i], n);
+		len += n;
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	size_t path_len = strlen(socket_path);
+	if (path_len >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long: %s\n", prog, socket_path);
+		exit(1);
+	}
+	memcpy(addr.sun_path, socket_path, path_len + 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "%s: cannot reach ext2d on %s: %s\n", prog, socket_path, strerror(errno));
+		exit(1);
+	}
+	struct ext2d_request req = {EXT2D_MAGIC, op, argc, len};
+	if (ext2d_write_all(fd, &req, sizeof(req)) == -1 || ext2d_write_all(fd, payload, len) == -1) {
+		perror(socket_path);
+		exit(1);
+	}
+
+	// Relay frames until the exit status arrives
+	struct ext2d_frame frame;
+	char buf[4096];
+	while (ext2d_read_all(fd, &frame, sizeof(frame)) == 0) {
+		if (frame.type == EXT2D_FRAME_EXIT) {
+			int32_t code;
+			if (frame.len != sizeof(code) || ext2d_read_all(fd, &code, sizeof(code)) == -1) {
+				break;
+			}
+			close(fd);
+			return code;
+		}
+		int out = frame.type == EXT2D_FRAME_STDOUT ? STDOUT_FILENO : STDERR_FILENO;
+		while (frame.len > 0) {
+			uint32_t n = frame.len < sizeof(buf) ? frame.len : sizeof(buf);
+			if (ext2d_read_all(fd, buf, n) == -1) {
+				break;
+			}
+			ext2d_write_all(out, buf, n);
+			frame.len -= n;
+		}
+	}
+	fprintf(stderr, "%s: lost connection to ext2d\n", prog);
+	exit(1);
+}
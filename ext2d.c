@@ -0,0 +1,547 @@
+/*
+ * Takes one argument, plus options:
+ * First: the name of an ext2 formatted disk.
+ *
+ * -s: path of the Unix socket to listen on (default disk.sock).
+ * --io and --cache-size as for the tools, to serve the image through the
+ * block cache.
+ *
+ * The program is a long-running server for the ext2_* tools. It opens the
+ * image once and serves mkdir, cp, ln, rm, restore, checker, stat and read
+ * requests from ext2c over a Unix socket (see ext2d.h for the protocol).
+ * Every tool is built into the daemon and runs in the daemon itself, so the
+ * mapping or block cache and the inode summary carry over from one request
+ * to the next, with no exec, open or mmap per operation. So do the
+ * allocator's windows, from one request on a connection to the next, until
+ * the connection closes.
+ *
+ * Each client gets a thread of its own, and any number of clients can be
+ * connected at once. Their requests are queued for a single thread that runs
+ * them one at a time, so operations never interleave on the image. A
+ * request's stdout and stderr are captured and sent back to its client with
+ * its exit status once it is done; a tool that exits ends just the request.
+ *
+ * The daemon owns the image while it runs: it holds a lock on all of it,
+ * which its requests' locks fall inside, so the standalone tools wait until
+ * the daemon has stopped. Requests naming any other image are refused.
+ */
+
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<signal.h>
+#include<setjmp.h>
+#include<pthread.h>
+#include "ext2.h"
+#include<errno.h>
+
+/*
+ * The tools exit when they are done or something is wrong. In the daemon an
+ * exit during a request only ends the request: it jumps back to where the
+ * request was started, with the exit status.
+ */
+__thread jmp_buf *tool_jump;  // Where to go on exit, NULL outside a request
+__thread int tool_status;
+
+__attribute__((noreturn)) void tool_exit(int code) {
+	if (tool_jump != NULL) {
+		tool_status = code;
+		longjmp(*tool_jump, 1);
+	}
+	(exit)(code);
+}
+
+#define exit(code) tool_exit(code)
+
+#include "ext2_utils.c"
+#include "ext2d.h"
+
+/*
+ * The tools, each with its main renamed so they can share this program.
+ * Helpers that more than one tool defines are renamed as well.
+ */
+#define main ext2_mkdir_main
+#include "ext2_mkdir.c"
+#undef main
+
+#define main ext2_cp_main
+#define check_path cp_check_path
+#include "ext2_cp.c"
+#undef check_path
+#undef main
+
+#define main ext2_ln_main
+#define check_path ln_check_path
+#define get_last_file_name ln_get_last_file_name
+#include "ext2_ln.c"
+#undef get_last_file_name
+#undef check_path
+#undef main
+
+#define main ext2_rm_main
+#include "ext2_rm.c"
+#undef main
+
+#define main ext2_restore_main
+#define get_last_file_name restore_get_last_file_name
+#include "ext2_restore.c"
+#undef get_last_file_name
+#undef main
+
+#define main ext2_checker_main
+#include "ext2_checker.c"
+#undef main
+
+char *socket_path;
+volatile sig_atomic_t stopping = 0;
+FILE *daemon_log;       // The daemon's own messages, stderr is the request's
+int saved_out, saved_err, home_fd;
+
+/* A request, queued by a client's thread for the executor. */
+struct job {
+	int op;
+	char *cwd;
+	int argc;
+	char **args;
+	int out, err;       // Files the request's stdout and stderr go to
+	struct prealloc_window *windows;  // The connection's, see PREALLOCATION
+	int32_t status;
+	int done;
+	struct job *next;
+};
+
+struct job *queue_head, *queue_tail;
+int executor_done = 0;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_queued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t job_finished = PTHREAD_COND_INITIALIZER;
+
+/* HELPERS */
+
+/* Opens and maps the disk named by argv[1] and returns the inode index behind
+ * the path in argv[2], exiting if either does not exist.
+ */
+int open_target(int argc, char **argv) {
+	parse_common_flags(&argc, argv);
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s [--stats] [--trace file] [disk] [path]\n", argv[0]);
+		exit(1);
+	}
+	disk = map_disk(hold_fd(open(argv[1], O_RDWR)));
+	int index = lookup_path(disk, argv[2]);
+	if (index == -1) {
+		fprintf(stderr, "File does not exist.\n");
+		exit(ENOENT);
+	}
+	return index;
+}
+
+/* Prints the inode behind a path in the same format as readimage. */
+int ext2_stat_main(int argc, char **argv) {
+	int index = open_target(argc, argv);
+	struct ext2_inode *ip = get_inode(disk, index);
+	int i;
+	printf("[%d] type: %c size: %d links: %d blocks: %d\n", index + 1,
+			get_inode_type(ip), ip->i_size, ip->i_links_count, ip->i_blocks);
+	if (is_fast_symlink(ip)) {
+		printf("[%d] Target: %.*s\n", index + 1, ip->i_size, (char *)ip->i_block);
+	} else {
+		printf("[%d] Blocks:", index + 1);
+		for (i = 0; i < 15 && ip->i_block[i] != 0; i++) {
+			printf(" %d", ip->i_block[i]);
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+/* Writes the contents of the file behind a path to stdout. Symlinks are not
+ * followed, their target is written instead. Holes read as zeroes.
+ */
+int ext2_read_main(int argc, char **argv) {
+	int index = open_target(argc, argv);
+	struct ext2_inode *ip = get_inode(disk, index);
+	unsigned int bs = get_block_size(disk);
+	unsigned int left = ip->i_size, n, i;
+	if (get_inode_type(ip) == 'd') {
+		fprintf(stderr, "Cannot read directories.\n");
+		exit(EISDIR);
+	}
+	if (is_fast_symlink(ip)) {
+		fwrite(ip->i_block, 1, left, stdout);
+		return 0;
+	}
+	unsigned char *zeroes = calloc(1, bs);
+	for (i = 0; left > 0; i++) {
+		unsigned int block = file_block(disk, ip, i);
+		n = left < bs ? left : bs;
+		fwrite(block != 0 ? get_block(disk, block) : zeroes, 1, n, stdout);
+		left -= n;
+		if (i % 64 == 63) {
+			release_blocks();
+		}
+	}
+	free(zeroes);
+	return 0;
+}
+
+/* Runs the tool for op with args, the way its own program would be run. */
+int run_tool(int op, int argc, char **args) {
+	static char name[32];
+	char *argv[EXT2D_MAX_ARGS + 2];
+	int i;
+	snprintf(name, sizeof(name), "ext2_%s", ext2d_op_names[op]);
+	argv[0] = name;
+	for (i = 0; i < argc; i++) {
+		argv[i + 1] = args[i];
+	}
+	argv[argc + 1] = NULL;
+	optind = 0; // Has getopt start over
+	switch (op) {
+		case EXT2D_OP_MKDIR:   return ext2_mkdir_main(argc + 1, argv);
+		case EXT2D_OP_CP:      return ext2_cp_main(argc + 1, argv);
+		case EXT2D_OP_LN:      return ext2_ln_main(argc + 1, argv);
+		case EXT2D_OP_RM:      return ext2_rm_main(argc + 1, argv);
+		case EXT2D_OP_RESTORE: return ext2_restore_main(argc + 1, argv);
+		case EXT2D_OP_CHECKER: return ext2_checker_main(argc + 1, argv);
+		case EXT2D_OP_STAT:    return ext2_stat_main(argc + 1, argv);
+		case EXT2D_OP_READ:    return ext2_read_main(argc + 1, argv);
+	}
+	return 1;
+}
+
+/* Takes the lock on the whole image that the daemon holds while it runs. It
+ * is an open file description lock, so it stays put when a request closes
+ * its own fd on the image, and it is entered in the lock table so that
+ * requests' locks fall inside it and leave the kernel alone.
+ */
+void own_image(int fd) {
+	struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+	if (fcntl(fd, F_OFD_SETLK, &fl) == -1) {
+		fprintf(stderr, "ext2d: the image is in use: %s\n", strerror(errno));
+		exit(1);
+	}
+	memset(held_locks, 0, sizeof(held_locks));
+	held_locks[0].exclusive = 1;
+	held_locks[0].depth = 1;
+	threaded_writes = 0;
+	deferred_count = 0;
+}
+
+/* Drops what the last request's tool left behind in its globals. */
+void reset_tools(int image_fd) {
+	int i;
+	for (i = 0; i < dir_count; i++) {
+		free(dirs[i].name);
+		free(dirs[i].data); // Left over if the run ended early
+	}
+	dir_count = 0;
+	free(dir_table);
+	dir_table = NULL;
+	table_size = 0;
+	errors = 0;
+	use_prealloc_session(NULL); // The executor keeps no windows of its own
+	release_all_prealloc();
+	mapped_fd = image_fd;
+	own_image(image_fd);
+}
+
+/* Runs a job with its output captured and the client's working directory,
+ * then ends it as a tool's exit would have.
+ */
+void run_job(struct job *job, int image_fd) {
+	jmp_buf jump;
+	fflush(stdout);
+	fflush(stderr);
+	dup2(job->out, STDOUT_FILENO);
+	dup2(job->err, STDERR_FILENO);
+	tool_jump = &jump;
+	use_prealloc_session(job->windows);
+	if (chdir(job->cwd) == -1) {
+		perror(job->cwd);
+		job->status = ENOENT;
+	} else if (setjmp(jump) == 0) {
+		job->status = run_tool(job->op, job->argc, job->args);
+	} else {
+		job->status = tool_status;
+	}
+	// A hook that exits comes back here, and the rest still run
+	if (setjmp(jump) != 0 && job->status == 0) {
+		job->status = tool_status;
+	}
+	finish_run();
+	tool_jump = NULL;
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved_out, STDOUT_FILENO);
+	dup2(saved_err, STDERR_FILENO);
+	if (fchdir(home_fd) == -1) {
+		perror("fchdir");
+	}
+	reset_tools(image_fd);
+}
+
+/* Runs queued jobs one at a time until the daemon stops and the queue is
+ * empty.
+ */
+void *executor(void *arg) {
+	int image_fd = *(int *)arg;
+	pthread_mutex_lock(&queue_lock);
+	while (1) {
+		while (queue_head == NULL && !stopping) {
+			pthread_cond_wait(&job_queued, &queue_lock);
+		}
+		struct job *job = queue_head;
+		if (job == NULL) {
+			break;
+		}
+		queue_head = job->next;
+		if (queue_head == NULL) {
+			queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&queue_lock);
+		run_job(job, image_fd);
+		pthread_mutex_lock(&queue_lock);
+		job->done = 1;
+		pthread_cond_broadcast(&job_finished);
+	}
+	executor_done = 1;
+	pthread_cond_broadcast(&job_finished);
+	pthread_mutex_unlock(&queue_lock);
+	return NULL;
+}
+
+/* Queues job and waits for it. Returns -1 if the daemon is stopping. */
+int submit_job(struct job *job) {
+	pthread_mutex_lock(&queue_lock);
+	if (stopping || executor_done) {
+		pthread_mutex_unlock(&queue_lock);
+		return -1;
+	}
+	job->done = 0;
+	job->next = NULL;
+	if (queue_tail != NULL) {
+		queue_tail->next = job;
+	} else {
+		queue_head = job;
+	}
+	queue_tail = job;
+	pthread_cond_signal(&job_queued);
+	while (!job->done) {
+		pthread_cond_wait(&job_finished, &queue_lock);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+/* Sends one response frame to the client. */
+int send_frame(int cfd, uint32_t type, const void *buf, uint32_t len) {
+	struct ext2d_frame frame = {type, len};
+	if (ext2d_write_all(cfd, &frame, sizeof(frame)) == -1) {
+		return -1;
+	}
+	return ext2d_write_all(cfd, buf, len);
+}
+
+/* Sends what was written to the file fd to the client as frames of type. */
+int send_output(int cfd, int fd, uint32_t type) {
+	char buf[4096];
+	ssize_t n;
+	off_t offset = 0;
+	while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+		if (send_frame(cfd, type, buf, n) == -1) {
+			return -1;
+		}
+		offset += n;
+	}
+	return 0;
+}
+
+/* Runs one request with the client's working directory and the connection's
+ * preallocation windows, then sends its output and exit status to the client.
+ * Returns 0 if the client is still there, -1 otherwise.
+ */
+int serve_request(int cfd, struct prealloc_window *windows, int op, char *cwd, int argc, char **args) {
+	struct job job = {op, cwd, argc, args};
+	job.windows = windows;
+	job.out = memfd_create("ext2d-stdout", 0);
+	job.err = memfd_create("ext2d-stderr", 0);
+	if (job.out == -1 || job.err == -1) {
+		fprintf(daemon_log, "ext2d: memfd_create: %s\n", strerror(errno));
+		if (job.out != -1) close(job.out);
+		return -1;
+	}
+	int ok = submit_job(&job) == 0 &&
+			send_output(cfd, job.out, EXT2D_FRAME_STDOUT) == 0 &&
+			send_output(cfd, job.err, EXT2D_FRAME_STDERR) == 0 &&
+			send_frame(cfd, EXT2D_FRAME_EXIT, &job.status, sizeof(job.status)) == 0;
+	close(job.out);
+	close(job.err);
+	return ok ? 0 : -1;
+}
+
+/* Serves requests from one client until it hangs up or sends garbage. */
+void *serve_client(void *arg) {
+	int cfd = (int)(long)arg;
+	struct ext2d_request req;
+	char *payload = malloc(EXT2D_MAX_PAYLOAD + 1);
+	char *args[EXT2D_MAX_ARGS];
+	// The connection's preallocation windows, released when it closes
+	struct prealloc_window *windows = calloc(PREALLOC_MAX_WINDOWS, sizeof(struct prealloc_window));
+	while (!stopping && ext2d_read_all(cfd, &req, sizeof(req)) == 0) {
+		if (req.magic != EXT2D_MAGIC || req.op == 0 || req.op >= EXT2D_OP_MAX ||
+				req.argc > EXT2D_MAX_ARGS || req.payload_len > EXT2D_MAX_PAYLOAD ||
+				ext2d_read_all(cfd, payload, req.payload_len) == -1) {
+			fprintf(daemon_log, "ext2d: bad request, dropping client\n");
+			break;
+		}
+		// Split the payload into the working directory and the arguments
+		payload[req.payload_len] = '\0';
+		char *p = payload, *end = payload + req.payload_len;
+		char *cwd = p;
+		int i;
+		p += strlen(p) + 1;
+		for (i = 0; i < req.argc && p < end; i++) {
+			args[i] = p;
+			p += strlen(p) + 1;
+		}
+		if (i != req.argc) {
+			fprintf(daemon_log, "ext2d: bad request, dropping client\n");
+			break;
+		}
+		if (serve_request(cfd, windows, req.op, cwd, req.argc, args) == -1) {
+			break;
+		}
+	}
+	free(windows);
+	free(payload);
+	close(cfd);
+	return NULL;
+}
+
+/* Starts a detached thread running fn, with INT and TERM left to main. */
+int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg) {
+	sigset_t block, old;
+	pthread_attr_t attr;
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	pthread_attr_init(&attr);
+	if (thread == NULL) {
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	}
+	pthread_t detached;
+	int err = pthread_create(thread != NULL ? thread : &detached, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return err;
+}
+
+void stop(int sig) {
+	stopping = 1;
+}
+
+/* MAIN */
+int main(int argc, char **argv) {
+	char default_socket[4096];
+	int opt;
+	parse_common_flags(&argc, argv);
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+			case 's':
+				socket_path = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-s socket] [--io mmap|pread] [--cache-size MiB] [disk]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-s socket] [--io mmap|pread] [--cache-size MiB] [disk]\n", argv[0]);
+		exit(1);
+	}
+	if (socket_path == NULL) {
+		socket_path = ext2d_socket_path(argv[optind], default_socket, sizeof(default_socket));
+	}
+	// Open the disk once and pull it into the page cache, every request reuses it
+	int image_fd = open(argv[optind], O_RDWR);
+	if (image_fd == -1) {
+		perror(argv[optind]);
+		exit(ENOENT);
+	}
+	own_image(image_fd);
+	disk = map_disk(image_fd);
+	if (mapped_size != 0) {
+		madvise(disk, mapped_size, MADV_WILLNEED);
+	}
+	image_pinned = 1; // Requests naming another image are refused
+	// Requests write to stdout and stderr, the daemon keeps its own copies
+	saved_out = dup(STDOUT_FILENO);
+	saved_err = dup(STDERR_FILENO);
+	home_fd = open(".", O_RDONLY | O_DIRECTORY);
+	daemon_log = fdopen(dup(STDERR_FILENO), "w");
+	setvbuf(daemon_log, NULL, _IOLBF, 0);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long.\n");
+		exit(1);
+	}
+	strcpy(addr.sun_path, socket_path);
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socket_path);
+	if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lfd, 16) == -1) {
+		perror(socket_path);
+		exit(1);
+	}
+
+	// Stop cleanly on INT and TERM, accept() is interrupted so the loop notices
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_t executor_thread;
+	if (start_thread(&executor_thread, executor, &image_fd) != 0) {
+		fprintf(stderr, "ext2d: cannot start the executor.\n");
+		exit(1);
+	}
+	fprintf(daemon_log, "ext2d: serving %s on %s\n", argv[optind], socket_path);
+	while (!stopping) {
+		int cfd = accept(lfd, NULL, NULL);
+		if (cfd == -1) {
+			if (errno != EINTR) perror("accept");
+			continue;
+		}
+		if (start_thread(NULL, serve_client, (void *)(long)cfd) != 0) {
+			fprintf(daemon_log, "ext2d: cannot start a thread for a client.\n");
+			close(cfd);
+		}
+	}
+
+	// Let the running and queued requests finish, then write everything back
+	close(lfd);
+	unlink(socket_path);
+	pthread_mutex_lock(&queue_lock);
+	pthread_cond_signal(&job_queued);
+	pthread_mutex_unlock(&queue_lock);
+	pthread_join(executor_thread, NULL);
+	flush_caches();
+	if (mapped_size != 0) {
+		msync(disk, mapped_size, MS_SYNC);
+	}
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Wire protocol between ext2d and its client, ext2c.
+ *
+ * A client sends one request per operation and reads back response frames
+ * until it gets an EXT2D_FRAME_EXIT frame, then it may send the next request
+ * on the same connection. Everything is in host byte order, both ends are
+ * always on the same machine.
+ */
+
+#ifndef EXT2D_H
+#define EXT2D_H
+
+#include<stdint.h>
+
+#define EXT2D_MAGIC 0x45324431  /* "E2D1" */
+#define EXT2D_MAX_ARGS 64
+#define EXT2D_MAX_PAYLOAD 65536
+
+/* Operations, one per tool plus the daemon only ones. */
+#define EXT2D_OP_MKDIR   1
+#define EXT2D_OP_CP      2
+#define EXT2D_OP_LN      3
+#define EXT2D_OP_RM      4
+#define EXT2D_OP_RESTORE 5
+#define EXT2D_OP_CHECKER 6
+#define EXT2D_OP_STAT    7  /* stat disk path: print the inode behind path */
+#define EXT2D_OP_READ    8  /* read disk path: write the file's contents to stdout */
+#define EXT2D_OP_MAX     9
+
+/*
+ * Request header, followed by payload_len bytes: the client's working
+ * directory, then argc arguments, each NUL terminated. The arguments are the
+ * ones the tool itself takes, disk image first, so argv[0] is not sent.
+ */
+struct ext2d_request {
+	uint32_t magic;
+	uint16_t op;
+	uint16_t argc;
+	uint32_t payload_len;
+};
+
+/* Response frame types */
+#define EXT2D_FRAME_STDOUT 1  /* Payload is output for stdout */
+#define EXT2D_FRAME_STDERR 2  /* Payload is output for stderr */
+#define EXT2D_FRAME_EXIT   3  /* Payload is the int32_t exit status, last frame */
+
+/* Response frame header, followed by len bytes of payload. */
+struct ext2d_frame {
+	uint32_t type;
+	uint32_t len;
+};
+
+/* Tool names, indexed by operation. */
+static const char *ext2d_op_names[EXT2D_OP_MAX] = {
+	NULL, "mkdir", "cp", "ln", "rm", "restore", "checker", "stat", "read"
+};
+
+/* Returns the operation for a tool name, "cp" or "ext2_cp", 0 if unknown. */
+static inline int ext2d_op(const char *name) {
+	int op;
+	if (strncmp(name, "ext2_", 5) == 0) {
+		name += 5;
+	}
+	for (op = 1; op < EXT2D_OP_MAX; op++) {
+		if (strcmp(name, ext2d_op_names[op]) == 0) {
+			return op;
+		}
+	}
+	return 0;
+}
+
+/* Writes all len bytes of buf to fd. Returns 0 on success, -1 on error. */
+static inline int ext2d_write_all(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Reads exactly len bytes from fd into buf. Returns 0 on success, -1 on error
+ * or end of file.
+ */
+static inline int ext2d_read_all(int fd, void *buf, size_t len) {
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Returns the default socket path for disk, "disk.sock", in buf. */
+static inline char *ext2d_socket_path(const char *disk, char *buf, size_t size) {
+	snprintf(buf, size, "%s.sock", disk);
+	return buf;
+}
+
+#endif
@@ -1,150 +1,441 @@
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include "ext2.h"
-
-unsigned char *disk;
-
-unsigned char get_inode_type(struct ext2_inode *ip) {
-	if (S_ISREG(ip->i_mode)) {
-		return 'f';
-	} else if (S_ISDIR(ip->i_mode)) {
-		return 'd';
-	} else if (S_ISLNK(ip->i_mode)) {
-		return 'l';
-	} else {
-		return '?';
-	}
-}
-
-unsigned char get_dir_type(unsigned char file_type) {
-	if (file_type == EXT2_FT_REG_FILE) {
-		return 'f';
-	} else if (file_type == EXT2_FT_DIR) {
-		return 'd';
-	} else if (file_type == EXT2_FT_SYMLINK) {
-		return 'l';
-	} else {
-		return '?';
-	}
-}
-
-int check_inode(int index, unsigned char *imap) {
-	return (imap[index/8] >> (index % 8)) & 0x1;
-}
-
-int main(int argc, char **argv) {
-
-    if(argc != 2) {
-        fprintf(stderr, "Usage: %s <image file name>\n", argv[0]);
-        exit(1);
-    }
-    int fd = open(argv[1], O_RDWR);
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    struct ext2_super_block *sb = (struct ext2_super_block *)(disk + 1024);
-	struct ext2_group_desc *desc = (struct ext2_group_desc *)(disk + 2*1024); 
-    printf("Inodes: %d\n", sb->s_inodes_count);
-    printf("Blocks: %d\n", sb->s_blocks_count);
-	printf("Block group:\n");
-	printf("    block bitmap: %d\n", desc->bg_block_bitmap);
-	printf("    inode bitmap: %d\n", desc->bg_inode_bitmap);
-	printf("    inode table: %d\n", desc->bg_inode_table);
-	printf("    free blocks: %d\n", sb->s_free_blocks_count); //should it be desc->free blocks count??????
-	printf("    free inodes: %d\n", sb->s_free_inodes_count);
-	printf("    used_dirs: %d\n", desc->bg_used_dirs_count);
-  
-	// Printing block bitmap byte by byte 
-    printf("Block bitmap: ");
-	unsigned char *map = (unsigned char*)(disk + EXT2_BLOCK_SIZE * desc->bg_block_bitmap);
-	int i;
-	for (i = 0; i < sb->s_blocks_count; i++) {
-		if (i != 0 && i % 8 == 0) {
-			printf(" ");
-		}
-		printf("%d", (map[i/8] >> (i % 8)) & 0x1);
-	}
-	printf("\n");
-
-	// Printing inode bitmap byte by byte
-	printf("Inode bitmap: ");
-	unsigned char *imap = (unsigned char *)(disk + 1024 * desc->bg_inode_bitmap);
-	for (i = 0; i < sb->s_inodes_count; i++) {
-		if (i != 0 && i%8 == 0) {
-			printf(" ");
-		}
-		printf("%d", (imap[i/8] >> (i%8)) & 0x1);
-	}
-	printf("\n");
-
-	// Printing important inodes (2, >11)
-	printf("\nInodes:\n");
-	struct ext2_inode *curinode;
-	unsigned char inode_type;
-	int node;
-	for (node = 0; node < 32; node++) {
-		//printf("%d", check_inode(node, imap));
-		if (check_inode(node, imap) && (node == 1 || node >= 11)) {
-			curinode = (struct ext2_inode *)((disk + 1024 * desc->bg_inode_table) + (sb->s_inode_size * (node)));
-			inode_type = get_inode_type(curinode);
-			printf("[%d] type: %c size: %d links: %d blocks: %d\n[%d] Blocks:",
-				node+1, inode_type, curinode->i_size, curinode->i_links_count, curinode->i_blocks, node+1);
-			for (i = 0; curinode->i_block[i] != 0; i++) {
-				printf(" %d", curinode->i_block[i]);
-			}
-			printf("\n");
-		}
-	}
-
-	// Printing directory blocks
-	printf("\nDirectory Blocks:\n"); 
-	// Loop through valid inodes again to find directory blocks
-	for (node = 0; node < 32; node++) {
-		if (check_inode(node, imap) && (node == 1 || node >= 11)) {
-			curinode = (struct ext2_inode *)((disk + 1024 * desc->bg_inode_table) + (sb->s_inode_size * node));
-			if (get_inode_type(curinode) == 'd') {
-				// Printing the DIR BLOCK NUM line.
-				printf("   DIR BLOCK NUM: ");
-				for (i = 0; curinode->i_block[i] != 0; i++) {
-					printf("%d ", curinode->i_block[i]);				
-				}
-				printf("(for inode %d)\n", node+1);
-
-				// Looping through the data blocks to find and print the ext2_dir_entry details
-				unsigned int cur_rec_len;
-				unsigned char file_type;
-				char filename[256];
-				struct ext2_dir_entry *cur_dir;
-				for (i = 0; curinode->i_block[i] != 0; i++) {
-					// Currently results in some strange infinite loop, reading wrong block????
-					for (cur_rec_len = 0; cur_rec_len < 1024; ) {
-						// Reset filename to null-terminators
-						memset(filename, '\0', sizeof(filename));
-						// Grabbing the directory, setting necessary variables for readability
-						cur_dir = (struct ext2_dir_entry *)(disk + (1024 * curinode->i_block[i]) + cur_rec_len);
-						strncpy(filename, cur_dir->name, cur_dir->name_len);
-						file_type = get_dir_type(cur_dir->file_type);
-						// Increasing cur_rec_len for next directory
-						cur_rec_len += cur_dir->rec_len;
-						// Doing the actual print
-						printf("Inode: %d rec_len: %d name_len: %d type= %c name=%s\n",
-								cur_dir->inode, cur_dir->rec_len, cur_dir->name_len, file_type, filename);
-					}
-				}
-			}
-		}
-	}
-    return 0;
-}
-
-
+/*
+ * Takes one argument, plus options:
+ * First: the name of an ext2 formatted disk.
+ *
+ * --super:       the superblock and group descriptors.
+ * --bitmaps:     the block and inode bitmaps.
+ * --dirs:        the entries of every directory.
+ * --inode N:     inode number N, and its entries if it is a directory.
+ * --path P:      the inode at absolute path P, the same way.
+ * --format F:    text (default), json or binary.
+ * Without any of the first five, everything is dumped: every section, and
+ * every inode in use.
+ *
+ * The program dumps the image's metadata, covering every group and the
+ * whole inode table. Output is built in a large buffer and written out a
+ * megabyte at a time.
+ *
+ * The binary format is a stream of records, each a one byte type and a
+ * four byte length, then that many bytes, all little-endian:
+ *   'S' the superblock, as on disk.
+ *   'G' a group descriptor, as on disk, in group order.
+ *   'b' a group's block bitmap: the four byte group number, then the bitmap.
+ *   'i' a group's inode bitmap, the same way.
+ *   'I' an inode: the four byte inode number, then the inode as on disk.
+ *   'D' a directory entry: the four byte number of its directory, then the
+ *       entry as on disk, up to the end of its name.
+ */
+
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<stdarg.h>
+#include<getopt.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include "ext2.h"
+#include<errno.h>
+#include "ext2_utils.c"
+
+#define FORMAT_TEXT   0
+#define FORMAT_JSON   1
+#define FORMAT_BINARY 2
+
+#define OUT_BUF_SIZE (1 << 20)
+
+unsigned char *disk;
+struct ext2_super_block *sb;
+unsigned int bs;
+int format = FORMAT_TEXT;
+
+char *out_buf;
+size_t out_len = 0;
+
+/* OUTPUT */
+
+/* Writes out everything buffered so far. */
+void out_flush() {
+	if (write_all(STDOUT_FILENO, out_buf, out_len) == -1) {
+		perror("write");
+		exit(1);
+	}
+	out_len = 0;
+}
+
+/* Makes room for n more bytes in the buffer. */
+void out_reserve(size_t n) {
+	if (out_len + n > OUT_BUF_SIZE) {
+		out_flush();
+	}
+}
+
+/* Appends formatted text, which must be short (a line or so). */
+void out_printf(const char *fmt, ...) {
+	va_list ap;
+	out_reserve(1024);
+	va_start(ap, fmt);
+	out_len += vsnprintf(out_buf + out_len, OUT_BUF_SIZE - out_len, fmt, ap);
+	va_end(ap);
+}
+
+/* Appends n raw bytes. */
+void out_bytes(const void *buf, size_t n) {
+	if (n > OUT_BUF_SIZE) {
+		out_flush();
+		write_all(STDOUT_FILENO, buf, n);
+		return;
+	}
+	out_reserve(n);
+	memcpy(out_buf + out_len, buf, n);
+	out_len += n;
+}
+
+/* Appends a binary record header of type for len bytes, plus a leading
+ * four byte number if with_number is set.
+ */
+void out_record(char type, unsigned int len, int with_number, unsigned int number) {
+	unsigned char header[9];
+	header[0] = type;
+	len += with_number ? 4 : 0;
+	memcpy(header + 1, &len, 4);
+	memcpy(header + 5, &number, 4);
+	out_bytes(header, with_number ? 9 : 5);
+}
+
+/* Appends name, len bytes long, as a JSON string. */
+void out_json_string(const char *name, int len) {
+	int i;
+	out_reserve(len * 6 + 2);
+	out_buf[out_len++] = '"';
+	for (i = 0; i < len; i++) {
+		unsigned char c = name[i];
+		if (c == '"' || c == '\\') {
+			out_buf[out_len++] = '\\';
+			out_buf[out_len++] = c;
+		} else if (c < 0x20) {
+			out_len += sprintf(out_buf + out_len, "\\u%04x", c);
+		} else {
+			out_buf[out_len++] = c;
+		}
+	}
+	out_buf[out_len++] = '"';
+}
+
+/* Appends count bits of map as text, a space between every byte's worth. */
+void out_bits(unsigned char *map, unsigned int count, unsigned int *written) {
+	unsigned int i;
+	for (i = 0; i < count; i++, (*written)++) {
+		out_reserve(2);
+		if (*written != 0 && *written % 8 == 0 && format == FORMAT_TEXT) {
+			out_buf[out_len++] = ' ';
+		}
+		out_buf[out_len++] = '0' + ((map[i / 8] >> (i % 8)) & 0x1);
+	}
+}
+
+/* HELPERS */
+
+/* Returns the number of blocks in group g. */
+unsigned int group_blocks(unsigned int g) {
+	unsigned int n = sb->s_blocks_count - sb->s_first_data_block - g * sb->s_blocks_per_group;
+	return n < sb->s_blocks_per_group ? n : sb->s_blocks_per_group;
+}
+
+/* Returns 1 if the inode at index is one to show in a full dump: the root or
+ * any non-reserved inode in use.
+ */
+int worth_dumping(unsigned int index) {
+	unsigned int first = sb->s_rev_level == 0 ? EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+	return (index == EXT2_ROOT_INO - 1 || index >= first - 1) && inode_in_use(disk, index);
+}
+
+/* Calls dump for every inode worth dumping, skipping bitmap bytes with
+ * nothing in use.
+ */
+void for_each_inode(void (*dump)(unsigned int, int *), int *first) {
+	unsigned int g, groups = get_group_count(disk), bit;
+	for (g = 0; g < groups; g++) {
+		unsigned char *imap = get_block(disk, get_group_desc(disk, g)->bg_inode_bitmap);
+		for (bit = 0; bit < sb->s_inodes_per_group; bit++) {
+			if (bit % 8 == 0 && imap[bit / 8] == 0) {
+				bit += 7;
+				continue;
+			}
+			if (worth_dumping(g * sb->s_inodes_per_group + bit)) {
+				dump(g * sb->s_inodes_per_group + bit, first);
+				// Let the block cache go of what we used, imap included
+				release_blocks();
+				imap = get_block(disk, get_group_desc(disk, g)->bg_inode_bitmap);
+			}
+		}
+	}
+}
+
+/* Separates items of a JSON array. */
+void out_separator(int *first) {
+	if (format == FORMAT_JSON && !*first) {
+		out_printf(",");
+	}
+	*first = 0;
+}
+
+/* SECTIONS */
+
+void dump_super() {
+	unsigned int g, groups = get_group_count(disk);
+	if (format == FORMAT_BINARY) {
+		out_record('S', sizeof(struct ext2_super_block), 0, 0);
+		out_bytes(sb, sizeof(struct ext2_super_block));
+		for (g = 0; g < groups; g++) {
+			out_record('G', sizeof(struct ext2_group_desc), 0, 0);
+			out_bytes(get_group_desc(disk, g), sizeof(struct ext2_group_desc));
+		}
+		return;
+	}
+	if (format == FORMAT_JSON) {
+		out_printf("\"super\": {\"inodes\": %u, \"blocks\": %u, \"free_blocks\": %u, "
+				"\"free_inodes\": %u, \"block_size\": %u, \"blocks_per_group\": %u, "
+				"\"inodes_per_group\": %u, \"inode_size\": %u}, \"groups\": [",
+				sb->s_inodes_count, sb->s_blocks_count, sb->s_free_blocks_count,
+				sb->s_free_inodes_count, bs, sb->s_blocks_per_group, sb->s_inodes_per_group,
+				sb->s_inode_size);
+	} else {
+		out_printf("Inodes: %d\n", sb->s_inodes_count);
+		out_printf("Blocks: %d\n", sb->s_blocks_count);
+	}
+	for (g = 0; g < groups; g++) {
+		struct ext2_group_desc *gd = get_group_desc(disk, g);
+		if (format == FORMAT_JSON) {
+			out_printf("%s{\"block_bitmap\": %u, \"inode_bitmap\": %u, \"inode_table\": %u, "
+					"\"free_blocks\": %u, \"free_inodes\": %u, \"used_dirs\": %u}", g ? ", " : "",
+					gd->bg_block_bitmap, gd->bg_inode_bitmap, gd->bg_inode_table,
+					gd->bg_free_blocks_count, gd->bg_free_inodes_count, gd->bg_used_dirs_count);
+			continue;
+		}
+		out_printf("Block group:\n");
+		out_printf("    block bitmap: %d\n", gd->bg_block_bitmap);
+		out_printf("    inode bitmap: %d\n", gd->bg_inode_bitmap);
+		out_printf("    inode table: %d\n", gd->bg_inode_table);
+		out_printf("    free blocks: %d\n", gd->bg_free_blocks_count);
+		out_printf("    free inodes: %d\n", gd->bg_free_inodes_count);
+		out_printf("    used_dirs: %d\n", gd->bg_used_dirs_count);
+	}
+	if (format == FORMAT_JSON) {
+		out_printf("]");
+	}
+}
+
+void dump_bitmaps() {
+	unsigned int g, groups = get_group_count(disk), written;
+	if (format == FORMAT_BINARY) {
+		for (g = 0; g < groups; g++) {
+			struct ext2_group_desc *gd = get_group_desc(disk, g);
+			out_record('b', (group_blocks(g) + 7) / 8, 1, g);
+			out_bytes(get_block(disk, gd->bg_block_bitmap), (group_blocks(g) + 7) / 8);
+			out_record('i', (sb->s_inodes_per_group + 7) / 8, 1, g);
+			out_bytes(get_block(disk, gd->bg_inode_bitmap), (sb->s_inodes_per_group + 7) / 8);
+		}
+		return;
+	}
+	out_printf(format == FORMAT_JSON ? "\"block_bitmap\": \"" : "Block bitmap: ");
+	for (g = 0, written = 0; g < groups; g++) {
+		out_bits(get_block(disk, get_group_desc(disk, g)->bg_block_bitmap), group_blocks(g), &written);
+	}
+	out_printf(format == FORMAT_JSON ? "\", \"inode_bitmap\": \"" : "\nInode bitmap: ");
+	for (g = 0, written = 0; g < groups; g++) {
+		out_bits(get_block(disk, get_group_desc(disk, g)->bg_inode_bitmap), sb->s_inodes_per_group,
+				&written);
+	}
+	out_printf(format == FORMAT_JSON ? "\"" : "\n");
+}
+
+/* Dumps the inode at index. */
+void dump_inode(unsigned int index, int *first) {
+	struct ext2_inode *ip = get_inode(disk, index);
+	int i;
+	if (format == FORMAT_BINARY) {
+		out_record('I', sb->s_inode_size, 1, index + 1);
+		out_bytes(ip, sb->s_inode_size);
+		return;
+	}
+	out_separator(first);
+	if (format == FORMAT_JSON) {
+		out_printf("{\"inode\": %u, \"type\": \"%c\", \"mode\": %u, \"size\": %u, \"links\": %u, "
+				"\"blocks\": %u, \"ctime\": %u, \"dtime\": %u, \"block\": [", index + 1,
+				get_inode_type(ip), ip->i_mode, ip->i_size, ip->i_links_count, ip->i_blocks,
+				ip->i_ctime, ip->i_dtime);
+	} else {
+		out_printf("[%d] type: %c size: %d links: %d blocks: %d\n[%d] Blocks:", index + 1,
+				get_inode_type(ip), ip->i_size, ip->i_links_count, ip->i_blocks, index + 1);
+	}
+	for (i = 0; i < 15 && !is_fast_symlink(ip) && ip->i_block[i] != 0; i++) {
+		if (format == FORMAT_JSON) {
+			out_printf(i ? ", %u" : "%u", ip->i_block[i]);
+		} else {
+			out_printf(" %d", ip->i_block[i]);
+		}
+	}
+	out_printf(format == FORMAT_JSON ? "]}" : "\n");
+}
+
+/* Dumps the entries of the directory at index, if it is one. */
+void dump_dir(unsigned int index, int *first) {
+	unsigned int cur_rec_len;
+	struct ext2_dir_entry *cur_dir;
+	unsigned int n, nblocks, block;
+	int first_entry = 1;
+	// Picked out through the summary, not every inode's table entry
+	if (!S_ISDIR(inode_summary(disk)->mode[index])) {
+		return;
+	}
+	struct ext2_inode *ip = get_inode(disk, index);
+	nblocks = dir_block_count(disk, ip);
+	if (format == FORMAT_TEXT) {
+		out_printf("   DIR BLOCK NUM: ");
+		for (n = 0; n < nblocks; n++) {
+			if ((block = file_block(disk, ip, n)) != 0) {
+				out_printf("%d ", block);
+			}
+		}
+		out_printf("(for inode %d)\n", index + 1);
+	} else if (format == FORMAT_JSON) {
+		out_separator(first);
+		out_printf("{\"inode\": %u, \"entries\": [", index + 1);
+	}
+	for (n = 0; n < nblocks; n++) {
+		if ((block = file_block(disk, ip, n)) == 0) {
+			continue;
+		}
+		unsigned char *data = get_block(disk, block);
+		for (cur_rec_len = 0; cur_rec_len < bs; cur_rec_len += cur_dir->rec_len) {
+			cur_dir = (struct ext2_dir_entry *)(data + cur_rec_len);
+			if (format == FORMAT_BINARY) {
+				out_record('D', sizeof(struct ext2_dir_entry) + cur_dir->name_len, 1, index + 1);
+				out_bytes(cur_dir, sizeof(struct ext2_dir_entry) + cur_dir->name_len);
+			} else if (format == FORMAT_JSON) {
+				out_separator(&first_entry);
+				out_printf("{\"inode\": %u, \"rec_len\": %u, \"name_len\": %u, \"type\": \"%c\", \"name\": ",
+						cur_dir->inode, cur_dir->rec_len, cur_dir->name_len,
+						get_dir_type(cur_dir->file_type));
+				out_json_string(cur_dir->name, cur_dir->name_len);
+				out_printf("}");
+			} else {
+				out_printf("Inode: %d rec_len: %d name_len: %d type= %c name=%.*s\n",
+						cur_dir->inode, cur_dir->rec_len, cur_dir->name_len,
+						get_dir_type(cur_dir->file_type), cur_dir->name_len, cur_dir->name);
+			}
+			if (cur_dir->rec_len == 0) {
+				break;
+			}
+		}
+	}
+	if (format == FORMAT_JSON) {
+		out_printf("]}");
+	}
+}
+
+/* MAIN */
+int main(int argc, char **argv) {
+	parse_common_flags(&argc, argv);
+	int want_super = 0, want_bitmaps = 0, want_dirs = 0;
+	unsigned int *picked = malloc(argc * sizeof(unsigned int));  // Inode indexes asked for
+	char **paths = malloc(argc * sizeof(char *));
+	int npicked = 0, npaths = 0, opt, i, bad = 0;
+	struct option options[] = {
+		{"super", no_argument, NULL, 's'},
+		{"bitmaps", no_argument, NULL, 'b'},
+		{"dirs", no_argument, NULL, 'd'},
+		{"inode", required_argument, NULL, 'i'},
+		{"path", required_argument, NULL, 'p'},
+		{"format", required_argument, NULL, 'f'},
+		{NULL, 0, NULL, 0}
+	};
+	while ((opt = getopt_long(argc, argv, "sbdi:p:f:", options, NULL)) != -1) {
+		switch (opt) {
+			case 's': want_super = 1; break;
+			case 'b': want_bitmaps = 1; break;
+			case 'd': want_dirs = 1; break;
+			case 'i': picked[npicked++] = atoi(optarg) - 1; break;
+			case 'p': paths[npaths++] = optarg; break;
+			case 'f':
+				if (strcmp(optarg, "json") == 0) format = FORMAT_JSON;
+				else if (strcmp(optarg, "binary") == 0) format = FORMAT_BINARY;
+				else if (strcmp(optarg, "text") == 0) format = FORMAT_TEXT;
+				else bad = 1;
+				break;
+			default: bad = 1;
+		}
+	}
+	if (bad || optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [--stats] [--trace file] [--super] [--bitmaps] [--dirs] "
+				"[--inode n] [--path p] [--format text|json|binary] [disk]\n", argv[0]);
+		exit(1);
+	}
+	int everything = !want_super && !want_bitmaps && !want_dirs && npicked == 0 && npaths == 0;
+	// Opening disk
+	int fd = open(argv[optind], O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "Disk image '%s' not found.\n", argv[optind]);
+		exit(ENOENT);
+	}
+	disk = map_disk(fd);
+	lock_image(0);
+	sb = get_super(disk);
+	bs = get_block_size(disk);
+	for (i = 0; i < npaths; i++) {
+		int index = lookup_path(disk, paths[i]);
+		if (index == -1) {
+			fprintf(stderr, "'%s' No such file or directory\n", paths[i]);
+			exit(ENOENT);
+		}
+		picked[npicked++] = index;
+	}
+	for (i = 0; i < npicked; i++) {
+		if (picked[i] >= sb->s_inodes_count) {
+			fprintf(stderr, "No inode %u.\n", picked[i] + 1);
+			exit(ENOENT);
+		}
+	}
+
+	out_buf = malloc(OUT_BUF_SIZE);
+	int first;
+	if (format == FORMAT_JSON) out_printf("{");
+	if (everything || want_super) {
+		dump_super();
+		if (format == FORMAT_JSON) out_printf(", ");
+	}
+	if (everything || want_bitmaps) {
+		dump_bitmaps();
+		if (format == FORMAT_JSON) out_printf(", ");
+	}
+	if (everything || npicked > 0) {
+		out_printf(format == FORMAT_JSON ? "\"inodes\": [" : format == FORMAT_TEXT ? "\nInodes:\n" : "");
+		first = 1;
+		if (everything) {
+			for_each_inode(dump_inode, &first);
+		}
+		for (i = 0; i < npicked; i++) {
+			dump_inode(picked[i], &first);
+		}
+		if (format == FORMAT_JSON) out_printf("], ");
+	}
+	if (everything || want_dirs || npicked > 0) {
+		out_printf(format == FORMAT_JSON ? "\"dirs\": [" : format == FORMAT_TEXT ? "\nDirectory Blocks:\n" : "");
+		first = 1;
+		if (everything || want_dirs) {
+			for_each_inode(dump_dir, &first);
+		}
+		for (i = 0; i < npicked; i++) {
+			dump_dir(picked[i], &first);
+		}
+		if (format == FORMAT_JSON) out_printf("]");
+	} else if (format == FORMAT_JSON) {
+		out_printf("\"dirs\": []");
+	}
+	if (format == FORMAT_JSON) out_printf("}\n");
+	out_flush();
+	return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Copies files with several threads on an image of several block groups and
+# checks that each file's blocks are contiguous and in one group: every
+# thread allocates from an arena of its own, so their files do not
+# interleave.
+# usage: tests/ext2_cp_arenas.sh [dir with the built tools]
+BIN=$(cd "${1:-.}" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+IMG=$TMP/disk.img
+mkdir "$TMP/in"
+i=1
+while [ $i -le 32 ]; do
+	head -c $((i * 1000 + 9000)) /dev/urandom > "$TMP/in/f$i"
+	i=$((i + 1))
+done
+
+# Four groups of 2048 blocks, the first starting at block 1
+"$BIN/ext2_mkfs" -g 4 "$IMG" 8M > /dev/null && "$BIN/ext2_mkdir" "$IMG" /d || exit 1
+"$BIN/ext2_cp" -j 4 "$IMG" "$TMP"/in/* /d || { echo "threaded copy failed"; exit 1; }
+
+"$BIN/readimage" "$IMG" | awk '
+	/type: f/ { file = 1; next }
+	file && /Blocks:/ {
+		for (i = 4; i <= NF; i++) {
+			if ($i != $(i - 1) + 1 || int(($i - 1) / 2048) != int(($3 - 1) / 2048)) {
+				print "inode " $1 " is split up:" substr($0, index($0, ":") + 1)
+				bad = 1
+				break
+			}
+		}
+	}
+	{ file = 0 }
+	END { exit bad }' || exit 1
+"$BIN/ext2_checker" "$IMG" | grep -q "^No file system inconsistencies detected!" ||
+	{ echo "image inconsistent after a threaded copy"; exit 1; }
+echo "ok: 32 files copied by 4 threads, each in one piece"
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Copies files into a directory with several threads, then checks with
+# ext2_checker that the superblock's and every group's free counters match
+# the bitmaps, and that each file reads back as it was.
+# usage: tests/ext2_cp_threads.sh [dir with the built tools]
+BIN=$(cd "${1:-.}" && pwd)
+TMP=$(mktemp -d)
+trap 'kill $DAEMON 2>/dev/null; rm -rf "$TMP"' EXIT
+IMG=$TMP/disk.img
+mkdir "$TMP/in"
+i=1
+while [ $i -le 48 ]; do
+	# Sizes from under a block to past the indirect block's reach
+	head -c $((i * i * 37 + i)) /dev/urandom > "$TMP/in/f$i"
+	i=$((i + 1))
+done
+: > "$TMP/in/empty"
+
+"$BIN/ext2_mkfs" -g 4 "$IMG" 8M > /dev/null && "$BIN/ext2_mkdir" "$IMG" /d || exit 1
+if ! "$BIN/ext2_cp" -j 4 "$IMG" "$TMP"/in/* /d; then
+	echo "threaded copy failed"
+	exit 1
+fi
+"$BIN/ext2_checker" "$IMG" > "$TMP/check"
+if ! grep -q "^No file system inconsistencies detected!" "$TMP/check"; then
+	echo "counters or bitmaps wrong after a threaded copy:"
+	cat "$TMP/check"
+	exit 1
+fi
+
+"$BIN/ext2d" -s "$TMP/sock" "$IMG" 2> "$TMP/log" &
+DAEMON=$!
+i=0
+while [ ! -S "$TMP/sock" ] && [ $i -lt 50 ]; do
+	sleep 0.1
+	i=$((i + 1))
+done
+for f in "$TMP"/in/*; do
+	if ! "$BIN/ext2c" -s "$TMP/sock" read "$IMG" "/d/${f##*/}" | cmp -s - "$f"; then
+		echo "/d/${f##*/} does not read back as copied"
+		exit 1
+	fi
+done
+echo "ok: 49 files copied by 4 threads, counters match the bitmaps"
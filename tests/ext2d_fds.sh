@@ -0,0 +1,39 @@
+#!/bin/sh
+# Checks that requests ext2d fails do not leave descriptors open in the
+# daemon: its fd count must be the same after 50 of them as before.
+# usage: tests/ext2d_fds.sh [dir with the built tools]
+BIN=$(cd "${1:-.}" && pwd)
+TMP=$(mktemp -d)
+trap 'kill $DAEMON 2>/dev/null; rm -rf "$TMP"' EXIT
+IMG=$TMP/disk.img
+echo hello > "$TMP/file"
+
+"$BIN/ext2_mkfs" "$IMG" 256 > /dev/null || exit 1
+"$BIN/ext2d" "$IMG" 2> "$TMP/log" &
+DAEMON=$!
+i=0
+while [ ! -S "$IMG.sock" ] && [ $i -lt 50 ]; do
+	sleep 0.1
+	i=$((i + 1))
+done
+"$BIN/ext2c" mkdir "$IMG" /d > /dev/null 2>&1 &&
+	"$BIN/ext2c" cp "$IMG" "$TMP/file" /d/f > /dev/null 2>&1 || { echo "setup failed"; exit 1; }
+
+before=$(ls /proc/$DAEMON/fd | wc -l)
+i=0
+while [ $i -lt 10 ]; do
+	# Each of these fails after the tool has opened or allocated something
+	"$BIN/ext2c" cp "$IMG" "$TMP/file" /d/f > /dev/null 2>&1 && { echo "cp over a file succeeded"; exit 1; }
+	"$BIN/ext2c" cp "$IMG" "$TMP/file" /missing/f > /dev/null 2>&1 && { echo "cp into a missing dir succeeded"; exit 1; }
+	"$BIN/ext2c" mkdir "$IMG" /d > /dev/null 2>&1 && { echo "mkdir of an existing dir succeeded"; exit 1; }
+	"$BIN/ext2c" rm "$IMG" /d/missing > /dev/null 2>&1 && { echo "rm of a missing file succeeded"; exit 1; }
+	"$BIN/ext2c" ln "$IMG" /d/f /d/f > /dev/null 2>&1 && { echo "ln over a file succeeded"; exit 1; }
+	i=$((i + 1))
+done
+after=$(ls /proc/$DAEMON/fd | wc -l)
+
+if [ "$before" -ne "$after" ]; then
+	echo "ext2d had $before fds open before 50 failing requests, $after after"
+	exit 1
+fi
+echo "ok: ext2d kept $before fds open across 50 failing requests"
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Checks that ext2d refuses requests naming an image other than the one it
+# serves, and keeps serving its own afterwards.
+# usage: tests/ext2d_foreign.sh [dir with the built tools]
+BIN=$(cd "${1:-.}" && pwd)
+TMP=$(mktemp -d)
+trap 'kill $DAEMON 2>/dev/null; rm -rf "$TMP"' EXIT
+
+"$BIN/ext2_mkfs" "$TMP/served.img" 256 > /dev/null && "$BIN/ext2_mkfs" "$TMP/other.img" 256 > /dev/null || exit 1
+cp "$TMP/other.img" "$TMP/other.orig"
+"$BIN/ext2d" -s "$TMP/sock" "$TMP/served.img" 2> "$TMP/log" &
+DAEMON=$!
+i=0
+while [ ! -S "$TMP/sock" ] && [ $i -lt 50 ]; do
+	sleep 0.1
+	i=$((i + 1))
+done
+
+if "$BIN/ext2c" -s "$TMP/sock" mkdir "$TMP/other.img" /x > /dev/null 2>&1; then
+	echo "mkdir on another image succeeded"
+	exit 1
+fi
+if ! cmp -s "$TMP/other.img" "$TMP/other.orig"; then
+	echo "another image was written"
+	exit 1
+fi
+if ! "$BIN/ext2c" -s "$TMP/sock" mkdir "$TMP/served.img" /x > /dev/null 2>&1 ||
+		! "$BIN/ext2c" -s "$TMP/sock" stat "$TMP/served.img" /x > /dev/null 2>&1; then
+	echo "served image not usable after a refused request"
+	exit 1
+fi
+echo "ok: ext2d refused another image"